@@ -36,6 +36,7 @@ static int wsa_init = 0;
 #else
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -291,6 +292,56 @@ int socket_connect(const char *addr, uint16_t port)
 	return sfd;
 }
 
+#ifndef WIN32
+/* poll() has no limit on the value of fd, select() breaks once fd reaches
+ * FD_SETSIZE, which happens in long running processes that open many files. */
+int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
+{
+	struct pollfd pfd;
+	int sret;
+
+	if (fd < 0) {
+		if (verbose >= 2)
+			fprintf(stderr, "ERROR: invalid fd in check_fd %d\n", fd);
+		return -1;
+	}
+
+	pfd.fd = fd;
+	pfd.revents = 0;
+
+	switch (fdm) {
+	case FDM_READ:
+		pfd.events = POLLIN;
+		break;
+	case FDM_WRITE:
+		pfd.events = POLLOUT;
+		break;
+	case FDM_EXCEPT:
+		pfd.events = POLLPRI;
+		break;
+	default:
+		return -1;
+	}
+
+	do {
+		sret = poll(&pfd, 1, timeout > 0 ? (int)timeout : -1);
+	} while (sret < 0 && errno == EINTR);
+
+	if (sret < 0) {
+		if (errno == EAGAIN) {
+			if (verbose >= 2)
+				fprintf(stderr, "%s: EAGAIN\n", __func__);
+		} else {
+			if (verbose >= 2)
+				fprintf(stderr, "%s: poll failed: %s\n", __func__,
+						strerror(errno));
+			return -1;
+		}
+	}
+
+	return sret;
+}
+#else
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 {
 	fd_set fds;
@@ -357,6 +408,7 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 
 	return sret;
 }
+#endif
 
 int socket_accept(int fd, uint16_t port)
 {
@@ -431,6 +483,54 @@ int socket_receive_timeout(int fd, void *data, size_t length, int flags,
 	return result;
 }
 
+int socket_receive_nonblocking(int fd, void *data, size_t length)
+{
+	int result;
+
+#ifdef WIN32
+	u_long available = 0;
+	if (ioctlsocket(fd, FIONREAD, &available) != 0) {
+		return -WSAGetLastError();
+	}
+	if (available == 0) {
+		return -EAGAIN;
+	}
+	result = recv(fd, data, length, 0);
+	if (result < 0) {
+		return -WSAGetLastError();
+	}
+#else
+	result = recv(fd, data, length, MSG_DONTWAIT);
+	if (result < 0) {
+		return (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+	}
+#endif
+	if (result == 0) {
+		/* the other end closed the connection */
+		return -ECONNRESET;
+	}
+	return result;
+}
+
+int socket_set_receive_buffer_size(int fd, int size)
+{
+	int actual = 0;
+#ifdef WIN32
+	int len = sizeof(actual);
+#else
+	socklen_t len = sizeof(actual);
+#endif
+
+	/* the kernel may clamp (or, on Linux, double) the requested size */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&size, sizeof(int)) == -1) {
+		perror("setsockopt()");
+	}
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&actual, &len) == -1) {
+		return -1;
+	}
+	return actual;
+}
+
 int socket_send(int fd, void *data, size_t length)
 {
 	int flags = 0;
@@ -57,6 +57,8 @@ int socket_receive(int fd, void *data, size_t size);
 int socket_peek(int fd, void *data, size_t size);
 int socket_receive_timeout(int fd, void *data, size_t size, int flags,
 					 unsigned int timeout);
+int socket_receive_nonblocking(int fd, void *data, size_t size);
+int socket_set_receive_buffer_size(int fd, int size);
 
 int socket_send(int fd, void *data, size_t size);
 
@@ -87,6 +87,18 @@ typedef struct {
  */
 typedef void (*usbmuxd_event_cb_t) (const usbmuxd_event_t *event, void *user_data);
 
+/**
+ * A connection to usbmuxd that device events are received on, see
+ * usbmuxd_events_open().
+ */
+typedef struct usbmuxd_events_private *usbmuxd_events_t;
+
+/**
+ * A request for usbmuxd to connect to a port on a device, see
+ * usbmuxd_connect_start().
+ */
+typedef struct usbmuxd_connect_private *usbmuxd_connect_t;
+
 /**
  * Sets the socket type (Unix socket or TCP socket) libusbmuxd should use when connecting
  * to usbmuxd.
@@ -147,6 +159,39 @@ USBMUXD_API_MSC int usbmuxd_subscribe(usbmuxd_event_cb_t callback, void *user_da
  */
 USBMUXD_API_MSC int usbmuxd_unsubscribe();
 
+/**
+ * Opens a connection to usbmuxd that device events are sent on, for
+ * applications that wait for them in their own event loop instead of the
+ * thread started by usbmuxd_subscribe(). Each connection keeps its own
+ * device list, so there can be several of them at once.
+ *
+ * Wait for the socket returned by usbmuxd_events_get_fd() to become readable,
+ * then call usbmuxd_events_process().
+ *
+ * @return The connection, or NULL if usbmuxd couldn't be reached.
+ */
+USBMUXD_API_MSC usbmuxd_events_t usbmuxd_events_open();
+
+/**
+ * @return The socket of the connection, to wait on for it to become readable.
+ */
+USBMUXD_API_MSC int usbmuxd_events_get_fd(usbmuxd_events_t events);
+
+/**
+ * Reads the next event from the connection and passes it to callback. Only
+ * call this when the socket is readable, otherwise it blocks.
+ *
+ * @return 0 on success, or negative if the connection to usbmuxd failed, in
+ *     which case remove events have been generated for every device and
+ *     the connection should be closed.
+ */
+USBMUXD_API_MSC int usbmuxd_events_process(usbmuxd_events_t events, usbmuxd_event_cb_t callback, void *user_data);
+
+/**
+ * Closes the connection and frees its device list.
+ */
+USBMUXD_API_MSC void usbmuxd_events_close(usbmuxd_events_t events);
+
 /**
  * Contacts usbmuxd and retrieves a list of connected devices.
  *
@@ -194,6 +239,39 @@ USBMUXD_API_MSC int usbmuxd_get_device_by_udid(const char *udid, usbmuxd_device_
  */
 USBMUXD_API_MSC int usbmuxd_connect(const int handle, const unsigned short tcp_port);
 
+/**
+ * Sends the same request as usbmuxd_connect(), but returns without waiting
+ * for the answer, for applications that wait in their own event loop.
+ *
+ * Wait for the socket returned by usbmuxd_connect_get_fd() to become
+ * readable, then call usbmuxd_connect_finish().
+ *
+ * @return The request, or NULL if usbmuxd couldn't be reached.
+ */
+USBMUXD_API_MSC usbmuxd_connect_t usbmuxd_connect_start(const int handle, const unsigned short tcp_port);
+
+/**
+ * @return The socket of the request, to wait on for it to become readable.
+ */
+USBMUXD_API_MSC int usbmuxd_connect_get_fd(usbmuxd_connect_t conn);
+
+/**
+ * Reads usbmuxd's answer. Only call this when the socket is readable,
+ * otherwise it blocks.
+ *
+ * @return file descriptor socket of the connection, which then belongs to
+ *     the caller, -EAGAIN if the request had to be sent again (wait on the
+ *     socket from usbmuxd_connect_get_fd() again, it will have changed),
+ *     or another negative value if the connection failed.
+ */
+USBMUXD_API_MSC int usbmuxd_connect_finish(usbmuxd_connect_t conn);
+
+/**
+ * Frees the request, closing its socket unless usbmuxd_connect_finish()
+ * handed it over. A request can be closed before it has finished.
+ */
+USBMUXD_API_MSC void usbmuxd_connect_close(usbmuxd_connect_t conn);
+
 /**
  * Disconnect. For now, this just closes the socket file descriptor.
  *
@@ -240,6 +318,33 @@ USBMUXD_API_MSC int usbmuxd_recv_timeout(int sfd, char *data, uint32_t len, uint
  */
 USBMUXD_API_MSC int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_bytes);
 
+/**
+ * Receive whatever data is available on the specified socket without
+ * waiting for more, e.g. once an event loop has found it to be readable.
+ *
+ * @param sfd socket file descriptor returned by usbmuxd_connect()
+ * @param data buffer to put the data to
+ * @param len maximum number of bytes to receive
+ * @param recv_bytes number of bytes received, 0 if there was nothing to read
+ *
+ * @return 0 on success, a negative errno value otherwise. -ECONNRESET means
+ *     that the device closed the connection.
+ */
+USBMUXD_API_MSC int usbmuxd_recv_nonblocking(int sfd, char *data, uint32_t len, uint32_t *recv_bytes);
+
+/**
+ * Asks the kernel for a larger receive buffer on the specified socket, so
+ * that more data is waiting (and can be read at once) when a reader falls
+ * behind.
+ *
+ * @param sfd socket file descriptor returned by usbmuxd_connect()
+ * @param size the requested size in bytes
+ *
+ * @return the size of the receive buffer, which may differ from the
+ *     requested size, or negative on error.
+ */
+USBMUXD_API_MSC int usbmuxd_set_receive_buffer_size(int sfd, int size);
+
 /**
  * Reads the SystemBUID
  *
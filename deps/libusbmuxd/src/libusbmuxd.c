@@ -109,14 +109,35 @@ static int listenfd = -1;
 static volatile int use_tag = 0;
 static volatile int proto_version = 1;
 static volatile int try_list_devices = 1;
+/* binary plists are quicker to write and parse, but daemons that only read
+ * XML drop the connection when they get one. Which kind the daemon reads is
+ * only known once it has answered, or hung up on, the first binary request,
+ * and is forgotten when it goes away, as it may come back as another version. */
+enum plist_format {
+	PLIST_FORMAT_UNKNOWN = 0,
+	PLIST_FORMAT_BINARY,
+	PLIST_FORMAT_XML
+};
+static volatile int plist_format = PLIST_FORMAT_UNKNOWN;
+
+/**
+ * Forgets which plist format the daemon reads, as it has gone away.
+ */
+static void plist_format_reset()
+{
+	if (plist_format != PLIST_FORMAT_UNKNOWN) {
+		DEBUG(2, "%s: usbmuxd went away, trying binary plists again\n", __func__);
+	}
+	plist_format = PLIST_FORMAT_UNKNOWN;
+}
 
 /**
  * Finds a device info record by its handle.
  * if the record is not found, NULL is returned.
  */
-static usbmuxd_device_info_t *devices_find(uint32_t handle)
+static usbmuxd_device_info_t *devices_find(struct collection *devices, uint32_t handle)
 {
-	FOREACH(usbmuxd_device_info_t *dev, &devices) {
+	FOREACH(usbmuxd_device_info_t *dev, devices) {
 		if (dev && dev->handle == handle) {
 			return dev;
 		}
@@ -129,8 +150,32 @@ static usbmuxd_device_info_t *devices_find(uint32_t handle)
  * For Mac/Linux it is a unix domain socket,
  * for Windows it is a tcp socket.
  */
-static int connect_usbmuxd_socket()
+static int open_usbmuxd_socket()
 {
+	/* USBMUXD_SOCKET_ADDRESS overrides the default, either as UNIX:<path>
+	 * or <host>:<port>, e.g. to talk to a usbmuxd emulator */
+	char *address = getenv("USBMUXD_SOCKET_ADDRESS");
+	if (address && *address) {
+		char *separator;
+		if (strncmp(address, "UNIX:", 5) == 0) {
+#if defined(WIN32) || defined(__CYGWIN__)
+			DEBUG(1, "%s: unix sockets are not supported, ignoring USBMUXD_SOCKET_ADDRESS\n", __func__);
+#else
+			return socket_connect_unix(address + 5);
+#endif
+		} else if ((separator = strrchr(address, ':')) != NULL) {
+			char host[256];
+			long port = strtol(separator + 1, NULL, 10);
+			size_t host_len = separator - address;
+			if (port > 0 && port < 65536 && host_len > 0 && host_len < sizeof(host)) {
+				memcpy(host, address, host_len);
+				host[host_len] = '\0';
+				return socket_connect(host, (uint16_t)port);
+			}
+			DEBUG(1, "%s: invalid USBMUXD_SOCKET_ADDRESS '%s'\n", __func__, address);
+		}
+	}
+
 #if defined(WIN32) || defined(__CYGWIN__)
 	return socket_connect(tcp_host, tcp_port);
 #else
@@ -142,6 +187,16 @@ static int connect_usbmuxd_socket()
 #endif
 }
 
+static int connect_usbmuxd_socket()
+{
+	int sfd = open_usbmuxd_socket();
+	if (sfd < 0) {
+		/* whichever daemon answers next may be a different one */
+		plist_format_reset();
+	}
+	return sfd;
+}
+
 static struct usbmuxd_device_record* device_record_from_plist(plist_t props)
 {
 	struct usbmuxd_device_record* dev = NULL;
@@ -239,7 +294,8 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 	if (hdr.message == MESSAGE_PLIST) {
 		char *message = NULL;
 		plist_t plist = NULL;
-		plist_from_xml(payload_loc, payload_size, &plist);
+		/* replies may come back in either format */
+		plist_from_memory(payload_loc, payload_size, &plist);
 		free(payload_loc);
 
 		if (!plist) {
@@ -427,13 +483,59 @@ static int send_plist_packet(int sfd, uint32_t tag, plist_t message)
 	char *payload = NULL;
 	uint32_t payload_size = 0;
 
-	plist_to_xml(message, &payload, &payload_size);
+	if (plist_format != PLIST_FORMAT_XML) {
+		plist_to_bin(message, &payload, &payload_size);
+	} else {
+		plist_to_xml(message, &payload, &payload_size);
+	}
 	res = send_packet(sfd, MESSAGE_PLIST, tag, payload, payload_size);
 	free(payload);
 
 	return res;
 }
 
+/**
+ * Whether usbmuxd_get_result() failed because the daemon closed the
+ * connection, rather than timing out or sending something unexpected.
+ */
+static int result_was_hang_up(int get_result_ret)
+{
+#ifdef WIN32
+	if (get_result_ret == -WSAECONNRESET) {
+		return 1;
+	}
+#endif
+	/* socket_receive_timeout() gives -EAGAIN when recv() finds the end of the stream */
+	return get_result_ret == -EAGAIN || get_result_ret == -ECONNRESET;
+}
+
+/**
+ * Checks whether a plist request failed because usbmuxd couldn't read a
+ * binary plist, which it shows by closing the connection without a result
+ * to the first one it is sent. If so, XML is used until the daemon goes
+ * away and the request should be sent again. Any answer to a binary
+ * request settles it the other way, so later failures never fall back.
+ */
+static int plist_fall_back_to_xml(int get_result_ret)
+{
+	if (plist_format != PLIST_FORMAT_UNKNOWN || proto_version != 1) {
+		return 0;
+	}
+
+	if (get_result_ret >= 0) {
+		plist_format = PLIST_FORMAT_BINARY;
+		return 0;
+	}
+
+	if (!result_was_hang_up(get_result_ret)) {
+		return 0;
+	}
+
+	DEBUG(1, "%s: usbmuxd did not answer a binary plist, using XML instead\n", __func__);
+	plist_format = PLIST_FORMAT_XML;
+	return 1;
+}
+
 static plist_t create_plist_message(const char* message_type)
 {
 	plist_t plist = plist_new_dict();
@@ -648,6 +750,7 @@ static int usbmuxd_listen()
 	int sfd;
 	uint32_t res = -1;
 	int tag;
+	int ret;
 
 retry:
 
@@ -675,7 +778,12 @@ retry:
 		socket_close(sfd);
 		return -1;
 	}
-	if ((usbmuxd_get_result(sfd, tag, &res, NULL) == 1) && (res != 0)) {
+	ret = usbmuxd_get_result(sfd, tag, &res, NULL);
+	if (plist_fall_back_to_xml(ret)) {
+		socket_close(sfd);
+		goto retry;
+	}
+	if ((ret == 1) && (res != 0)) {
 		socket_close(sfd);
 		if ((res == RESULT_BADVERSION) && (proto_version == 1)) {
 			proto_version = 0;
@@ -691,7 +799,7 @@ retry:
  * Waits for an event to occur, i.e. a packet coming from usbmuxd.
  * Calls generate_event to pass the event via callback to the client program.
  */
-static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
+static int get_next_event(int sfd, struct collection *devices, usbmuxd_event_cb_t callback, void *user_data)
 {
 	struct usbmuxd_header hdr;
 	void *payload = NULL;
@@ -699,12 +807,13 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
 	/* block until we receive something */
 	if (receive_packet(sfd, &hdr, &payload, 0) < 0) {
 		DEBUG(1, "%s: Error in usbmuxd connection, disconnecting all devices!\n", __func__);
+		plist_format_reset();
 		// when then usbmuxd connection fails,
 		// generate remove events for every device that
 		// is still present so applications know about it
-		FOREACH(usbmuxd_device_info_t *dev, &devices) {
+		FOREACH(usbmuxd_device_info_t *dev, devices) {
 			generate_event(callback, dev, UE_DEVICE_REMOVE, user_data);
-			collection_remove(&devices, dev);
+			collection_remove(devices, dev);
 			free(dev);
 		} ENDFOREACH
 		return -EIO;
@@ -738,7 +847,7 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
         
         devinfo->connection_speed = dev->connection_speed;
         
-		collection_add(&devices, devinfo);
+		collection_add(devices, devinfo);
 		generate_event(callback, devinfo, UE_DEVICE_ADD, user_data);
 	} else if (hdr.message == MESSAGE_DEVICE_REMOVE) {
 		uint32_t handle;
@@ -746,12 +855,12 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
 
 		memcpy(&handle, payload, sizeof(uint32_t));
 
-		devinfo = devices_find(handle);
+		devinfo = devices_find(devices, handle);
 		if (!devinfo) {
 			DEBUG(1, "%s: WARNING: got device remove message for handle %d, but couldn't find the corresponding handle in the device list. This event will be ignored.\n", __func__, handle);
 		} else {
 			generate_event(callback, devinfo, UE_DEVICE_REMOVE, user_data);
-			collection_remove(&devices, devinfo);
+			collection_remove(devices, devinfo);
 			free(devinfo);
 		}
 	} else if (hdr.message == MESSAGE_DEVICE_PAIRED) {
@@ -760,7 +869,7 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
 
 		memcpy(&handle, payload, sizeof(uint32_t));
 
-		devinfo = devices_find(handle);
+		devinfo = devices_find(devices, handle);
 		if (!devinfo) {
 			DEBUG(1, "%s: WARNING: got paired message for device handle %d, but couldn't find the corresponding handle in the device list. This event will be ignored.\n", __func__, handle);
 		} else {
@@ -805,7 +914,7 @@ static void *device_monitor(void *data)
 		}
 
 		while (event_cb) {
-			int res = get_next_event(listenfd, event_cb, data);
+			int res = get_next_event(listenfd, &devices, event_cb, data);
 			if (res < 0) {
 			    break;
 			}
@@ -883,6 +992,90 @@ USBMUXD_API int usbmuxd_unsubscribe()
 	return 0;
 }
 
+struct usbmuxd_events_private {
+	int sfd;
+	struct collection devices;
+};
+
+USBMUXD_API usbmuxd_events_t usbmuxd_events_open()
+{
+	int sfd;
+	uint32_t res = -1;
+	int tag;
+	int ret;
+	usbmuxd_events_t events;
+
+retry:
+	/* unlike usbmuxd_listen() this doesn't wait for usbmuxd to start,
+	 * the caller is expected to try again later */
+	sfd = connect_usbmuxd_socket();
+	if (sfd < 0) {
+		return NULL;
+	}
+
+	tag = ++use_tag;
+	if (send_listen_packet(sfd, tag) <= 0) {
+		DEBUG(1, "%s: ERROR: could not send listen packet\n", __func__);
+		socket_close(sfd);
+		return NULL;
+	}
+	ret = usbmuxd_get_result(sfd, tag, &res, NULL);
+	if (plist_fall_back_to_xml(ret)) {
+		socket_close(sfd);
+		goto retry;
+	}
+	if ((ret == 1) && (res != 0)) {
+		socket_close(sfd);
+		if ((res == RESULT_BADVERSION) && (proto_version == 1)) {
+			proto_version = 0;
+			goto retry;
+		}
+		DEBUG(1, "%s: ERROR: did not get OK but %d\n", __func__, res);
+		return NULL;
+	}
+
+	events = (usbmuxd_events_t)malloc(sizeof(struct usbmuxd_events_private));
+	if (!events) {
+		socket_close(sfd);
+		return NULL;
+	}
+
+	events->sfd = sfd;
+	collection_init(&events->devices);
+
+	return events;
+}
+
+USBMUXD_API int usbmuxd_events_get_fd(usbmuxd_events_t events)
+{
+	return events ? events->sfd : -1;
+}
+
+USBMUXD_API int usbmuxd_events_process(usbmuxd_events_t events, usbmuxd_event_cb_t callback, void *user_data)
+{
+	if (!events || !callback) {
+		return -EINVAL;
+	}
+
+	return get_next_event(events->sfd, &events->devices, callback, user_data);
+}
+
+USBMUXD_API void usbmuxd_events_close(usbmuxd_events_t events)
+{
+	if (!events) {
+		return;
+	}
+
+	FOREACH(usbmuxd_device_info_t *dev, &events->devices) {
+		collection_remove(&events->devices, dev);
+		free(dev);
+	} ENDFOREACH
+	collection_free(&events->devices);
+
+	socket_close(events->sfd);
+	free(events);
+}
+
 static usbmuxd_device_info_t *device_info_from_device_record(struct usbmuxd_device_record *dev)
 {
 	if (!dev) {
@@ -915,6 +1108,7 @@ USBMUXD_API int usbmuxd_get_device_list(usbmuxd_device_info_t **device_list)
 {
 	int sfd;
 	int tag;
+	int ret;
 	int listen_success = 0;
 	uint32_t res;
 	struct collection tmpdevs;
@@ -937,7 +1131,12 @@ retry:
 	if ((proto_version == 1) && (try_list_devices)) {
 		if (send_list_devices_packet(sfd, tag) > 0) {
 			plist_t list = NULL;
-			if ((usbmuxd_get_result(sfd, tag, &res, &list) == 1) && (res == 0)) {
+			ret = usbmuxd_get_result(sfd, tag, &res, &list);
+			if (plist_fall_back_to_xml(ret)) {
+				socket_close(sfd);
+				goto retry;
+			}
+			if ((ret == 1) && (res == 0)) {
 				plist_t devlist = plist_dict_get_item(list, "DeviceList");
 				if (devlist && plist_get_node_type(devlist) == PLIST_ARRAY) {
 					collection_init(&tmpdevs);
@@ -977,10 +1176,14 @@ retry:
 	if (send_listen_packet(sfd, tag) > 0) {
 		res = -1;
 		// get response
-		if ((usbmuxd_get_result(sfd, tag, &res, NULL) == 1) && (res == 0)) {
+		ret = usbmuxd_get_result(sfd, tag, &res, NULL);
+		if ((ret == 1) && (res == 0)) {
 			listen_success = 1;
 		} else {
 			socket_close(sfd);
+			if (plist_fall_back_to_xml(ret)) {
+				goto retry;
+			}
 			if ((res == RESULT_BADVERSION) && (proto_version == 1)) {
 				proto_version = 0;
 				goto retry;
@@ -1111,6 +1314,7 @@ USBMUXD_API int usbmuxd_connect(const int handle, const unsigned short port)
 {
 	int sfd;
 	int tag;
+	int ret;
 	int connected = 0;
 	uint32_t res = -1;
 
@@ -1128,7 +1332,12 @@ retry:
 	} else {
 		// read ACK
 		DEBUG(2, "%s: Reading connect result...\n", __func__);
-		if (usbmuxd_get_result(sfd, tag, &res, NULL) == 1) {
+		ret = usbmuxd_get_result(sfd, tag, &res, NULL);
+		if (plist_fall_back_to_xml(ret)) {
+			socket_close(sfd);
+			goto retry;
+		}
+		if (ret == 1) {
 			if (res == 0) {
 				DEBUG(2, "%s: Connect success!\n", __func__);
 				connected = 1;
@@ -1152,6 +1361,107 @@ retry:
 	return -1;
 }
 
+struct usbmuxd_connect_private {
+	int sfd;
+	int tag;
+	uint32_t handle;
+	uint16_t port;
+};
+
+static int connect_send_request(usbmuxd_connect_t conn)
+{
+	conn->sfd = connect_usbmuxd_socket();
+	if (conn->sfd < 0) {
+		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
+				__func__, strerror(errno));
+		return conn->sfd;
+	}
+
+	conn->tag = ++use_tag;
+	if (send_connect_packet(conn->sfd, conn->tag, conn->handle, conn->port) <= 0) {
+		DEBUG(1, "%s: Error sending connect message!\n", __func__);
+		socket_close(conn->sfd);
+		conn->sfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+USBMUXD_API usbmuxd_connect_t usbmuxd_connect_start(const int handle, const unsigned short port)
+{
+	usbmuxd_connect_t conn;
+
+	conn = (usbmuxd_connect_t)malloc(sizeof(struct usbmuxd_connect_private));
+	if (!conn) {
+		return NULL;
+	}
+
+	conn->handle = (uint32_t)handle;
+	conn->port = (uint16_t)port;
+
+	if (connect_send_request(conn) < 0) {
+		free(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+USBMUXD_API int usbmuxd_connect_get_fd(usbmuxd_connect_t conn)
+{
+	return conn->sfd;
+}
+
+USBMUXD_API int usbmuxd_connect_finish(usbmuxd_connect_t conn)
+{
+	int sfd;
+	int ret;
+	uint32_t res = -1;
+
+	if (conn->sfd < 0) {
+		return -EINVAL;
+	}
+
+	DEBUG(2, "%s: Reading connect result...\n", __func__);
+	ret = usbmuxd_get_result(conn->sfd, conn->tag, &res, NULL);
+	if (ret == 1 && res == 0) {
+		DEBUG(2, "%s: Connect success!\n", __func__);
+		sfd = conn->sfd;
+		conn->sfd = -1;
+		return sfd;
+	}
+
+	socket_close(conn->sfd);
+	conn->sfd = -1;
+
+	if (plist_fall_back_to_xml(ret)) {
+		return connect_send_request(conn) < 0 ? -1 : -EAGAIN;
+	}
+
+	if (ret == 1) {
+		if ((res == RESULT_BADVERSION) && (proto_version == 1)) {
+			proto_version = 0;
+			return connect_send_request(conn) < 0 ? -1 : -EAGAIN;
+		}
+		DEBUG(1, "%s: Connect failed, Error code=%d\n", __func__, res);
+	}
+
+	return -1;
+}
+
+USBMUXD_API void usbmuxd_connect_close(usbmuxd_connect_t conn)
+{
+	if (!conn) {
+		return;
+	}
+
+	if (conn->sfd >= 0) {
+		socket_close(conn->sfd);
+	}
+	free(conn);
+}
+
 USBMUXD_API int usbmuxd_disconnect(int sfd)
 {
 	return socket_close(sfd);
@@ -1198,6 +1508,29 @@ USBMUXD_API int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_b
 	return usbmuxd_recv_timeout(sfd, data, len, recv_bytes, 5000);
 }
 
+USBMUXD_API int usbmuxd_recv_nonblocking(int sfd, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	int num_recv = socket_receive_nonblocking(sfd, (void*)data, len);
+
+	*recv_bytes = 0;
+
+	if (num_recv == -EAGAIN) {
+		return 0;
+	}
+	if (num_recv < 0) {
+		return num_recv;
+	}
+
+	*recv_bytes = num_recv;
+
+	return 0;
+}
+
+USBMUXD_API int usbmuxd_set_receive_buffer_size(int sfd, int size)
+{
+	return socket_set_receive_buffer_size(sfd, size);
+}
+
 USBMUXD_API int usbmuxd_read_buid(char **buid)
 {
 	int sfd;
@@ -1209,6 +1542,7 @@ USBMUXD_API int usbmuxd_read_buid(char **buid)
 	}
 	*buid = NULL;
 
+retry:
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n", __func__, strerror(errno));
@@ -1223,6 +1557,10 @@ USBMUXD_API int usbmuxd_read_buid(char **buid)
 		uint32_t rc = 0;
 		plist_t pl = NULL;
 		ret = usbmuxd_get_result(sfd, tag, &rc, &pl);
+		if (plist_fall_back_to_xml(ret)) {
+			socket_close(sfd);
+			goto retry;
+		}
 		if ((ret == 1) && (rc == 0)) {
 			plist_t node = plist_dict_get_item(pl, "BUID");
 			if (node && plist_get_node_type(node) == PLIST_STRING) {
@@ -1251,6 +1589,7 @@ USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_da
 	*record_data = NULL;
 	*record_size = 0;
 
+retry:
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
@@ -1267,6 +1606,10 @@ USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_da
 		uint32_t rc = 0;
 		plist_t pl = NULL;
 		ret = usbmuxd_get_result(sfd, tag, &rc, &pl);
+		if (plist_fall_back_to_xml(ret)) {
+			socket_close(sfd);
+			goto retry;
+		}
 		if ((ret == 1) && (rc == 0)) {
 			plist_t node = plist_dict_get_item(pl, "PairRecordData");
 			if (node && plist_get_node_type(node) == PLIST_DATA) {
@@ -1297,6 +1640,7 @@ USBMUXD_API int usbmuxd_save_pair_record(const char* record_id, const char *reco
 		return -EINVAL;
 	}
 
+retry:
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
@@ -1313,6 +1657,11 @@ USBMUXD_API int usbmuxd_save_pair_record(const char* record_id, const char *reco
 	} else {
 		uint32_t rc = 0;
 		ret = usbmuxd_get_result(sfd, tag, &rc, NULL);
+		if (plist_fall_back_to_xml(ret)) {
+			plist_free(data);
+			socket_close(sfd);
+			goto retry;
+		}
 		if ((ret == 1) && (rc == 0)) {
 			ret = 0;
 		} else if (ret == 1) {
@@ -1336,6 +1685,7 @@ USBMUXD_API int usbmuxd_delete_pair_record(const char* record_id)
 		return -EINVAL;
 	}
 
+retry:
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
@@ -1351,6 +1701,10 @@ USBMUXD_API int usbmuxd_delete_pair_record(const char* record_id)
 	} else {
 		uint32_t rc = 0;
 		ret = usbmuxd_get_result(sfd, tag, &rc, NULL);
+		if (plist_fall_back_to_xml(ret)) {
+			socket_close(sfd);
+			goto retry;
+		}
 		if ((ret == 1) && (rc == 0)) {
 			ret = 0;
 		} else if (ret == 1) {
@@ -0,0 +1,628 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "Capture.hpp"
+#include "Portal.hpp"
+#include "Protocol.hpp"
+#include "ThreadConfig.hpp"
+
+namespace portal
+{
+
+    // A looping replay leaves this much between the last timestamp of one
+    // pass and the first of the next, about a frame at 60 fps.
+    static const uint64_t LoopGap = 16666667;
+
+    static void writeUInt32BigEndian(char *data, uint32_t value)
+    {
+        for (int i = 3; i >= 0; i--) {
+            data[i] = (char)(value & 0xFF);
+            value >>= 8;
+        }
+    }
+
+    static void writeUInt64BigEndian(char *data, uint64_t value)
+    {
+        for (int i = 7; i >= 0; i--) {
+            data[i] = (char)(value & 0xFF);
+            value >>= 8;
+        }
+    }
+
+    static uint32_t readUInt32BigEndian(const char *data)
+    {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+        return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    }
+
+    static uint64_t readUInt64BigEndian(const char *data)
+    {
+        return ((uint64_t)readUInt32BigEndian(data) << 32) | readUInt32BigEndian(data + 4);
+    }
+
+    // Captures easily pass 2 GB, which a long can't address on Windows.
+    static bool seekFile(FILE *file, uint64_t offset)
+    {
+#ifdef WIN32
+        return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+        return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+    }
+
+    static bool isTimestamped(uint32_t type)
+    {
+        return type == PortalFrameTypeTimestampedVideo || type == PortalFrameTypeTimestampedAudio;
+    }
+
+    bool CaptureIndexer::add(int type, int naluType, uint64_t offset, uint64_t time, CaptureIndexEntry &entry)
+    {
+        if (type != PortalFrameTypeVideo) {
+            return false;
+        }
+
+        if (naluType == 7) {
+            if (!hasParameterSets) {
+                hasParameterSets = true;
+                parameterSets.time = time;
+                parameterSets.offset = offset;
+            }
+            return false;
+        }
+
+        if (naluType == 8) {
+            return false;
+        }
+
+        const bool keyframe = naluType == 5;
+        const bool hadParameterSets = hasParameterSets;
+        hasParameterSets = false;
+
+        if (!keyframe || (hasEntry && time - lastEntryTime < CaptureIndexInterval)) {
+            return false;
+        }
+
+        if (hadParameterSets) {
+            entry = parameterSets;
+        } else {
+            entry.time = time;
+            entry.offset = offset;
+        }
+
+        hasEntry = true;
+        lastEntryTime = entry.time;
+        return true;
+    }
+
+    CaptureWriter::~CaptureWriter()
+    {
+        close();
+    }
+
+    bool CaptureWriter::open(const std::string &path)
+    {
+        close();
+
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            portal_log("Could not create capture %s\n", path.c_str());
+            return false;
+        }
+
+        indexFile = fopen((path + ".idx").c_str(), "wb");
+        if (indexFile == nullptr) {
+            portal_log("Could not create capture index %s.idx\n", path.c_str());
+            fclose(file);
+            file = nullptr;
+            return false;
+        }
+
+        char header[CaptureHeaderSize] = {};
+        memcpy(header, CaptureMagic, sizeof(CaptureMagic));
+        writeUInt32BigEndian(header + 8, CaptureVersion);
+
+        if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+            portal_log("Could not write capture header\n");
+            fclose(file);
+            fclose(indexFile);
+            file = nullptr;
+            indexFile = nullptr;
+            return false;
+        }
+
+        offset = sizeof(header);
+        startTime = 0;
+        indexer = CaptureIndexer();
+        pending.clear();
+        pendingBytes = 0;
+        stopping = false;
+        records = 0;
+        droppedRecords = 0;
+
+        running.store(true, std::memory_order_release);
+        thread = std::thread(&CaptureWriter::run, this);
+        return true;
+    }
+
+    void CaptureWriter::close()
+    {
+        if (!thread.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_one();
+        thread.join();
+
+        fclose(file);
+        fclose(indexFile);
+        file = nullptr;
+        indexFile = nullptr;
+
+        portal_log("Capture closed with %llu records, %llu dropped\n",
+                   (unsigned long long)getRecords(), (unsigned long long)getDroppedRecords());
+    }
+
+    void CaptureWriter::write(const Packet &packet, int type, int tag)
+    {
+        if (!isOpen() || packet.empty()) {
+            return;
+        }
+
+        const uint64_t receiveTime = packet.receiveTime() != 0 ? packet.receiveTime() : monotonicTime();
+        const size_t size = CaptureRecordHeaderSize + sizeof(uint64_t) + packet.size();
+
+        PendingRecord record;
+        record.type = type;
+        record.tag = tag;
+        record.timestamp = packet.timestamp();
+        memcpy(record.prefix, packet.data(), std::min<size_t>(packet.size(), sizeof(record.prefix)));
+        record.packet = packet.share();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                return;
+            }
+
+            if (pendingBytes + size > MaxPendingBytes) {
+                droppedRecords.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            if (startTime == 0) {
+                startTime = receiveTime;
+            }
+            record.time = receiveTime > startTime ? receiveTime - startTime : 0;
+
+            pending.push_back(std::move(record));
+            pendingBytes += size;
+        }
+        condition.notify_one();
+    }
+
+    void CaptureWriter::run()
+    {
+        setCurrentThreadName("portal-capture");
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            if (pending.empty()) {
+                if (stopping) {
+                    break;
+                }
+
+                // Nothing is waiting, so this is a good time to get what we
+                // have onto the disk.
+                lock.unlock();
+                fflush(file);
+                lock.lock();
+
+                condition.wait(lock, [this]{ return stopping || !pending.empty(); });
+                continue;
+            }
+
+            PendingRecord record = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+
+            const size_t size = CaptureRecordHeaderSize + sizeof(uint64_t) + record.packet.size();
+            const bool written = writeRecord(record);
+            record.packet = Packet();
+
+            lock.lock();
+            pendingBytes -= size;
+
+            if (!written) {
+                portal_log("Could not write to capture, stopping\n");
+                droppedRecords.fetch_add(pending.size() + 1, std::memory_order_relaxed);
+                pending.clear();
+                pendingBytes = 0;
+                stopping = true;
+                break;
+            }
+        }
+
+        running.store(false, std::memory_order_release);
+        lock.unlock();
+        fflush(file);
+    }
+
+    bool CaptureWriter::writeRecord(PendingRecord &record)
+    {
+        const Packet &packet = record.packet;
+        const bool timestamped = record.timestamp != 0;
+
+        uint32_t type = (uint32_t)record.type;
+        uint32_t payloadSize = (uint32_t)packet.size();
+        if (timestamped) {
+            type = type == PortalFrameTypeVideo ? PortalFrameTypeTimestampedVideo : PortalFrameTypeTimestampedAudio;
+            payloadSize += sizeof(uint64_t);
+        }
+
+        char header[CaptureRecordHeaderSize + sizeof(uint64_t)];
+        size_t headerSize = CaptureRecordHeaderSize;
+        writeUInt64BigEndian(header, record.time);
+        writeUInt32BigEndian(header + 8, 0);
+        writeUInt32BigEndian(header + 12, type);
+        writeUInt32BigEndian(header + 16, (uint32_t)record.tag);
+        writeUInt32BigEndian(header + 20, payloadSize);
+        if (timestamped) {
+            writeUInt64BigEndian(header + CaptureRecordHeaderSize, record.timestamp);
+            headerSize += sizeof(uint64_t);
+        }
+
+        const size_t prefixSize = std::min<size_t>(packet.size(), sizeof(record.prefix));
+        if (fwrite(header, 1, headerSize, file) != headerSize ||
+            fwrite(record.prefix, 1, prefixSize, file) != prefixSize ||
+            fwrite(packet.data() + prefixSize, 1, packet.size() - prefixSize, file) != packet.size() - prefixSize) {
+            return false;
+        }
+
+        const int naluType = packet.size() > 4 ? (packet[4] & 0x1F) : -1;
+        CaptureIndexEntry entry;
+        if (indexer.add(record.type, naluType, offset, record.time, entry)) {
+            char data[16];
+            writeUInt64BigEndian(data, entry.time);
+            writeUInt64BigEndian(data + 8, entry.offset);
+
+            // The index is small, so it is flushed straight away to keep it
+            // in step with the capture if we never get to close it.
+            if (fwrite(data, 1, sizeof(data), indexFile) == sizeof(data)) {
+                fflush(indexFile);
+            }
+        }
+
+        offset += headerSize + packet.size();
+        records.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    CaptureReader::~CaptureReader()
+    {
+        close();
+    }
+
+    bool CaptureReader::open(const std::string &path)
+    {
+        close();
+
+        file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            portal_log("Could not open capture %s\n", path.c_str());
+            return false;
+        }
+
+        char header[CaptureHeaderSize];
+        if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+            memcmp(header, CaptureMagic, sizeof(CaptureMagic)) != 0) {
+            portal_log("%s is not a capture\n", path.c_str());
+            close();
+            return false;
+        }
+
+        const uint32_t version = readUInt32BigEndian(header + 8);
+        if (version > CaptureVersion) {
+            portal_log("Capture version %u is newer than this reader\n", version);
+            close();
+            return false;
+        }
+
+        if (!loadIndex(path + ".idx")) {
+            buildIndex();
+        }
+
+        rewind();
+        return true;
+    }
+
+    void CaptureReader::close()
+    {
+        if (file) {
+            fclose(file);
+            file = nullptr;
+        }
+        index.clear();
+    }
+
+    bool CaptureReader::next(CaptureRecord &record)
+    {
+        if (file == nullptr) {
+            return false;
+        }
+
+        while (true) {
+            char header[CaptureRecordHeaderSize];
+            if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+                return false;
+            }
+
+            uint32_t type = readUInt32BigEndian(header + 12);
+            uint32_t payloadSize = readUInt32BigEndian(header + 20);
+
+            if (payloadSize > SimpleDataPacketProtocol::MaxPayloadSize) {
+                portal_log("Capture record claims %u bytes, stopping\n", payloadSize);
+                return false;
+            }
+
+            uint64_t timestamp = 0;
+            if (isTimestamped(type)) {
+                char data[sizeof(uint64_t)];
+                if (payloadSize < sizeof(data) || fread(data, 1, sizeof(data), file) != sizeof(data)) {
+                    return false;
+                }
+
+                timestamp = readUInt64BigEndian(data);
+                type = type == PortalFrameTypeTimestampedVideo ? PortalFrameTypeVideo : PortalFrameTypeAudio;
+                payloadSize -= sizeof(data);
+            }
+
+            // SimpleDataPacketProtocol never dispatches these either.
+            if (payloadSize == 0) {
+                continue;
+            }
+
+            Packet packet(payloadSize);
+            if (fread(packet.data(), 1, payloadSize, file) != payloadSize) {
+                return false;
+            }
+            packet.setTimestamp(timestamp);
+
+            record.time = readUInt64BigEndian(header);
+            record.type = (int)type;
+            record.tag = (int)readUInt32BigEndian(header + 16);
+            record.packet = std::move(packet);
+            return true;
+        }
+    }
+
+    void CaptureReader::seek(uint64_t time)
+    {
+        if (file == nullptr) {
+            return;
+        }
+
+        auto entry = std::upper_bound(index.begin(), index.end(), time, [](uint64_t time, const CaptureIndexEntry &entry) {
+            return time < entry.time;
+        });
+
+        if (entry == index.begin()) {
+            rewind();
+        } else {
+            seekFile(file, std::prev(entry)->offset);
+        }
+    }
+
+    void CaptureReader::rewind()
+    {
+        if (file) {
+            seekFile(file, CaptureHeaderSize);
+        }
+    }
+
+    bool CaptureReader::loadIndex(const std::string &path)
+    {
+        FILE *indexFile = fopen(path.c_str(), "rb");
+        if (indexFile == nullptr) {
+            return false;
+        }
+
+        char data[16];
+        while (fread(data, 1, sizeof(data), indexFile) == sizeof(data)) {
+            CaptureIndexEntry entry;
+            entry.time = readUInt64BigEndian(data);
+            entry.offset = readUInt64BigEndian(data + 8);
+
+            if (entry.offset < CaptureHeaderSize || (!index.empty() && entry.offset <= index.back().offset)) {
+                portal_log("Capture index is corrupt, rebuilding it\n");
+                index.clear();
+                fclose(indexFile);
+                return false;
+            }
+
+            index.push_back(entry);
+        }
+
+        fclose(indexFile);
+        return true;
+    }
+
+    void CaptureReader::buildIndex()
+    {
+        CaptureIndexer indexer;
+        uint64_t offset = CaptureHeaderSize;
+        seekFile(file, offset);
+
+        char header[CaptureRecordHeaderSize + sizeof(uint64_t) + 5];
+        while (fread(header, 1, CaptureRecordHeaderSize, file) == CaptureRecordHeaderSize) {
+            const uint64_t time = readUInt64BigEndian(header);
+            uint32_t type = readUInt32BigEndian(header + 12);
+            const uint32_t payloadSize = readUInt32BigEndian(header + 20);
+
+            // Enough of the payload to find the NAL unit type.
+            size_t peekSize = isTimestamped(type) ? sizeof(uint64_t) + 5 : 5;
+            peekSize = std::min<size_t>(peekSize, payloadSize);
+            if (fread(header + CaptureRecordHeaderSize, 1, peekSize, file) != peekSize) {
+                break;
+            }
+
+            size_t naluOffset = CaptureRecordHeaderSize + 4;
+            if (isTimestamped(type)) {
+                type = type == PortalFrameTypeTimestampedVideo ? PortalFrameTypeVideo : PortalFrameTypeAudio;
+                naluOffset += sizeof(uint64_t);
+            }
+            const int naluType = naluOffset < CaptureRecordHeaderSize + peekSize ? (header[naluOffset] & 0x1F) : -1;
+
+            CaptureIndexEntry entry;
+            if (indexer.add((int)type, naluType, offset, time, entry)) {
+                index.push_back(entry);
+            }
+
+            offset += CaptureRecordHeaderSize + payloadSize;
+            if (!seekFile(file, offset)) {
+                break;
+            }
+        }
+    }
+
+    CaptureReplayer::~CaptureReplayer()
+    {
+        stop();
+    }
+
+    bool CaptureReplayer::start(const std::string &path, bool realTime, bool loop)
+    {
+        stop();
+
+        if (!reader.open(path)) {
+            return false;
+        }
+
+        stopping = false;
+        packets = 0;
+        running.store(true, std::memory_order_release);
+        thread = std::thread(&CaptureReplayer::run, this, realTime, loop);
+        return true;
+    }
+
+    void CaptureReplayer::stop()
+    {
+        if (!thread.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        thread.join();
+
+        reader.close();
+    }
+
+    bool CaptureReplayer::waitUntil(uint64_t time)
+    {
+        const std::chrono::time_point<std::chrono::steady_clock, std::chrono::nanoseconds> deadline{std::chrono::nanoseconds(time)};
+
+        std::unique_lock<std::mutex> lock(mutex);
+        return !condition.wait_until(lock, deadline, [this]{ return stopping; });
+    }
+
+    void CaptureReplayer::run(bool realTime, bool loop)
+    {
+        setCurrentThreadName("portal-replay");
+
+        uint64_t startClock = monotonicTime();
+        uint64_t timestampOffset = 0;
+
+        // The device timestamps seen in this pass through the capture.
+        uint64_t firstTimestamp = 0;
+        uint64_t lastTimestamp = 0;
+        uint64_t passPackets = 0;
+
+        CaptureRecord record;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) {
+                    break;
+                }
+            }
+
+            if (!reader.next(record)) {
+                if (!loop || passPackets == 0) {
+                    break;
+                }
+
+                if (lastTimestamp != 0) {
+                    timestampOffset += lastTimestamp - firstTimestamp + LoopGap;
+                }
+                firstTimestamp = 0;
+                lastTimestamp = 0;
+                passPackets = 0;
+
+                reader.rewind();
+                startClock = monotonicTime();
+                continue;
+            }
+
+            if (realTime) {
+                if (!waitUntil(startClock + record.time)) {
+                    break;
+                }
+            } else if (throttle) {
+                bool stopped = false;
+                while (!stopped && throttle()) {
+                    stopped = !waitUntil(monotonicTime() + 1000000);
+                }
+                if (stopped) {
+                    break;
+                }
+            }
+
+            const uint64_t timestamp = record.packet.timestamp();
+            if (timestamp != 0) {
+                if (firstTimestamp == 0) {
+                    firstTimestamp = timestamp;
+                }
+                lastTimestamp = std::max(lastTimestamp, timestamp);
+                record.packet.setTimestamp(timestamp + timestampOffset);
+            }
+
+            // As far as the rest of the pipeline can tell, the packet has just arrived.
+            const uint64_t now = monotonicTime();
+            record.packet.setReceiveTime(now);
+            record.packet.setParseTime(now);
+
+            delegate->portalDeviceDidReceivePacket(std::move(record.packet), record.type, record.tag);
+            packets.fetch_add(1, std::memory_order_relaxed);
+            passPackets++;
+        }
+
+        running.store(false, std::memory_order_release);
+    }
+}
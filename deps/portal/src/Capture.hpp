@@ -0,0 +1,274 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_CAPTURE_H
+#define PORTAL_CAPTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logging.h"
+#include "Packet.hpp"
+
+namespace portal
+{
+
+    class PortalDelegate;
+
+    /**
+     A capture is the Portal frame stream received from a device, written to
+     disk so that it can be replayed later. All integers are big endian.
+
+     The file starts with a 16 byte header: the magic "HSPORTAL", the format
+     version and 4 reserved bytes. It is followed by one record per frame:
+
+         uint64 receiveTime   nanoseconds since the first record was received
+         PortalFrame header   exactly as it was sent, 16 bytes
+         payload              payloadSize bytes
+
+     Frames that carried a device timestamp are written as the timestamped
+     types, with the timestamp at the start of the payload, so the records
+     after the receive time are the same bytes the device sent.
+
+     Records are only ever appended, so a capture that was cut short (OBS
+     crashed, the disk filled up) can still be read up to its last complete
+     record.
+
+     Next to it, <path>.idx holds the keyframes to seek to, as 16 byte
+     entries of the receive time and file offset of the record that starts
+     the keyframe (its SPS, or the IDR slice if it had none). An entry is
+     appended at most every CaptureIndexInterval. If the index is missing it is
+     rebuilt by scanning the capture.
+     */
+    static constexpr char CaptureMagic[8] = {'H', 'S', 'P', 'O', 'R', 'T', 'A', 'L'};
+    static constexpr uint32_t CaptureVersion = 1;
+    static constexpr size_t CaptureHeaderSize = 16;
+    static constexpr size_t CaptureRecordHeaderSize = 8 + 16;
+
+    // The least time between index entries.
+    static constexpr uint64_t CaptureIndexInterval = 1000000000ULL;
+
+    struct CaptureIndexEntry {
+        uint64_t time;
+        uint64_t offset;
+    };
+
+    /**
+     Decides which records start a keyframe worth indexing, as records are
+     written or scanned in order. Each video payload is one NAL unit behind
+     a 4 byte start code, and the SPS and PPS come right before the IDR.
+     */
+    class CaptureIndexer
+    {
+    public:
+        // Returns true and fills in *entry* if the index should get an entry.
+        bool add(int type, int naluType, uint64_t offset, uint64_t time, CaptureIndexEntry &entry);
+
+    private:
+        // Where the last SPS was, while no slice has followed it.
+        bool hasParameterSets = false;
+        CaptureIndexEntry parameterSets = {};
+
+        bool hasEntry = false;
+        uint64_t lastEntryTime = 0;
+    };
+
+    struct CaptureRecord {
+        // Nanoseconds since the start of the capture.
+        uint64_t time;
+        // The type as dispatched by SimpleDataPacketProtocol, i.e. timestamped
+        // frames have the plain type and the timestamp set on the packet.
+        int type;
+        int tag;
+        Packet packet;
+    };
+
+    /**
+     Writes a capture on a background thread, so that recording never blocks
+     the thread receiving from the device.
+     */
+    class CaptureWriter
+    {
+    public:
+        CaptureWriter() {}
+        ~CaptureWriter();
+
+        bool open(const std::string &path);
+        void close();
+
+        bool isOpen() {
+            return running.load(std::memory_order_acquire);
+        }
+
+        /**
+         Queues a packet to be written. The payload is shared rather than
+         copied, apart from the first few bytes: decoders may overwrite the
+         H.264 start code in place once they have the packet.
+         */
+        void write(const Packet &packet, int type, int tag);
+
+        // Packets are dropped rather than buffering more than this if the
+        // disk can't keep up.
+        static constexpr size_t MaxPendingBytes = 64 * 1024 * 1024;
+
+        uint64_t getRecords() {
+            return records.load(std::memory_order_relaxed);
+        }
+
+        uint64_t getDroppedRecords() {
+            return droppedRecords.load(std::memory_order_relaxed);
+        }
+
+    private:
+        struct PendingRecord {
+            uint64_t time;
+            int type;
+            int tag;
+            uint64_t timestamp;
+            char prefix[4];
+            Packet packet;
+        };
+
+        void run();
+        bool writeRecord(PendingRecord &record);
+
+        FILE *file = nullptr;
+        FILE *indexFile = nullptr;
+        uint64_t offset = 0;
+
+        // The first record's receive time, which the others are relative to.
+        uint64_t startTime = 0;
+
+        CaptureIndexer indexer;
+
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<PendingRecord> pending;
+        size_t pendingBytes = 0;
+        bool stopping = false;
+
+        std::thread thread;
+        std::atomic<bool> running{false};
+
+        std::atomic<uint64_t> records{0};
+        std::atomic<uint64_t> droppedRecords{0};
+    };
+
+    class CaptureReader
+    {
+    public:
+        CaptureReader() {}
+        ~CaptureReader();
+
+        bool open(const std::string &path);
+        void close();
+
+        /**
+         Reads the next record. Returns false at the end of the capture, or
+         at a record that was only partly written.
+         */
+        bool next(CaptureRecord &record);
+
+        /**
+         Moves to the last keyframe at or before *time*, or the start of the
+         capture if there isn't one.
+         */
+        void seek(uint64_t time);
+
+        // Moves back to the first record.
+        void rewind();
+
+        const std::vector<CaptureIndexEntry> &getIndex() {
+            return index;
+        }
+
+    private:
+        bool loadIndex(const std::string &path);
+        void buildIndex();
+
+        FILE *file = nullptr;
+        std::vector<CaptureIndexEntry> index;
+    };
+
+    /**
+     Feeds a capture to a PortalDelegate as if it was coming from a device,
+     on its own thread.
+     */
+    class CaptureReplayer
+    {
+    public:
+        CaptureReplayer(PortalDelegate *delegate_) : delegate(delegate_) {}
+        ~CaptureReplayer();
+
+        /**
+         Starts replaying *path*. In real time the packets are delivered with
+         the gaps they were received with, otherwise as fast as the delegate
+         takes them. A looping replay shifts the device timestamps forward
+         each time round, so they keep increasing.
+         */
+        bool start(const std::string &path, bool realTime, bool loop);
+        void stop();
+
+        bool isRunning() {
+            return running.load(std::memory_order_acquire);
+        }
+
+        /**
+         When replaying as fast as possible, delivery waits while this
+         returns true, so that a slower consumer isn't simply overrun.
+         */
+        void setThrottle(std::function<bool()> isBusy) {
+            throttle = isBusy;
+        }
+
+        uint64_t getPackets() {
+            return packets.load(std::memory_order_relaxed);
+        }
+
+    private:
+        void run(bool realTime, bool loop);
+
+        // Sleeps until monotonicTime() reaches *time*. Returns false if the
+        // replay was stopped first.
+        bool waitUntil(uint64_t time);
+
+        PortalDelegate *delegate;
+        std::function<bool()> throttle;
+
+        CaptureReader reader;
+        std::thread thread;
+        std::atomic<bool> running{false};
+
+        // Wakes a real time replay that is waiting for the next packet.
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool stopping = false;
+
+        std::atomic<uint64_t> packets{0};
+    };
+}
+
+#endif
@@ -28,84 +28,118 @@ namespace portal
 
         protocol = std::make_unique<SimpleDataPacketProtocol>();
 
-        running = StartInternalThread();
+        receiveBufferSize = usbmuxd_set_receive_buffer_size(conn, ReceiveBufferSize);
+        portal_log("%s: Receive buffer is %d bytes\n", __func__, receiveBufferSize);
+
+        // Store the token before the handler can run, so that it can remove itself.
+        Reactor::shared().perform([this]() {
+            readToken = Reactor::shared().add(conn, [this]() { readAvailableData(); });
+        });
     }
 
     Channel::~Channel()
     {
-        running = false;
-        WaitForInternalThreadToExit();
+        stopReading();
         portal_log("%s: Deallocating\n", __func__);
     }
 
     void Channel::close()
     {
-        running = false;
-        WaitForInternalThreadToExit();
-        usbmuxd_disconnect(conn);
-    }
+        stopReading();
 
-    /** Returns true if the thread was successfully started, false if there was an error starting the thread */
-    bool Channel::StartInternalThread()
-    {
-        _thread = std::thread(InternalThreadEntryFunc, this);
-        return true;
+        {
+            std::lock_guard<std::mutex> lock(connMutex);
+            if (conn < 0) {
+                return;
+            }
+            usbmuxd_disconnect(conn);
+            conn = -1;
+        }
+
+        ChannelStats stats = getStats();
+        portal_log("%s: Received %llu bytes in %llu reads (%llu bytes per read, %llu empty reads)\n", __func__,
+                   (unsigned long long)stats.bytes, (unsigned long long)stats.reads,
+                   (unsigned long long)(stats.reads > 0 ? stats.bytes / stats.reads : 0),
+                   (unsigned long long)stats.emptyReads);
     }
 
-    /** Will not return until the internal thread has exited. */
-    void Channel::WaitForInternalThreadToExit()
+    ChannelStats Channel::getStats()
     {
-        if (_thread.joinable())
-        {
-            _thread.join();
-        }
+        ChannelStats stats;
+        stats.reads = reads.load(std::memory_order_relaxed);
+        stats.emptyReads = emptyReads.load(std::memory_order_relaxed);
+        stats.bytes = bytes.load(std::memory_order_relaxed);
+        stats.receiveBufferSize = receiveBufferSize;
+        return stats;
     }
 
-    void Channel::StopInternalThread()
+    void Channel::stopReading()
     {
-        running = false;
+        // Either the reactor thread (on an error) or close() may get here first.
+        Reactor::Token token = readToken.exchange(0);
+        if (token != 0) {
+            Reactor::shared().remove(token);
+        }
     }
 
-    void Channel::InternalThreadEntry()
+    void Channel::readAvailableData()
     {
-        while (running)
+        // Bounded, so that one busy channel can't starve the others sharing the reactor.
+        for (int i = 0; i < 16; i++)
         {
-
-            const uint32_t numberOfBytesToAskFor = 65536; // (1 << 16); // This is the value in DarkLighting
+            // Read straight into the protocol's buffer (or the payload of the
+            // packet that is being received) so the data is only written once.
+            size_t numberOfBytesToAskFor = 0;
+            char *buffer = protocol->prepareRead(&numberOfBytesToAskFor);
             uint32_t numberOfBytesReceived = 0;
 
-            char buffer[numberOfBytesToAskFor];
-
-            int ret = usbmuxd_recv_timeout(conn, (char *)&buffer, numberOfBytesToAskFor, &numberOfBytesReceived, 100);
+            int ret = usbmuxd_recv_nonblocking(conn, buffer, (uint32_t)numberOfBytesToAskFor, &numberOfBytesReceived);
 
-
-            if (ret == 0)
+            if (ret != 0)
             {
-                if (numberOfBytesReceived > 0)
-                {
-                    if (running) {
-                        protocol->processData((char *)buffer, numberOfBytesReceived);
-                    }
+                portal_log("There was an error receiving data");
+                stopReading();
+
+                // Only for a lost connection, not one that was closed.
+                std::shared_ptr<ChannelDelegate> strongDelegate = delegate.lock();
+                if (strongDelegate) {
+                    strongDelegate->channelDidStop();
                 }
+                return;
             }
-            else
-            {
-                portal_log("There was an error receiving data");
-                running = false;
+
+            if (numberOfBytesReceived == 0) {
+                emptyReads.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            reads.fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(numberOfBytesReceived, std::memory_order_relaxed);
+
+            protocol->commitRead(numberOfBytesReceived);
+
+            // A short read means the socket has been drained.
+            if (numberOfBytesReceived < numberOfBytesToAskFor) {
+                return;
             }
         }
     }
 
     int Channel::send(std::vector<char> buffer) {
+        std::lock_guard<std::mutex> lock(connMutex);
+        if (conn < 0) {
+            return -1;
+        }
+
         uint32_t numSent = 0;
         return usbmuxd_send(conn, &buffer[0], buffer.size(), &numSent);
     }
 
-    void Channel::simpleDataPacketProtocolDelegateDidProcessPacket(std::vector<char> packet, int type, int tag)
+    void Channel::simpleDataPacketProtocolDelegateDidProcessPacket(Packet packet, int type, int tag)
     {
         std::shared_ptr<ChannelDelegate> strongDelegate = delegate.lock();
         if (strongDelegate) {
-            strongDelegate->channelDidReceivePacket(packet, type, tag);
+            strongDelegate->channelDidReceivePacket(std::move(packet), type, tag);
         }
     }
 }
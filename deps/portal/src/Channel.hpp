@@ -16,19 +16,34 @@
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#include <mutex>
+
 #include <usbmuxd.h>
-#include <thread>
 
 #include "logging.h"
 #include "Protocol.hpp"
+#include "Reactor.hpp"
 
 namespace portal
 {
 
+    struct ChannelStats {
+        // recv() calls that returned data.
+        uint64_t reads;
+        // recv() calls that found nothing to read.
+        uint64_t emptyReads;
+        uint64_t bytes;
+        // The socket's receive buffer, as granted by the kernel.
+        int receiveBufferSize;
+    };
+
     class ChannelDelegate
     {
     public:
-        virtual void channelDidReceivePacket(std::vector<char> packet, int type, int tag) = 0;
+        virtual void channelDidReceivePacket(Packet packet, int type, int tag) = 0;
+
+        // Called on the reactor thread when the connection is lost, but not
+        // when the channel is closed.
         virtual void channelDidStop() = 0;
         virtual ~ChannelDelegate(){};
     };
@@ -45,9 +60,11 @@ namespace portal
         }
 
         void close();
+
+        // May be called from any thread. Returns -1 once the channel is closed.
         int send(std::vector<char> buffer);
 
-        void simpleDataPacketProtocolDelegateDidProcessPacket(std::vector<char> packet, int type, int tag);
+        void simpleDataPacketProtocolDelegateDidProcessPacket(Packet packet, int type, int tag);
 
         void setDelegate(std::shared_ptr<ChannelDelegate> newDelegate)
         {
@@ -58,6 +75,12 @@ namespace portal
             return port;
         }
 
+        ChannelStats getStats();
+
+        // What we ask the kernel to buffer, so that a burst (e.g. a 4K IDR
+        // frame) is already waiting when the reactor gets to the socket.
+        static constexpr int ReceiveBufferSize = 4 * 1024 * 1024;
+
         void configureProtocolDelegate() {
             protocol->setDelegate(shared_from_this());
         }
@@ -66,6 +89,10 @@ namespace portal
         int port;
         int conn;
 
+        // Held by send() and close(), so a send never reaches a socket that
+        // was disconnected, or whose fd has since been reused.
+        std::mutex connMutex;
+
         void setPacketDelegate(std::shared_ptr<SimpleDataPacketProtocolDelegate> newDelegate)
         {
             protocol->setDelegate(newDelegate);
@@ -75,20 +102,16 @@ namespace portal
 
         std::weak_ptr<ChannelDelegate> delegate;
 
-        bool running = false;
-
-        bool StartInternalThread();
-        void WaitForInternalThreadToExit();
-        void StopInternalThread();
-        void InternalThreadEntry();
+        // Called on the reactor thread when the socket is readable.
+        void readAvailableData();
+        void stopReading();
 
-        static void *InternalThreadEntryFunc(void *This)
-        {
-            ((portal::Channel *)This)->InternalThreadEntry();
-            return NULL;
-        }
+        std::atomic<Reactor::Token> readToken{0};
 
-        std::thread _thread;
+        std::atomic<uint64_t> reads{0};
+        std::atomic<uint64_t> emptyReads{0};
+        std::atomic<uint64_t> bytes{0};
+        int receiveBufferSize = 0;
     };
 }
 
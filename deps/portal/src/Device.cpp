@@ -24,7 +24,15 @@
 namespace portal
 {
 
+    // How long to wait before trying to connect again, doubling each time.
+    static const std::chrono::milliseconds InitialConnectBackoff(100);
+    static const std::chrono::milliseconds MaxConnectBackoff(2000);
+
+    // usbmuxd waits for the device to answer, so give it as long as libusbmuxd would.
+    static const std::chrono::milliseconds ConnectAttemptTimeout(5000);
+
     Device::DeviceMap Device::s_devices;
+    std::mutex Device::s_devicesMutex;
     //Device::ChannelsVec Device::s_connectedChannels;
 
     Device::Device(const usbmuxd_device_info_t &device) : _connected(false),
@@ -32,6 +40,7 @@ namespace portal
     _uuid(_device.udid),
     _productId(std::to_string(_device.product_id))
     {
+        std::lock_guard<std::mutex> lock(s_devicesMutex);
         s_devices[_uuid].push_back(this);
         portal_log("Added %p to device list", this);
     }
@@ -40,6 +49,7 @@ namespace portal
     _device(other._device),
     _uuid(other._uuid)
     {
+        std::lock_guard<std::mutex> lock(s_devicesMutex);
         s_devices[_uuid].push_back(this);
         portal_log("Added %p to device list (copy)", this);
     }
@@ -53,6 +63,7 @@ namespace portal
         this->_uuid = rhs._uuid;
         this->_productId = rhs._productId;
 
+        std::lock_guard<std::mutex> lock(s_devicesMutex);
         s_devices[_uuid].push_back(this);
 
         return *this;
@@ -73,53 +84,191 @@ namespace portal
         return _device.product_id;
     }
 
-    int Device::connect(uint16_t port, std::shared_ptr<ChannelDelegate> newChannelDelegate, int attempts)
+    void Device::connect(uint16_t port, std::shared_ptr<ChannelDelegate> newChannelDelegate, int attempts,
+                         ConnectCallback completion)
     {
-        int retval = 0;
-        int conn = usbmuxd_connect(_device.handle, port);
+        Reactor::shared().perform([&]() {
+            cancelConnect();
 
-        if (conn > 0)
-        {
-            connectedChannel = std::shared_ptr<Channel>(new Channel(port, conn));
-            connectedChannel->configureProtocolDelegate();
-            connectedChannel->setDelegate(newChannelDelegate);
-        } else {
+            _connectPort = port;
+            _connectAttemptsLeft = attempts;
+            _connectBackoff = InitialConnectBackoff;
+            _connectDelegate = newChannelDelegate;
+            _connectCompletion = completion;
+            _connecting = true;
+
+            _connectToken = Reactor::shared().schedule(std::chrono::milliseconds(0), [this]() {
+                _connectToken = 0;
+                startConnectAttempt();
+            });
+        });
+    }
 
-            if (attempts > 0) {
-                connect(port, newChannelDelegate, attempts - 1);
-            }
+    void Device::startConnectAttempt()
+    {
+        _pendingConnect = usbmuxd_connect_start(_device.handle, _connectPort);
+        if (_pendingConnect == NULL) {
+            failConnectAttempt();
+            return;
         }
 
-        return retval;
+        // usbmuxd answers once the device has, which a locked phone may not.
+        _connectTimeoutToken = Reactor::shared().schedule(ConnectAttemptTimeout, [this]() {
+            _connectTimeoutToken = 0;
+            portal_log("%s: Timed out connecting to %s\n", __func__, _uuid.c_str());
+
+            Reactor::shared().remove(_connectToken);
+            _connectToken = 0;
+            usbmuxd_connect_close(_pendingConnect);
+            _pendingConnect = NULL;
+            failConnectAttempt();
+        });
+
+        watchConnectAttempt();
     }
 
-    int Device::send(std::vector<char> buffer)
+    void Device::watchConnectAttempt()
     {
-        return connectedChannel->send(buffer);
+        _connectToken = Reactor::shared().add(usbmuxd_connect_get_fd(_pendingConnect), [this]() { finishConnectAttempt(); });
+        if (_connectToken == 0) {
+            Reactor::shared().remove(_connectTimeoutToken);
+            _connectTimeoutToken = 0;
+            usbmuxd_connect_close(_pendingConnect);
+            _pendingConnect = NULL;
+            failConnectAttempt();
+        }
     }
 
-    void Device::disconnect()
+    void Device::finishConnectAttempt()
     {
-        if (isConnected() == false) {
+        // Stop watching before the socket is handed over or closed.
+        Reactor::shared().remove(_connectToken);
+        _connectToken = 0;
+
+        const int conn = usbmuxd_connect_finish(_pendingConnect);
+        if (conn == -EAGAIN) {
+            watchConnectAttempt();
             return;
         }
 
-        connectedChannel->close();
-        connectedChannel = nullptr;
+        Reactor::shared().remove(_connectTimeoutToken);
+        _connectTimeoutToken = 0;
+        usbmuxd_connect_close(_pendingConnect);
+        _pendingConnect = NULL;
+
+        if (conn < 0) {
+            failConnectAttempt();
+            return;
+        }
+
+        // The channel starts reading as soon as it is made, but this is the
+        // reactor thread, so it knows where to send the packets first.
+        auto channel = std::shared_ptr<Channel>(new Channel(_connectPort, conn));
+        channel->configureProtocolDelegate();
+        channel->setDelegate(_connectDelegate);
+        std::atomic_store(&connectedChannel, channel);
+
+        completeConnect(true);
     }
 
-    bool Device::isConnected() const
+    void Device::failConnectAttempt()
+    {
+        if (_connectAttemptsLeft <= 0) {
+            portal_log("%s: Could not connect to %s\n", __func__, _uuid.c_str());
+            completeConnect(false);
+            return;
+        }
+
+        _connectAttemptsLeft--;
+        _connectToken = Reactor::shared().schedule(_connectBackoff, [this]() {
+            _connectToken = 0;
+            startConnectAttempt();
+        });
+        _connectBackoff = std::min(_connectBackoff * 2, MaxConnectBackoff);
+    }
+
+    void Device::completeConnect(bool connected)
+    {
+        // Cleared first, as the callback may connect again.
+        ConnectCallback completion = std::move(_connectCompletion);
+        _connectCompletion = nullptr;
+        _connectDelegate = nullptr;
+        _connecting = false;
+
+        if (completion) {
+            completion(connected);
+        }
+    }
+
+    void Device::cancelConnect()
     {
-        if (connectedChannel == nullptr) {
-            return false;
+        if (_connectToken != 0) {
+            Reactor::shared().remove(_connectToken);
+            _connectToken = 0;
         }
 
-        return true;
+        if (_connectTimeoutToken != 0) {
+            Reactor::shared().remove(_connectTimeoutToken);
+            _connectTimeoutToken = 0;
+        }
+
+        usbmuxd_connect_close(_pendingConnect);
+        _pendingConnect = NULL;
+
+        _connectCompletion = nullptr;
+        _connectDelegate = nullptr;
+        _connecting = false;
+    }
+
+    int Device::send(std::vector<char> buffer)
+    {
+        // The connection may be lost while a decoder thread is sending.
+        std::shared_ptr<Channel> channel = std::atomic_load(&connectedChannel);
+        if (channel == nullptr) {
+            return -1;
+        }
+
+        return channel->send(buffer);
+    }
+
+    ChannelStats Device::getChannelStats()
+    {
+        std::shared_ptr<Channel> channel = std::atomic_load(&connectedChannel);
+        if (channel == nullptr) {
+            return ChannelStats{};
+        }
+
+        return channel->getStats();
+    }
+
+    void Device::disconnect()
+    {
+        std::shared_ptr<Channel> channel;
+
+        Reactor::shared().perform([&]() {
+            cancelConnect();
+            channel = std::atomic_exchange(&connectedChannel, std::shared_ptr<Channel>());
+        });
+
+        if (channel != nullptr) {
+            channel->close();
+        }
+    }
+
+    bool Device::isConnected() const
+    {
+        return std::atomic_load(&connectedChannel) != nullptr;
+    }
+
+    bool Device::isConnecting() const
+    {
+        return _connecting;
     }
 
     void Device::removeFromDeviceList()
     {
         //Remove this device from the tracked devices
+        std::lock_guard<std::mutex> lock(s_devicesMutex);
         std::vector<Device *> &devs = s_devices[_uuid];
         std::vector<Device *>::iterator it = std::find(devs.begin(), devs.end(), this);
         if (it != devs.end())
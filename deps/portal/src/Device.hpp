@@ -16,7 +16,11 @@
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -48,6 +52,11 @@ namespace portal
     class Device : public std::enable_shared_from_this<Device>
     {
     public:
+        typedef std::shared_ptr<Device> shared_ptr;
+
+        // Called with whether the device was connected to.
+        typedef std::function<void(bool connected)> ConnectCallback;
+
         std::shared_ptr<Device> getptr()
         {
             return shared_from_this();
@@ -69,6 +78,10 @@ namespace portal
          */
         bool isConnected() const;
 
+        // Returns whether connect() is still trying to connect.
+        bool isConnecting() const;
+
+        // Disconnects, or stops trying to connect, without calling the callback.
         void disconnect();
 
         /**
@@ -100,15 +113,30 @@ namespace portal
          */
         uint16_t productID() const;
 
-        int connect(uint16_t port, std::shared_ptr<ChannelDelegate> channelDelegate, int attempts);
+        /**
+         Connects to *port* on the device on the reactor thread, so it returns
+         straight away. A failed attempt is tried again up to *attempts*
+         times, waiting twice as long each time, as the app may not be
+         listening yet or the phone may be locked.
+         *
+         @param completion Called on the reactor thread once the device is
+         connected to or the attempts have run out.
+         */
+        void connect(uint16_t port, std::shared_ptr<ChannelDelegate> channelDelegate, int attempts,
+                     ConnectCallback completion = nullptr);
 
         int send(std::vector<char> buffer);
 
+        /**
+         Returns the receive statistics of the current connection, or zeros
+         if the device isn't connected.
+         */
+        ChannelStats getChannelStats();
+
         ~Device();
 
         typedef std::map<std::string, std::vector<Device *>> DeviceMap;
         typedef std::vector<std::shared_ptr<Channel>> ChannelsVec;
-        typedef std::shared_ptr<Device> shared_ptr;
 
         void setDelegate(DeviceDelegate *newDelegate)
         {
@@ -125,8 +153,31 @@ namespace portal
         ///Keeps track of all devices associated by their uuid
         static DeviceMap s_devices;
 
+        // Each Portal makes its own devices, on whichever thread it is told about them.
+        static std::mutex s_devicesMutex;
+
+        // Set on the reactor thread, and read from any, so only used atomically.
         std::shared_ptr<Channel> connectedChannel;
 
+        // The connection being made. Only touched on the reactor thread, or
+        // inside Reactor::perform().
+        usbmuxd_connect_t _pendingConnect = NULL;
+        Reactor::Token _connectToken = 0;
+        Reactor::Token _connectTimeoutToken = 0;
+        uint16_t _connectPort = 0;
+        int _connectAttemptsLeft = 0;
+        std::chrono::milliseconds _connectBackoff{0};
+        std::shared_ptr<ChannelDelegate> _connectDelegate;
+        ConnectCallback _connectCompletion;
+        std::atomic<bool> _connecting{false};
+
+        void startConnectAttempt();
+        void watchConnectAttempt();
+        void finishConnectAttempt();
+        void failConnectAttempt();
+        void completeConnect(bool connected);
+        void cancelConnect();
+
         bool _connected;
         usbmuxd_device_info_t _device;
         std::string _uuid;
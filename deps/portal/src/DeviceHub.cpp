@@ -0,0 +1,332 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+#include "DeviceHub.hpp"
+
+namespace portal
+{
+    /**
+     usbmuxd callback
+     */
+    void hub_usbmuxd_cb(const usbmuxd_event_t *event, void *user_data)
+    {
+        DeviceHub *hub = static_cast<DeviceHub *>(user_data);
+
+        switch (event->event)
+        {
+            case UE_DEVICE_ADD:
+                hub->addDevice(event->device);
+                break;
+            case UE_DEVICE_REMOVE:
+                hub->removeDevice(event->device);
+                break;
+        }
+    }
+
+    DeviceHub &DeviceHub::shared()
+    {
+        static DeviceHub hub;
+        return hub;
+    }
+
+    DeviceHub::DeviceHub()
+    {
+        // The reactor has to outlive the hub, which closes its events on it,
+        // so it must finish being constructed first.
+        Reactor::shared();
+
+        _published = std::make_shared<DeviceList>();
+
+#if PORTAL_DEBUG_LOG_ENABLED
+        libusbmuxd_set_debug_level(10);
+#endif
+    }
+
+    DeviceHub::~DeviceHub()
+    {
+        Reactor::shared().perform([this]() {
+            _listeners.clear();
+
+            for (const auto &announcement : _announcements) {
+                Reactor::shared().remove(announcement.second);
+            }
+            _announcements.clear();
+
+            if (_openToken != 0) {
+                Reactor::shared().remove(_openToken);
+                _openToken = 0;
+            }
+
+            closeEvents();
+        });
+    }
+
+    void DeviceHub::addListener(DeviceHubListener *listener)
+    {
+        Reactor::shared().perform([this, listener]() {
+            if (std::find(_listeners.begin(), _listeners.end(), listener) != _listeners.end()) {
+                return;
+            }
+
+            _listeners.push_back(listener);
+
+            _announcements[listener] = Reactor::shared().schedule(std::chrono::milliseconds(0), [this, listener]() {
+                _announcements.erase(listener);
+                announceDevices(listener);
+            });
+
+            if (_listeners.size() == 1) {
+                scheduleOpen(std::chrono::milliseconds(0));
+            }
+        });
+    }
+
+    void DeviceHub::removeListener(DeviceHubListener *listener)
+    {
+        Reactor::shared().perform([this, listener]() {
+            auto it = std::find(_listeners.begin(), _listeners.end(), listener);
+            if (it == _listeners.end()) {
+                return;
+            }
+
+            _listeners.erase(it);
+
+            auto announcement = _announcements.find(listener);
+            if (announcement != _announcements.end()) {
+                Reactor::shared().remove(announcement->second);
+                _announcements.erase(announcement);
+            }
+
+            // Nobody is left to tell, so stop listening to usbmuxd. The
+            // devices are announced again when it is next subscribed to.
+            if (_listeners.empty()) {
+                if (_openToken != 0) {
+                    Reactor::shared().remove(_openToken);
+                    _openToken = 0;
+                }
+
+                closeEvents();
+                _devices.clear();
+                publishDevices();
+            }
+        });
+    }
+
+    std::shared_ptr<const DeviceHub::DeviceList> DeviceHub::getDevices()
+    {
+        // Not through the reactor, which may be busy reading a channel.
+        std::lock_guard<std::mutex> lock(_publishedMutex);
+        return _published;
+    }
+
+    void DeviceHub::publishDevices()
+    {
+        auto list = std::make_shared<DeviceList>();
+        for (const auto &entry : _devices) {
+            list->devices.push_back(entry.second);
+        }
+
+        std::lock_guard<std::mutex> lock(_publishedMutex);
+        list->version = _published->version + 1;
+        _published = list;
+    }
+
+    void DeviceHub::reloadDeviceList()
+    {
+        // Ask before taking the reactor, this waits on usbmuxd.
+        usbmuxd_device_info_t *deviceList = NULL;
+        const int deviceCount = usbmuxd_get_device_list(&deviceList);
+        if (deviceCount < 0) {
+            portal_log("%s: Could not get the device list\n", __func__);
+            return;
+        }
+
+        Reactor::shared().perform([this, deviceList, deviceCount]() {
+            std::set<int> handles;
+            for (int i = 0; i < deviceCount; i++) {
+                handles.insert(deviceList[i].handle);
+            }
+
+            // Remove the unplugged devices.
+            std::vector<usbmuxd_device_info_t> devicesToRemove;
+            for (const auto &entry : _devices) {
+                if (handles.count(entry.first) == 0) {
+                    devicesToRemove.push_back(entry.second);
+                }
+            }
+
+            for (const auto &device : devicesToRemove) {
+                removeDevice(device);
+            }
+
+            // Add the currently connected devices
+            for (int i = 0; i < deviceCount; i++) {
+                addDevice(deviceList[i]);
+            }
+        });
+
+        usbmuxd_device_list_free(&deviceList);
+    }
+
+    bool DeviceHub::claim(const std::string &uuid, const void *owner)
+    {
+        std::lock_guard<std::mutex> lock(_claimsMutex);
+
+        auto it = _claims.find(uuid);
+        if (it != _claims.end()) {
+            return it->second == owner;
+        }
+
+        // Each owner only has one device at a time.
+        for (auto claim = _claims.begin(); claim != _claims.end(); ++claim) {
+            if (claim->second == owner) {
+                _claims.erase(claim);
+                break;
+            }
+        }
+
+        _claims[uuid] = owner;
+        return true;
+    }
+
+    void DeviceHub::release(const void *owner)
+    {
+        std::lock_guard<std::mutex> lock(_claimsMutex);
+
+        for (auto claim = _claims.begin(); claim != _claims.end(); ++claim) {
+            if (claim->second == owner) {
+                _claims.erase(claim);
+                break;
+            }
+        }
+    }
+
+    bool DeviceHub::isClaimed(const std::string &uuid, const void *owner)
+    {
+        std::lock_guard<std::mutex> lock(_claimsMutex);
+
+        auto it = _claims.find(uuid);
+        return it != _claims.end() && it->second != owner;
+    }
+
+    void DeviceHub::openEvents()
+    {
+        // usbmuxd may not be running yet (on Linux it is only started once a
+        // device is plugged in) so keep trying until it is.
+        _events = usbmuxd_events_open();
+        if (_events == NULL) {
+            scheduleOpen(std::chrono::milliseconds(1000));
+            return;
+        }
+
+        _eventsToken = Reactor::shared().add(usbmuxd_events_get_fd(_events), [this]() { processEvents(); });
+        if (_eventsToken == 0) {
+            closeEvents();
+            scheduleOpen(std::chrono::milliseconds(1000));
+        }
+    }
+
+    void DeviceHub::closeEvents()
+    {
+        if (_eventsToken != 0) {
+            Reactor::shared().remove(_eventsToken);
+            _eventsToken = 0;
+        }
+
+        if (_events != NULL) {
+            usbmuxd_events_close(_events);
+            _events = NULL;
+        }
+    }
+
+    void DeviceHub::processEvents()
+    {
+        if (usbmuxd_events_process(_events, hub_usbmuxd_cb, this) < 0) {
+            // libusbmuxd has already reported every device as removed.
+            portal_log("%s: Lost connection to usbmuxd\n", __func__);
+            closeEvents();
+            scheduleOpen(std::chrono::milliseconds(1000));
+        }
+    }
+
+    void DeviceHub::scheduleOpen(std::chrono::milliseconds delay)
+    {
+        _openToken = Reactor::shared().schedule(delay, [this]() {
+            _openToken = 0;
+            openEvents();
+        });
+    }
+
+    void DeviceHub::announceDevices(DeviceHubListener *listener)
+    {
+        // Copied, as the listener may reload the device list.
+        const std::map<int, usbmuxd_device_info_t> devices = _devices;
+        for (const auto &entry : devices) {
+            listener->deviceHubDidAddDevice(entry.second);
+        }
+    }
+
+    void DeviceHub::addDevice(const usbmuxd_device_info_t &device)
+    {
+        // Filter out network connected devices
+        if (strcmp(device.connection_type, "Network") == 0)
+        {
+            return;
+        }
+
+        if (_devices.find(device.handle) != _devices.end())
+        {
+            return;
+        }
+
+        _devices[device.handle] = device;
+        publishDevices();
+        portal_log("HUB: Added device: %i (%s)\n", device.product_id, device.udid);
+
+        // A listener may remove itself while it is being told.
+        const std::vector<DeviceHubListener *> listeners = _listeners;
+        for (auto listener : listeners) {
+            listener->deviceHubDidAddDevice(device);
+        }
+    }
+
+    void DeviceHub::removeDevice(const usbmuxd_device_info_t &device)
+    {
+        auto it = _devices.find(device.handle);
+        if (it == _devices.end())
+        {
+            return;
+        }
+
+        // Pass on what was known about it when it was added.
+        const usbmuxd_device_info_t removed = it->second;
+        _devices.erase(it);
+        publishDevices();
+        portal_log("HUB: Removed device: %i (%s)\n", removed.product_id, removed.udid);
+
+        const std::vector<DeviceHubListener *> listeners = _listeners;
+        for (auto listener : listeners) {
+            listener->deviceHubDidRemoveDevice(removed);
+        }
+    }
+}
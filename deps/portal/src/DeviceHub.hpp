@@ -0,0 +1,151 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_DEVICE_HUB_H
+#define PORTAL_DEVICE_HUB_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <usbmuxd.h>
+
+#include "logging.h"
+#include "Reactor.hpp"
+
+namespace portal
+{
+
+    class DeviceHubListener
+    {
+    public:
+        virtual void deviceHubDidAddDevice(const usbmuxd_device_info_t &device) = 0;
+        virtual void deviceHubDidRemoveDevice(const usbmuxd_device_info_t &device) = 0;
+        virtual ~DeviceHubListener(){};
+    };
+
+    /**
+     The process wide view of the devices plugged in over USB.
+
+     usbmuxd is subscribed to once, while there is anyone listening, and each
+     device event is passed on to every listener. Listeners are called on the
+     reactor thread, or on the thread calling reloadDeviceList(), but never
+     two at a time. The subscription is opened on the reactor thread too, so
+     adding a listener doesn't wait for usbmuxd.
+
+     The device list is kept current from the events, so reading it never
+     talks to usbmuxd.
+
+     The hub also remembers which owner (a Portal) has claimed each device,
+     so that several sources can each take a different phone without
+     connecting to one that is already in use. A claim outlives the device
+     being unplugged, so the phone goes back to the same source when it
+     comes back.
+     */
+    class DeviceHub
+    {
+    public:
+        // The devices at one point in time. Each change makes a new one.
+        struct DeviceList
+        {
+            // Goes up by one with each change.
+            uint64_t version = 0;
+            std::vector<usbmuxd_device_info_t> devices;
+        };
+
+        static DeviceHub &shared();
+
+        /**
+         Starts passing device events to *listener*. Shortly afterwards, on
+         the reactor thread, it is told about the devices that are already
+         plugged in as if they had just been added, as usbmuxd does for a
+         new subscription.
+         */
+        void addListener(DeviceHubListener *listener);
+
+        /**
+         Stops passing device events to *listener*. When this returns it
+         isn't being called and won't be again.
+         */
+        void removeListener(DeviceHubListener *listener);
+
+        /**
+         The devices as of the last event. It only takes a short lock, so
+         it can be called from any thread, including OBS's UI thread.
+         */
+        std::shared_ptr<const DeviceList> getDevices();
+
+        // Asks usbmuxd for the devices now, rather than waiting for events.
+        // This waits for usbmuxd, so should be kept off the UI thread.
+        void reloadDeviceList();
+
+        /**
+         Claims the device with *uuid* for *owner*, giving up any other
+         device it had claimed.
+         *
+         @return false if another owner has already claimed it.
+         */
+        bool claim(const std::string &uuid, const void *owner);
+
+        // Gives up whichever device *owner* had claimed.
+        void release(const void *owner);
+
+        // Returns whether an owner other than *owner* has claimed the device.
+        bool isClaimed(const std::string &uuid, const void *owner);
+
+    private:
+        DeviceHub();
+        ~DeviceHub();
+
+        DeviceHub(const DeviceHub &other);
+        DeviceHub &operator=(const DeviceHub &other);
+
+        // Only touched on the reactor thread, or inside Reactor::perform().
+        std::vector<DeviceHubListener *> _listeners;
+        std::map<DeviceHubListener *, Reactor::Token> _announcements;
+        std::map<int, usbmuxd_device_info_t> _devices;
+        usbmuxd_events_t _events = NULL;
+        Reactor::Token _eventsToken = 0;
+        Reactor::Token _openToken = 0;
+
+        void openEvents();
+        void closeEvents();
+        void processEvents();
+        void scheduleOpen(std::chrono::milliseconds delay);
+
+        // Replaces the published list with the one in _devices.
+        void publishDevices();
+
+        void announceDevices(DeviceHubListener *listener);
+        void addDevice(const usbmuxd_device_info_t &device);
+        void removeDevice(const usbmuxd_device_info_t &device);
+
+        friend void hub_usbmuxd_cb(const usbmuxd_event_t *event, void *user_data);
+
+        std::mutex _publishedMutex;
+        std::shared_ptr<const DeviceList> _published;
+
+        // Device UUIDs to the owner that claimed them.
+        std::mutex _claimsMutex;
+        std::map<std::string, const void *> _claims;
+    };
+}
+
+#endif
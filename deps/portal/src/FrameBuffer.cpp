@@ -0,0 +1,88 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <cstring>
+
+#include "FrameBuffer.hpp"
+
+namespace portal
+{
+
+    FrameBuffer::FrameBuffer(size_t capacity_) : storage(new char[capacity_]), capacity(capacity_)
+    {
+    }
+
+    FrameBuffer::~FrameBuffer()
+    {
+    }
+
+    char *FrameBuffer::prepare(size_t length)
+    {
+        if (capacity - writeOffset >= length) {
+            return storage.get() + writeOffset;
+        }
+
+        const size_t unread = size();
+
+        if (unread + length > capacity) {
+            // A single frame doesn't fit, grow the slab.
+            size_t newCapacity = capacity * 2;
+            while (newCapacity < unread + length) {
+                newCapacity *= 2;
+            }
+
+            std::unique_ptr<char[]> newStorage(new char[newCapacity]);
+            if (unread > 0) {
+                memcpy(newStorage.get(), data(), unread);
+            }
+
+            storage = std::move(newStorage);
+            capacity = newCapacity;
+        } else if (unread > 0) {
+            // Move the partial frame back to the start of the slab.
+            memmove(storage.get(), data(), unread);
+        }
+
+        readOffset = 0;
+        writeOffset = unread;
+
+        return storage.get() + writeOffset;
+    }
+
+    void FrameBuffer::commit(size_t length)
+    {
+        writeOffset += length;
+    }
+
+    void FrameBuffer::consume(size_t length)
+    {
+        readOffset += length;
+
+        // Once everything has been read the slab can be reused from the start
+        // without moving anything.
+        if (readOffset >= writeOffset) {
+            clear();
+        }
+    }
+
+    void FrameBuffer::clear()
+    {
+        readOffset = 0;
+        writeOffset = 0;
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_FRAME_BUFFER_H
+#define PORTAL_FRAME_BUFFER_H
+
+#include <cstddef>
+#include <memory>
+
+namespace portal
+{
+
+    /**
+     A fixed-capacity slab buffer used to frame the incoming byte stream.
+
+     Bytes are appended at the write offset and consumed from the read
+     offset, so parsing a packet never shifts the rest of the buffer. The
+     only time data is moved is when the free space at the end of the slab
+     runs out, at which point the (partial) frame that is still unread is
+     moved back to the start. The slab only grows when a single frame is
+     larger than the current capacity.
+     */
+    class FrameBuffer
+    {
+    public:
+        static constexpr size_t DefaultCapacity = 4 * 1024 * 1024;
+
+        explicit FrameBuffer(size_t capacity = DefaultCapacity);
+        ~FrameBuffer();
+
+        FrameBuffer(const FrameBuffer &other) = delete;
+        FrameBuffer &operator=(const FrameBuffer &other) = delete;
+
+        /**
+         Returns a pointer to at least *length* contiguous bytes of free space
+         at the end of the buffer. Call commit() once data has been written.
+         */
+        char *prepare(size_t length);
+
+        /**
+         Returns the number of contiguous bytes that can be written at the
+         pointer returned by prepare() without compacting or growing.
+         */
+        size_t writableLength() const
+        {
+            return capacity - writeOffset;
+        }
+
+        void commit(size_t length);
+
+        const char *data() const
+        {
+            return storage.get() + readOffset;
+        }
+
+        size_t size() const
+        {
+            return writeOffset - readOffset;
+        }
+
+        void consume(size_t length);
+
+        void clear();
+
+        size_t getCapacity() const
+        {
+            return capacity;
+        }
+
+    private:
+        std::unique_ptr<char[]> storage;
+
+        size_t capacity;
+        size_t readOffset = 0;
+        size_t writeOffset = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <cstring>
+#include <new>
+
+#include "Packet.hpp"
+
+namespace portal
+{
+
+    Packet::Packet(size_t size)
+    {
+        void *block = ::operator new(sizeof(Storage) + size + Padding);
+        storage = new (block) Storage();
+        storage->references = 1;
+        storage->size = size;
+        storage->timestamp = 0;
+        storage->receiveTime = 0;
+        storage->parseTime = 0;
+
+        memset(data() + size, 0, Padding);
+    }
+
+    Packet::Packet(const char *data_, size_t size) : Packet(size)
+    {
+        if (size > 0) {
+            memcpy(data(), data_, size);
+        }
+    }
+
+    Packet Packet::share() const
+    {
+        Packet packet;
+        if (storage) {
+            storage->references.fetch_add(1, std::memory_order_relaxed);
+            packet.storage = storage;
+        }
+        return packet;
+    }
+
+    void Packet::release()
+    {
+        if (storage == nullptr) {
+            return;
+        }
+
+        if (storage->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            storage->~Storage();
+            ::operator delete(storage);
+        }
+
+        storage = nullptr;
+    }
+}
@@ -0,0 +1,190 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_PACKET_H
+#define PORTAL_PACKET_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace portal
+{
+
+    /**
+     The host clock that packets are stamped with as they move through the
+     pipeline, in nanoseconds. Only differences between these are meaningful.
+     */
+    inline uint64_t monotonicTime()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     A reference counted packet payload.
+
+     A Packet is move-only so that a payload is written once, when it is
+     received from the device, and is then handed down the pipeline without
+     being copied. When a second owner genuinely needs the same payload
+     (e.g. a C library that releases it asynchronously) share() returns a
+     new reference to the same storage.
+     */
+    class Packet
+    {
+    public:
+        /**
+         Every payload is followed by this many zeroed bytes, so that it can
+         be handed to decoders that read past the end of their input (FFmpeg's
+         AV_INPUT_BUFFER_PADDING_SIZE) without being copied into a bigger buffer.
+         */
+        static constexpr size_t Padding = 64;
+
+        Packet() {}
+
+        /**
+         Allocates an uninitialised payload of *size* bytes.
+         */
+        explicit Packet(size_t size);
+
+        /**
+         Allocates a payload of *size* bytes and copies *data* into it.
+         */
+        Packet(const char *data, size_t size);
+
+        Packet(Packet &&other) noexcept : storage(other.storage)
+        {
+            other.storage = nullptr;
+        }
+
+        Packet &operator=(Packet &&other) noexcept
+        {
+            if (this != &other) {
+                release();
+                storage = other.storage;
+                other.storage = nullptr;
+            }
+            return *this;
+        }
+
+        Packet(const Packet &other) = delete;
+        Packet &operator=(const Packet &other) = delete;
+
+        ~Packet()
+        {
+            release();
+        }
+
+        /**
+         Returns a new reference to the same payload.
+         */
+        Packet share() const;
+
+        char *data()
+        {
+            return storage ? reinterpret_cast<char *>(storage + 1) : nullptr;
+        }
+
+        const char *data() const
+        {
+            return storage ? reinterpret_cast<const char *>(storage + 1) : nullptr;
+        }
+
+        size_t size() const
+        {
+            return storage ? storage->size : 0;
+        }
+
+        bool empty() const
+        {
+            return size() == 0;
+        }
+
+        /**
+         The time the payload was captured on the device, in nanoseconds on
+         the device's clock, or 0 if the frame it arrived in wasn't timestamped.
+         */
+        uint64_t timestamp() const
+        {
+            return storage ? storage->timestamp : 0;
+        }
+
+        void setTimestamp(uint64_t timestamp)
+        {
+            if (storage) {
+                storage->timestamp = timestamp;
+            }
+        }
+
+        /**
+         When the header of the frame that carried the payload was read from
+         the socket, and when the payload was complete and handed to the
+         delegate, in monotonicTime(). 0 if they weren't recorded.
+         */
+        uint64_t receiveTime() const
+        {
+            return storage ? storage->receiveTime : 0;
+        }
+
+        void setReceiveTime(uint64_t time)
+        {
+            if (storage) {
+                storage->receiveTime = time;
+            }
+        }
+
+        uint64_t parseTime() const
+        {
+            return storage ? storage->parseTime : 0;
+        }
+
+        void setParseTime(uint64_t time)
+        {
+            if (storage) {
+                storage->parseTime = time;
+            }
+        }
+
+        char &operator[](size_t index)
+        {
+            return data()[index];
+        }
+
+        const char &operator[](size_t index) const
+        {
+            return data()[index];
+        }
+
+    private:
+        // The payload immediately follows this header in the same allocation.
+        struct Storage
+        {
+            std::atomic<int> references;
+            size_t size;
+            uint64_t timestamp;
+            uint64_t receiveTime;
+            uint64_t parseTime;
+        };
+
+        void release();
+
+        Storage *storage = nullptr;
+    };
+}
+
+#endif
@@ -17,119 +17,192 @@
  */
 
 #include <iostream>
+#include <set>
 
 #include "Portal.hpp"
 
 namespace portal
 {
-    /**
-     usbmuxd callback
-     */
-    void pt_usbmuxd_cb(const usbmuxd_event_t *event, void *user_data)
-    {
-        Portal *client = static_cast<Portal *>(user_data);
 
-        switch (event->event)
-        {
-            case UE_DEVICE_ADD:
-                client->addDevice(event->device);
-                break;
-            case UE_DEVICE_REMOVE:
-                client->removeDevice(event->device);
-                break;
-        }
+    // The first connection gives up after about 10 seconds, as the user is
+    // waiting to hear whether it worked.
+    static const int ConnectAttempts = 10;
+
+    // Lost connections are tried for about a minute, long enough for the
+    // app to be reopened or the phone to be unlocked.
+    static const int ReconnectAttempts = 35;
 
-        if (client->delegate != NULL) {
-            client->delegate->portalDidUpdateDeviceList(client->_devices);
+    const char *connectionStateName(ConnectionState state)
+    {
+        switch (state) {
+            case ConnectionState::Disconnected:
+                return "disconnected";
+            case ConnectionState::Connecting:
+                return "connecting";
+            case ConnectionState::Connected:
+                return "connected";
+            case ConnectionState::Reconnecting:
+                return "reconnecting";
         }
+        return "unknown";
     }
 
-    Portal::Portal(PortalDelegate *delegate) : _listening(false)
+    Portal::Portal(PortalDelegate *delegate) : _listening(false), _devices(std::make_shared<DeviceMap>())
     {
         this->delegate = delegate;
 
-#if PORTAL_DEBUG_LOG_ENABLED
-        libusbmuxd_set_debug_level(10);
-#endif
+        // The devices are filled in once the owner calls
+        // startListeningForDevices(), when the hub announces them.
+    }
 
-        // Load the device list
-        reloadDeviceList();
+    bool Portal::connectToDevice(Device::shared_ptr device)
+    {
+        if (!claimDevice(device->uuid())) {
+            portal_log("PORTAL (%p): Device %s is in use by another portal\n", this, device->uuid().c_str());
+            return false;
+        }
+
+        Reactor::shared().perform([&]() {
+            // Disconnect to previous device
+            closeDevice();
+
+            std::atomic_store(&_device, device);
 
-        startListeningForDevices();
+            portal_log("PORTAL (%p): Connecting to device: %s (%s)\n", this, device->getProductId().c_str(), device->uuid().c_str());
+
+            // A lost device that has been plugged back in is still being reconnected to.
+            if (_connectionState != ConnectionState::Reconnecting) {
+                setConnectionState(ConnectionState::Connecting);
+            }
+            connect(device, _connectionState == ConnectionState::Reconnecting ? ReconnectAttempts : ConnectAttempts);
+        });
+        return true;
     }
 
-    void Portal::connectToDevice(Device::shared_ptr device)
+    void Portal::connect(Device::shared_ptr device, int attempts)
     {
-        // Disconnect to previous device
-        if (_device) {
-            portal_log("%s: Disconnecting from old device \n", __func__);
-            _device->disconnect();
-            _device = nullptr;
+        // Connect to the device with the channel delegate. Disconnecting
+        // cancels this, so the callback never outlives the Portal.
+        device->connect(2349, shared_from_this(), attempts, [this](bool connected) {
+            portal_log("PORTAL (%p): %s device\n", this, connected ? "Connected to" : "Could not connect to");
+            setConnectionState(connected ? ConnectionState::Connected : ConnectionState::Disconnected);
+        });
+    }
+
+    void Portal::reconnect()
+    {
+        if (_device == nullptr) {
+            setConnectionState(ConnectionState::Disconnected);
+            return;
         }
 
-        _device = device;
+        // Let go of the dead channel first.
+        _device->disconnect();
+        connect(_device, ReconnectAttempts);
+    }
 
-        portal_log("PORTAL (%p): Connecting to device: %s (%s)\n", this, device->getProductId().c_str(), device->uuid().c_str());
+    void Portal::setConnectionState(ConnectionState state)
+    {
+        if (_connectionState.exchange(state) == state) {
+            return;
+        }
 
-        // Connect to the device with the channel delegate.
-        device->connect(2349, shared_from_this(), 10);
+        portal_log("PORTAL (%p): Connection is %s\n", this, connectionStateName(state));
+        if (delegate != NULL) {
+            const std::string uuid = _device ? _device->uuid() : std::string();
+            delegate->portalConnectionStateDidChange(state, uuid);
+        }
     }
 
-    void Portal::removeDisconnectedDevices()
+    bool Portal::claimDevice(const std::string &uuid)
     {
-        // Find removed devices.
-        std::list<Device::shared_ptr> devicesToRemove;
-
-        std::for_each(_devices.begin(), _devices.end(),
-                      [&](std::map<int, Device::shared_ptr>::value_type &deviceMap) {
-                          if (deviceMap.second->isConnected() == false) {
-                              devicesToRemove.push_back(deviceMap.second);
-                          }
-                      }
-                      );
+        return DeviceHub::shared().claim(uuid, this);
+    }
 
-        // Remove the unplugged devices.
-        std::for_each(devicesToRemove.begin(), devicesToRemove.end(), [this](Device::shared_ptr device) {
-            this->removeDevice(device->_device);
+    void Portal::disconnectFromDevice()
+    {
+        Reactor::shared().perform([this]() {
+            closeDevice();
+            setConnectionState(ConnectionState::Disconnected);
         });
     }
 
-    void Portal::addConnectedDevices()
+    void Portal::closeDevice()
     {
-        // Add the currently connected devices
-        int connectedDeviceCount = 0;
-        usbmuxd_device_info_t *devicelist = NULL;
-        connectedDeviceCount = usbmuxd_get_device_list(&devicelist);
+        if (_reconnectToken != 0) {
+            Reactor::shared().remove(_reconnectToken);
+            _reconnectToken = 0;
+        }
+
+        if (_device) {
+            portal_log("%s: Disconnecting from old device \n", __func__);
+            _device->disconnect();
+            std::atomic_store(&_device, Device::shared_ptr());
+        }
+    }
 
-        if (connectedDeviceCount > 0) {
+    void Portal::releaseDevice()
+    {
+        disconnectFromDevice();
+        DeviceHub::shared().release(this);
+    }
 
-            usbmuxd_device_info_t device_info;
-            memset(&device_info, 0, sizeof(usbmuxd_device_info_t));
+    bool Portal::isDeviceClaimedElsewhere(const std::string &uuid)
+    {
+        return DeviceHub::shared().isClaimed(uuid, this);
+    }
 
-            for (int i = 0; i < connectedDeviceCount; i++) {
-                device_info = devicelist[i];
-                addDevice(device_info);
-            }
-        }
+    void Portal::setReceivePriority(ThreadPriority priority)
+    {
+        Reactor::shared().setPriority(this, priority);
     }
 
     void Portal::reloadDeviceList()
     {
-        removeDisconnectedDevices();
-        addConnectedDevices();
+        DeviceHub::shared().reloadDeviceList();
+
+        // Catch up with the hub, which only tells a Portal about the
+        // devices while it is listening.
+        const auto hubDevices = DeviceHub::shared().getDevices();
+        if (hubDevices->version == _reloadedVersion) {
+            return;
+        }
+        _reloadedVersion = hubDevices->version;
+
+        const auto &devices = hubDevices->devices;
+
+        std::set<int> handles;
+        for (const auto &device : devices) {
+            handles.insert(device.handle);
+        }
+
+        std::list<usbmuxd_device_info_t> devicesToRemove;
+        for (const auto &deviceMap : *getDevices()) {
+            if (handles.count(deviceMap.first) == 0) {
+                devicesToRemove.push_back(deviceMap.second->_device);
+            }
+        }
+
+        // Remove the unplugged devices.
+        for (const auto &device : devicesToRemove) {
+            removeDevice(device);
+        }
+
+        // Add the currently connected devices
+        for (const auto &device : devices) {
+            addDevice(device);
+        }
     }
 
-    // BUG: Listening for devices only works when there is one instance of the plugin
     int Portal::startListeningForDevices()
     {
-        //Subscribe for device connections
-        int status = usbmuxd_subscribe(pt_usbmuxd_cb, this);
-        if (status)
-        {
-            return -1;
+        if (_listening) {
+            return 0;
         }
 
         _listening = true;
+        DeviceHub::shared().addListener(this);
+
         portal_log("%s: Listening for devices \n", __func__);
 
         return 0;
@@ -137,12 +210,12 @@ namespace portal
 
     void Portal::stopListeningForDevices()
     {
-        if (_listening)
-        {
-            //Always returns 0
-            usbmuxd_unsubscribe();
-            _listening = false;
+        if (!_listening) {
+            return;
         }
+
+        DeviceHub::shared().removeListener(this);
+        _listening = false;
     }
 
     bool Portal::isListening()
@@ -152,50 +225,98 @@ namespace portal
 
     void Portal::addDevice(const usbmuxd_device_info_t &device)
     {
-        // Filter out network connected devices
-        if (strcmp(device.connection_type, "Network") == 0)
-        {
-            return;
-        }
+        std::lock_guard<std::mutex> lock(_devicesMutex);
 
-        if (_devices.find(device.handle) == _devices.end())
+        if (_devices->find(device.handle) == _devices->end())
         {
+            auto devices = std::make_shared<DeviceMap>(*_devices);
             Device::shared_ptr sp = Device::shared_ptr(new Device(device));
-            _devices.insert(DeviceMap::value_type(device.handle, sp));
+            devices->insert(DeviceMap::value_type(device.handle, sp));
+            _devices = devices;
             portal_log("PORTAL (%p): Added device: %i (%s)\n", this, device.product_id, device.udid);
         }
     }
 
     void Portal::removeDevice(const usbmuxd_device_info_t &device)
     {
-        DeviceMap::iterator it = _devices.find(device.handle);
-
-        if (it != _devices.end())
+        Device::shared_ptr removed;
         {
-            it->second->disconnect();
-            _devices.erase(it);
-            portal_log("PORTAL (%p): Removed device: %i (%s)\n", this, device.product_id, device.udid);
+            std::lock_guard<std::mutex> lock(_devicesMutex);
+
+            auto it = _devices->find(device.handle);
+            if (it == _devices->end())
+            {
+                return;
+            }
+
+            removed = it->second;
+
+            auto devices = std::make_shared<DeviceMap>(*_devices);
+            devices->erase(device.handle);
+            _devices = devices;
         }
+
+        // Closing the channel waits for its handler, so not while holding the lock.
+        removed->disconnect();
+        portal_log("PORTAL (%p): Removed device: %i (%s)\n", this, device.product_id, device.udid);
+
+        // The connection went with it, and is made again when the device
+        // is plugged back in.
+        Reactor::shared().perform([this, &removed]() {
+            if (removed == _device && _connectionState != ConnectionState::Disconnected) {
+                setConnectionState(ConnectionState::Reconnecting);
+            }
+        });
+    }
+
+    void Portal::notifyDeviceListChanged()
+    {
+        if (delegate != NULL) {
+            delegate->portalDidUpdateDeviceList(*getDevices());
+        }
+    }
+
+    void Portal::deviceHubDidAddDevice(const usbmuxd_device_info_t &device)
+    {
+        addDevice(device);
+        notifyDeviceListChanged();
     }
 
-    void Portal::channelDidReceivePacket(std::vector<char> packet, int type, int tag)
+    void Portal::deviceHubDidRemoveDevice(const usbmuxd_device_info_t &device)
+    {
+        removeDevice(device);
+        notifyDeviceListChanged();
+    }
+
+    void Portal::channelDidReceivePacket(Packet packet, int type, int tag)
     {
         if (delegate != NULL) {
-            delegate->portalDeviceDidReceivePacket(packet, type, tag);
+            delegate->portalDeviceDidReceivePacket(std::move(packet), type, tag);
         }
     }
 
     void Portal::channelDidStop()
     {
-        portal_log("Channel Did Stop in portal\n");
+        portal_log("PORTAL (%p): Lost the connection to the device\n", this);
+
+        if (_connectionState != ConnectionState::Connected) {
+            return;
+        }
+
+        setConnectionState(ConnectionState::Reconnecting);
+
+        // Not from inside the channel's handler, as reconnecting closes it.
+        _reconnectToken = Reactor::shared().schedule(std::chrono::milliseconds(0), [this]() {
+            _reconnectToken = 0;
+            reconnect();
+        });
     }
 
     Portal::~Portal()
     {
-        if (_listening)
-        {
-            usbmuxd_unsubscribe();
-        }
+        stopListeningForDevices();
+        Reactor::shared().perform([this]() { closeDevice(); });
+        DeviceHub::shared().release(this);
+        Reactor::shared().setPriority(this, ThreadPriority::Normal);
     }
 }
-
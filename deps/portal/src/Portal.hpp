@@ -20,25 +20,62 @@
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <atomic>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <string>
 
 #include "logging.h"
 #include "Device.hpp"
+#include "DeviceHub.hpp"
 
 typedef void (*portal_channel_receive_cb_t)(char *buffer, int buffer_len, void *user_data);
 
 namespace portal
 {
 
+    enum class ConnectionState {
+        // Not connected to a device, and not trying to be.
+        Disconnected = 0,
+        // connectToDevice() is trying to connect.
+        Connecting,
+        Connected,
+        // The connection was lost, and is being made again, or will be once
+        // the device is plugged back in.
+        Reconnecting,
+    };
+
+    const char *connectionStateName(ConnectionState state);
+
     class PortalDelegate
     {
     public:
-        virtual void portalDeviceDidReceivePacket(std::vector<char> packet, int type, int tag) = 0;
-        virtual void portalDidUpdateDeviceList(std::map<int, Device::shared_ptr>) = 0;
+        virtual void portalDeviceDidReceivePacket(Packet packet, int type, int tag) = 0;
+        virtual void portalDidUpdateDeviceList(const std::map<int, Device::shared_ptr> &deviceList) = 0;
+
+        /**
+         Called whenever the connection changes state, on the reactor thread
+         or the thread that changed it, but never two at a time. *uuid* is
+         the device being connected to, or empty once it has been
+         disconnected from on purpose. The reactor is held, so this mustn't
+         wait on anything.
+         */
+        virtual void portalConnectionStateDidChange(ConnectionState state, const std::string &uuid) = 0;
         virtual ~PortalDelegate(){};
     };
 
-    class Portal : public ChannelDelegate, public std::enable_shared_from_this<Portal>
+    /**
+     One source's view of the devices. The device list comes from the
+     shared DeviceHub, but each Portal has its own Device objects, and so its
+     own channel, so that any number of them can be connected to different
+     devices at once.
+
+     Once connected, a Portal stays connected: if the connection is lost it
+     reconnects by itself, and the delegate sees it go to Reconnecting and
+     back to Connected.
+     */
+    class Portal : public ChannelDelegate, public DeviceHubListener, public std::enable_shared_from_this<Portal>
     {
     public:
         typedef std::map<int, Device::shared_ptr> DeviceMap;
@@ -55,36 +92,103 @@ namespace portal
         void stopListeningForDevices();
         bool isListening();
 
-        void connectToDevice(Device::shared_ptr device);
+        /**
+         Connects to *device*, disconnecting from the previous one. This
+         returns before the device is connected to, and the delegate is told
+         how it went through the connection state.
+         *
+         @return false if another Portal has claimed the device.
+         */
+        bool connectToDevice(Device::shared_ptr device);
+
+        /**
+         Claims the device with *uuid* before it is plugged in, so that no
+         other Portal takes it in the meantime.
+         *
+         @return false if another Portal has claimed it.
+         */
+        bool claimDevice(const std::string &uuid);
+
+        // Disconnects from the device, but keeps it claimed.
+        void disconnectFromDevice();
+
+        // Disconnects from the device and lets other Portals have it.
+        void releaseDevice();
+
+        // Returns whether another Portal has claimed the device.
+        bool isDeviceClaimedElsewhere(const std::string &uuid);
+
+        ConnectionState getConnectionState() {
+            return _connectionState;
+        }
 
+        /**
+         Asks usbmuxd for the devices now. The list is kept current from
+         device events, so this is only needed if they can't be trusted, and
+         as it waits for usbmuxd, it shouldn't be called on the UI thread.
+         */
         void reloadDeviceList();
 
-        Portal::DeviceMap getDevices() {
+        /**
+         Sets the priority packets are received at. The reactor thread reads
+         for every Portal, so it runs at the highest any of them asks for.
+         */
+        void setReceivePriority(ThreadPriority priority);
+
+        /**
+         The devices as of the last event. The map is never changed once
+         returned, so it can be held on to and read without locking, and
+         getting it doesn't talk to usbmuxd.
+         */
+        std::shared_ptr<const Portal::DeviceMap> getDevices() {
+            std::lock_guard<std::mutex> lock(_devicesMutex);
             return _devices;
         }
 
+        // The device being connected to, if any. Safe to call from any thread.
+        Device::shared_ptr getDevice() {
+            return std::atomic_load(&_device);
+        }
+
         PortalDelegate *delegate;
 
-        Device::shared_ptr _device;
     private:
+        // Written with std::atomic_store on the reactor thread, so other
+        // threads must go through getDevice().
+        Device::shared_ptr _device;
+
 
         bool _listening;
-        Portal::DeviceMap _devices;
+
+        // Changed by hub events on the reactor thread, and read by the source.
+        // Changes make a new map, so the ones handed out stay as they were.
+        std::mutex _devicesMutex;
+        std::shared_ptr<const Portal::DeviceMap> _devices;
+
+        // The hub's device list version reloadDeviceList() last caught up to.
+        uint64_t _reloadedVersion = 0;
+
+        // Changed on the reactor thread, or inside Reactor::perform().
+        std::atomic<ConnectionState> _connectionState{ConnectionState::Disconnected};
+        Reactor::Token _reconnectToken = 0;
+
+        void setConnectionState(ConnectionState state);
+        void connect(Device::shared_ptr device, int attempts);
+        void reconnect();
+        void closeDevice();
 
         Portal(const Portal &other);
         Portal &operator=(const Portal &other);
 
-        void removeDisconnectedDevices();
-        void addConnectedDevices();
-
         void addDevice(const usbmuxd_device_info_t &device);
         void removeDevice(const usbmuxd_device_info_t &device);
+        void notifyDeviceListChanged();
 
-        friend void pt_usbmuxd_cb(const usbmuxd_event_t *event, void *user_data);
+        void deviceHubDidAddDevice(const usbmuxd_device_info_t &device);
+        void deviceHubDidRemoveDevice(const usbmuxd_device_info_t &device);
 
-        void channelDidReceivePacket(std::vector<char> packet, int type, int tag);
+        void channelDidReceivePacket(Packet packet, int type, int tag);
         void channelDidStop();
     };
 
 }
-
@@ -16,11 +16,15 @@
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#include <algorithm>
 #include <cstdint>
-#include <iostream>
+#include <cstdio>
+#include <cstring>
 
 #ifdef WIN32
 #include <winsock2.h>
+#else
+#include <arpa/inet.h>
 #endif
 
 #include "Protocol.hpp"
@@ -28,82 +32,183 @@
 namespace portal
 {
 
+    static uint64_t readUInt64BigEndian(const char *data)
+    {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++) {
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
     SimpleDataPacketProtocol::SimpleDataPacketProtocol()
     {
-        std::cout << "SimpleDataPacketProtocol created\n";
+        portal_log("SimpleDataPacketProtocol created\n");
     }
 
     SimpleDataPacketProtocol::~SimpleDataPacketProtocol()
     {
         buffer.clear();
-        std::cout << "SimpleDataPacketProtocol destroyed\n";
+        portal_log("SimpleDataPacketProtocol destroyed\n");
+    }
+
+    void SimpleDataPacketProtocol::reset()
+    {
+        buffer.clear();
+        pending = Packet();
+        pendingReceived = 0;
+        readSize = MinReadSize;
     }
 
     int SimpleDataPacketProtocol::processData(char *data, int dataLength)
     {
-        if (dataLength > 0)
+        int packetsProcessed = 0;
+
+        while (dataLength > 0)
         {
-            // Add data recieved to the end of buffer.
-            buffer.insert(buffer.end(), data, data + dataLength);
+            // Add data recieved to the end of buffer, or to the pending packet.
+            size_t length = 0;
+            char *destination = prepareRead(&length);
+
+            if (length > (size_t)dataLength) {
+                length = dataLength;
+            }
+
+            memcpy(destination, data, length);
+            packetsProcessed += commitRead(length);
+
+            data += length;
+            dataLength -= (int)length;
         }
 
-        uint32_t length = 0;
-        // Ensure that the data inside the buffer is at least as big
-        // as the length variable (32 bit int)
-        // and then read it out
-        if (buffer.size() < sizeof(PortalFrame))
-        {
-            return -1;
+        return packetsProcessed;
+    }
+
+    char *SimpleDataPacketProtocol::prepareRead(size_t *length)
+    {
+        if (!pending.empty()) {
+            *length = pending.size() - pendingReceived;
+            return pending.data() + pendingReceived;
+        }
+
+        // The buffer may have more room than that after compacting, but a read
+        // is kept to readSize so that it adapts to the bitrate.
+        char *destination = buffer.prepare(readSize);
+        *length = std::min(buffer.writableLength(), readSize);
+        return destination;
+    }
+
+    int SimpleDataPacketProtocol::commitRead(size_t length)
+    {
+        readTime = monotonicTime();
+
+        if (pending.empty()) {
+            if (length >= readSize) {
+                readSize = std::min(readSize * 2, MaxReadSize);
+            } else if (length < readSize / 4) {
+                readSize = std::max(readSize / 2, MinReadSize);
+            }
+
+            buffer.commit(length);
+            return parseFrames();
+        }
+
+        pendingReceived += length;
+        if (pendingReceived < pending.size()) {
+            return 0;
+        }
+
+        pendingReceived = 0;
+        dispatch(std::move(pending), pendingType, pendingTag);
+        return 1;
+    }
+
+    void SimpleDataPacketProtocol::dispatch(Packet packet, int type, int tag)
+    {
+        packet.setParseTime(monotonicTime());
+
+        std::shared_ptr<SimpleDataPacketProtocolDelegate> strongDelegate = delegate.lock();
+        if (strongDelegate) {
+            strongDelegate->simpleDataPacketProtocolDelegateDidProcessPacket(std::move(packet), type, tag);
         }
-        else
+    }
+
+    int SimpleDataPacketProtocol::parseFrames()
+    {
+        int packetsProcessed = 0;
+
+        // Ensure that the data inside the buffer is at least as big
+        // as the frame header and then read it out
+        while (buffer.size() >= sizeof(PortalFrame))
         {
             // Read the portal frame out
             PortalFrame frame;
 
-            memcpy(&frame, &buffer[0], sizeof(PortalFrame));
-            length = ntohl(length);
+            memcpy(&frame, buffer.data(), sizeof(PortalFrame));
 
             frame.version = ntohl(frame.version);
             frame.type = ntohl(frame.type);
             frame.tag = ntohl(frame.tag);
             frame.payloadSize = ntohl(frame.payloadSize);
 
-            if (frame.payloadSize == 0) {
-                printf("Payload was 0");
-                buffer.erase(buffer.begin(), buffer.begin() + sizeof(PortalFrame) + frame.payloadSize);
-                return -1;
+            if (frame.payloadSize > MaxPayloadSize) {
+                // The stream is out of sync, there is no way to find the next header.
+                portal_log("Payload size %u is too large, dropping buffered data\n", frame.payloadSize);
+                buffer.clear();
+                break;
             }
 
-            // Read payload size now..
-            // Check if we've got all the data for the packet
-
-            if (buffer.size() > (sizeof(PortalFrame) + frame.payloadSize)) {
+            // Timestamped frames are treated as if the timestamp was part of the header.
+            size_t headerSize = sizeof(PortalFrame);
+            uint64_t timestamp = 0;
 
-                // Read length bytes as that is the packet
-                std::vector<char>::const_iterator first = buffer.begin() + sizeof(PortalFrame);
-                std::vector<char>::const_iterator last = buffer.begin() + sizeof(PortalFrame) + frame.payloadSize;
-                std::vector<char> newVec(first, last);
+            if (frame.type == PortalFrameTypeTimestampedVideo || frame.type == PortalFrameTypeTimestampedAudio) {
+                if (frame.payloadSize < sizeof(uint64_t)) {
+                    portal_log("Timestamped frame is too small, dropping buffered data\n");
+                    buffer.clear();
+                    break;
+                }
 
-                std::shared_ptr<SimpleDataPacketProtocolDelegate> strongDelegate = delegate.lock();
-                if (strongDelegate) {
-                    strongDelegate->simpleDataPacketProtocolDelegateDidProcessPacket(newVec, frame.type, frame.tag);
+                headerSize += sizeof(uint64_t);
+                if (buffer.size() < headerSize) {
+                    break;
                 }
 
-                // Remove the data from buffer
-                buffer.erase(buffer.begin(), buffer.begin() + sizeof(PortalFrame) + frame.payloadSize);
+                timestamp = readUInt64BigEndian(buffer.data() + sizeof(PortalFrame));
+                frame.type = frame.type == PortalFrameTypeTimestampedVideo ? PortalFrameTypeVideo : PortalFrameTypeAudio;
+                frame.payloadSize -= sizeof(uint64_t);
+            }
 
-                // Attempt to parse another packet
-                processData(nullptr, 0);
+            buffer.consume(headerSize);
 
-            } else {
+            if (frame.payloadSize == 0) {
+                portal_log("Payload was 0\n");
+                continue;
+            }
 
-                // We haven't got the data for the packet just yet, so wait for next time!
-                return -1;
+            // Copy whatever part of the payload has already been read into the packet.
+            Packet packet(frame.payloadSize);
+            packet.setTimestamp(timestamp);
+            packet.setReceiveTime(readTime);
+            const size_t available = std::min<size_t>(buffer.size(), frame.payloadSize);
+            memcpy(packet.data(), buffer.data(), available);
+            buffer.consume(available);
+
+            if (available < frame.payloadSize) {
+                // We haven't got the data for the packet just yet, the rest of it
+                // will be read directly into the packet.
+                pending = std::move(packet);
+                pendingReceived = available;
+                pendingType = frame.type;
+                pendingTag = frame.tag;
+                break;
             }
 
+            dispatch(std::move(packet), frame.type, frame.tag);
+            packetsProcessed++;
         }
 
-        return 0;
+        return packetsProcessed;
     }
 }
-
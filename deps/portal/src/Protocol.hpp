@@ -19,9 +19,13 @@
 #ifndef PORTAL_SIMPLE_DATA_PACKET_PROTOCOL_H
 #define PORTAL_SIMPLE_DATA_PACKET_PROTOCOL_H
 
+#include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "logging.h"
+#include "FrameBuffer.hpp"
+#include "Packet.hpp"
 
 namespace portal
 {
@@ -45,10 +49,28 @@ namespace portal
 
     } PortalFrame;
 
+    enum PortalFrameType : uint32_t {
+        PortalFrameTypeVideo = 101,
+        PortalFrameTypeAudio = 102,
+
+        // The same as video and audio frames, but the payload starts with the
+        // time it was captured on the device, as a big endian uint64 of
+        // nanoseconds. The timestamp is included in payloadSize, so older
+        // readers can still skip these frames. They are dispatched with the
+        // plain type and the timestamp set on the packet.
+        PortalFrameTypeTimestampedVideo = 110,
+        PortalFrameTypeTimestampedAudio = 111,
+
+        // Sent to the device to ask it to encode an IDR frame straight away,
+        // e.g. after the decoder lost data. It has no payload, and apps that
+        // don't know it ignore it.
+        PortalFrameTypeRequestKeyframe = 112,
+    };
+
     class SimpleDataPacketProtocolDelegate
     {
     public:
-        virtual void simpleDataPacketProtocolDelegateDidProcessPacket(std::vector<char> packet, int type, int tag) = 0;
+        virtual void simpleDataPacketProtocolDelegateDidProcessPacket(Packet packet, int type, int tag) = 0;
         virtual ~SimpleDataPacketProtocolDelegate(){};
     };
 
@@ -63,19 +85,65 @@ namespace portal
             return shared_from_this();
         }
 
+        /**
+         Appends data received from the device and dispatches every complete
+         packet in the buffer to the delegate.
+         *
+         @return The number of packets that were dispatched.
+         */
         int processData(char *data, int dataLength);
 
+        /**
+         Returns where the next read from the device should be written to.
+         While a packet is partially received this points straight into the
+         packet's payload, so the payload is never copied after being read.
+         *
+         @param length Set to the maximum number of bytes to read.
+         */
+        char *prepareRead(size_t *length);
+
+        /**
+         Marks *length* bytes written to the pointer returned by prepareRead()
+         as received, and dispatches any packets that are now complete.
+         *
+         @return The number of packets that were dispatched.
+         */
+        int commitRead(size_t length);
+
         void reset();
 
+        // The most each read between packets asks for. It starts small and
+        // doubles whenever a read fills it, so that at high bitrates a single
+        // read can pick up several frames at once, and halves again when
+        // reads come back mostly empty.
+        static constexpr size_t MinReadSize = 65536;
+        static constexpr size_t MaxReadSize = FrameBuffer::DefaultCapacity / 2;
+
+        // Frames claiming a larger payload than this are treated as corrupt.
+        static constexpr uint32_t MaxPayloadSize = 64 * 1024 * 1024;
+
         void setDelegate(std::shared_ptr<SimpleDataPacketProtocolDelegate> newDelegate)
         {
             delegate = newDelegate;
         }
 
     private:
+        int parseFrames();
+        void dispatch(Packet packet, int type, int tag);
+
         std::weak_ptr<SimpleDataPacketProtocolDelegate> delegate;
 
-        std::vector<char> buffer;
+        FrameBuffer buffer;
+        size_t readSize = MinReadSize;
+
+        // When the data being parsed was read, to stamp the packets with.
+        uint64_t readTime = 0;
+
+        // The packet currently being received directly from the device.
+        Packet pending;
+        size_t pendingReceived = 0;
+        int pendingType = 0;
+        int pendingTag = 0;
     };
 }
 
@@ -0,0 +1,363 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <cerrno>
+#include <vector>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "logging.h"
+#include "Reactor.hpp"
+
+namespace portal
+{
+
+    // The token the wakeup fd is registered with.
+    static const Reactor::Token WakeToken = 0;
+
+    // Without a wakeup fd, changes are picked up after at most this long.
+    static const int PollInterval = 50;
+
+    Reactor &Reactor::shared()
+    {
+        static Reactor reactor;
+        return reactor;
+    }
+
+    Reactor::Reactor()
+    {
+#ifdef __linux__
+        mEpoll = epoll_create1(EPOLL_CLOEXEC);
+        mWakeRead = mWakeWrite = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = WakeToken;
+        epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWakeRead, &event);
+#elif !defined(WIN32)
+        int fds[2];
+        if (pipe(fds) == 0) {
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+            mWakeRead = fds[0];
+            mWakeWrite = fds[1];
+        }
+#endif
+
+        mThread = std::thread(&Reactor::run, this);
+    }
+
+    Reactor::~Reactor()
+    {
+        mStopping = true;
+        wake();
+
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+
+#ifdef __linux__
+        close(mEpoll);
+        close(mWakeRead);
+#elif !defined(WIN32)
+        close(mWakeRead);
+        close(mWakeWrite);
+#endif
+    }
+
+    Reactor::Token Reactor::add(int fd, Handler handler)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+        const Token token = mNextToken++;
+
+#ifdef __linux__
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = token;
+        if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            portal_log("Could not watch fd %d: %d\n", fd, errno);
+            return 0;
+        }
+#endif
+
+        mRegistrations[token] = Registration{fd, std::make_shared<Handler>(std::move(handler))};
+        wake();
+
+        return token;
+    }
+
+    Reactor::Token Reactor::schedule(std::chrono::milliseconds delay, Handler handler)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+        const Token token = mNextToken++;
+
+        mRegistrations[token] = Registration{-1, std::make_shared<Handler>(std::move(handler))};
+        mTimers.insert(std::make_pair(std::chrono::steady_clock::now() + delay, token));
+        wake();
+
+        return token;
+    }
+
+    void Reactor::remove(Token token)
+    {
+        // Waits for the handlers that are running to finish, unless this is
+        // the reactor thread, in which case the lock is already held.
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+        auto it = mRegistrations.find(token);
+        if (it == mRegistrations.end()) {
+            return;
+        }
+
+        if (it->second.fd < 0) {
+            for (auto timer = mTimers.begin(); timer != mTimers.end(); ++timer) {
+                if (timer->second == token) {
+                    mTimers.erase(timer);
+                    break;
+                }
+            }
+        }
+#ifdef __linux__
+        else {
+            epoll_ctl(mEpoll, EPOLL_CTL_DEL, it->second.fd, NULL);
+        }
+#endif
+
+        mRegistrations.erase(it);
+        wake();
+    }
+
+    void Reactor::perform(const std::function<void()> &work)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+        work();
+    }
+
+    void Reactor::setPriority(const void *owner, ThreadPriority priority)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+        if (priority == ThreadPriority::Normal) {
+            mPriorities.erase(owner);
+        } else {
+            mPriorities[owner] = priority;
+        }
+
+        ThreadPriority highest = ThreadPriority::Normal;
+        for (const auto &entry : mPriorities) {
+            if (entry.second > highest) {
+                highest = entry.second;
+            }
+        }
+
+        if (highest == mPriority) {
+            return;
+        }
+        mPriority = highest;
+
+        // Priorities can only be set from the thread itself everywhere.
+        schedule(std::chrono::milliseconds(0), [this]() {
+            if (!setCurrentThreadPriority(mPriority)) {
+                portal_log("Could not give the reactor %s priority\n", threadPriorityName(mPriority));
+            }
+        });
+    }
+
+    void Reactor::wake()
+    {
+#ifdef __linux__
+        uint64_t value = 1;
+        ssize_t written = write(mWakeWrite, &value, sizeof(value));
+        (void)written;
+#elif !defined(WIN32)
+        if (mWakeWrite >= 0) {
+            char value = 1;
+            ssize_t written = write(mWakeWrite, &value, sizeof(value));
+            (void)written;
+        }
+#endif
+    }
+
+    void Reactor::dispatch(Token token)
+    {
+        auto it = mRegistrations.find(token);
+        if (it == mRegistrations.end()) {
+            // Removed since the wait returned.
+            return;
+        }
+
+        // Keep the handler alive in case it removes itself.
+        std::shared_ptr<Handler> handler = it->second.handler;
+        (*handler)();
+    }
+
+    void Reactor::fireTimers()
+    {
+        const auto now = std::chrono::steady_clock::now();
+
+        while (!mTimers.empty() && mTimers.begin()->first <= now) {
+            const Token token = mTimers.begin()->second;
+            mTimers.erase(mTimers.begin());
+
+            auto it = mRegistrations.find(token);
+            if (it == mRegistrations.end()) {
+                continue;
+            }
+
+            std::shared_ptr<Handler> handler = it->second.handler;
+            mRegistrations.erase(it);
+            (*handler)();
+        }
+    }
+
+    int Reactor::nextTimeout()
+    {
+        if (mTimers.empty()) {
+            return -1;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        const auto due = mTimers.begin()->first;
+        if (due <= now) {
+            return 0;
+        }
+
+        // Round up so that the timer is due when the wait returns.
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(due - now) + std::chrono::milliseconds(1);
+        return (int)remaining.count();
+    }
+
+    void Reactor::run()
+    {
+        setCurrentThreadName("portal-reactor");
+
+#ifdef __linux__
+        const int MaxEvents = 16;
+        struct epoll_event events[MaxEvents];
+
+        while (!mStopping) {
+            int timeout;
+            {
+                std::lock_guard<std::recursive_mutex> lock(mMutex);
+                timeout = nextTimeout();
+            }
+
+            int count = epoll_wait(mEpoll, events, MaxEvents, timeout);
+            if (count < 0 && errno != EINTR) {
+                portal_log("epoll_wait failed: %d\n", errno);
+                break;
+            }
+
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+            for (int i = 0; i < count; i++) {
+                if (events[i].data.u64 == WakeToken) {
+                    uint64_t value;
+                    ssize_t got = read(mWakeRead, &value, sizeof(value));
+                    (void)got;
+                    continue;
+                }
+
+                dispatch(events[i].data.u64);
+            }
+
+            fireTimers();
+        }
+#else
+        std::vector<struct pollfd> fds;
+        std::vector<Token> tokens;
+
+        while (!mStopping) {
+            int timeout;
+            {
+                std::lock_guard<std::recursive_mutex> lock(mMutex);
+                timeout = nextTimeout();
+
+                fds.clear();
+                tokens.clear();
+
+                if (mWakeRead >= 0) {
+                    struct pollfd pfd = {};
+                    pfd.fd = mWakeRead;
+                    pfd.events = POLLIN;
+                    fds.push_back(pfd);
+                    tokens.push_back(WakeToken);
+                } else if (timeout < 0 || timeout > PollInterval) {
+                    timeout = PollInterval;
+                }
+
+                for (auto &registration : mRegistrations) {
+                    if (registration.second.fd < 0) {
+                        continue;
+                    }
+
+                    struct pollfd pfd = {};
+                    pfd.fd = registration.second.fd;
+                    pfd.events = POLLIN;
+                    fds.push_back(pfd);
+                    tokens.push_back(registration.first);
+                }
+            }
+
+            int count = 0;
+            if (fds.empty()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+            } else {
+#ifdef WIN32
+                count = WSAPoll(fds.data(), (ULONG)fds.size(), timeout);
+#else
+                count = poll(fds.data(), (nfds_t)fds.size(), timeout);
+#endif
+            }
+
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+            for (size_t i = 0; count > 0 && i < fds.size(); i++) {
+                if (fds[i].revents == 0) {
+                    continue;
+                }
+
+                if (tokens[i] == WakeToken) {
+#ifndef WIN32
+                    char buffer[64];
+                    while (read(mWakeRead, buffer, sizeof(buffer)) > 0) {}
+#endif
+                    continue;
+                }
+
+                dispatch(tokens[i]);
+            }
+
+            fireTimers();
+        }
+#endif
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_REACTOR_H
+#define PORTAL_REACTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "ThreadConfig.hpp"
+
+namespace portal
+{
+
+    /**
+     A single thread that services every socket portal reads from.
+
+     Handlers are called on the reactor thread when their socket becomes
+     readable, or when their timer fires, so idle connections cost nothing
+     and there are no timeouts to wait out when one is closed.
+
+     On Linux this is epoll, with an eventfd to wake the thread up. Elsewhere
+     it is poll(), with a pipe (or, on Windows, a short timeout) instead.
+     */
+    class Reactor
+    {
+    public:
+        typedef std::function<void()> Handler;
+        typedef uint64_t Token;
+
+        static Reactor &shared();
+
+        Reactor();
+        ~Reactor();
+
+        /**
+         Calls *handler* whenever *fd* is readable, until it is removed.
+         *
+         @return A token for remove(), or 0 if the fd couldn't be watched.
+         */
+        Token add(int fd, Handler handler);
+
+        /**
+         Calls *handler* once, after *delay*, unless it is removed first.
+         */
+        Token schedule(std::chrono::milliseconds delay, Handler handler);
+
+        /**
+         Stops watching the fd or cancels the timer. When this returns the
+         handler isn't running and won't be called again, so the fd can be
+         closed. It may be called from inside a handler.
+         */
+        void remove(Token token);
+
+        /**
+         Calls *work* on this thread while no handler is running, so that it
+         can safely touch state that the handlers also use.
+         */
+        void perform(const std::function<void()> &work);
+
+        /**
+         Asks for the reactor thread to run at *priority* for *owner*, or
+         withdraws the request with ThreadPriority::Normal. As every channel
+         is read on this one thread, it runs at the highest priority that is
+         currently asked for.
+         */
+        void setPriority(const void *owner, ThreadPriority priority);
+
+    private:
+        struct Registration {
+            int fd;
+            std::shared_ptr<Handler> handler;
+        };
+
+        void run();
+        void wake();
+        void dispatch(Token token);
+        void fireTimers();
+        int nextTimeout();
+
+        // Held while handlers run, so that remove() can wait for them.
+        std::recursive_mutex mMutex;
+
+        std::map<Token, Registration> mRegistrations;
+        std::multimap<std::chrono::steady_clock::time_point, Token> mTimers;
+        Token mNextToken = 1;
+
+        std::map<const void *, ThreadPriority> mPriorities;
+        ThreadPriority mPriority = ThreadPriority::Normal;
+
+        std::atomic<bool> mStopping{false};
+        std::thread mThread;
+
+        int mWakeRead = -1;
+        int mWakeWrite = -1;
+#ifdef __linux__
+        int mEpoll = -1;
+#endif
+    };
+}
+
+#endif
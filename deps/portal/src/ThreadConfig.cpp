@@ -0,0 +1,269 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <cerrno>
+#include <cstdio>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __APPLE__
+#include <pthread/qos.h>
+#endif
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "logging.h"
+#include "ThreadConfig.hpp"
+
+namespace portal
+{
+
+    // No one has more CPUs than this, so a larger number is a typo.
+    static const int MaxCpu = 1023;
+
+#ifdef __linux__
+    // The nice value for High. Lowering it needs CAP_SYS_NICE or a nice limit.
+    static const int HighNiceValue = -10;
+
+    // Low in the realtime range, so that audio servers still come first.
+    static const int RealtimePriority = 10;
+#endif
+
+    const char *threadPriorityName(ThreadPriority priority)
+    {
+        switch (priority) {
+            case ThreadPriority::Normal:
+                return "normal";
+            case ThreadPriority::High:
+                return "high";
+            case ThreadPriority::Realtime:
+                return "realtime";
+        }
+        return "unknown";
+    }
+
+    void setCurrentThreadName(const std::string &name)
+    {
+#if defined(__linux__)
+        pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#elif defined(__APPLE__)
+        pthread_setname_np(name.c_str());
+#elif defined(WIN32)
+        // Only Windows 10 1607 and later have SetThreadDescription().
+        typedef HRESULT (WINAPI *SetThreadDescriptionFunction)(HANDLE, PCWSTR);
+        auto setThreadDescription = reinterpret_cast<SetThreadDescriptionFunction>(
+            GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription"));
+        if (setThreadDescription == NULL) {
+            return;
+        }
+
+        std::wstring wideName(name.begin(), name.end());
+        setThreadDescription(GetCurrentThread(), wideName.c_str());
+#else
+        (void)name;
+#endif
+    }
+
+#ifdef __linux__
+    static bool setNiceValue(int value)
+    {
+        // The nice value is per thread on Linux, despite what POSIX says.
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), value) != 0) {
+            portal_log("Could not set the nice value to %d: %d\n", value, errno);
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    bool setCurrentThreadPriority(ThreadPriority priority)
+    {
+#if defined(__linux__)
+        if (priority == ThreadPriority::Realtime) {
+            struct sched_param param = {};
+            param.sched_priority = RealtimePriority;
+
+            const int result = pthread_setschedparam(pthread_self(), SCHED_RR, &param);
+            if (result == 0) {
+                return true;
+            }
+
+            portal_log("Could not make the thread realtime: %d\n", result);
+            setCurrentThreadPriority(ThreadPriority::High);
+            return false;
+        }
+
+        // Leave realtime first, the nice value is ignored until then.
+        struct sched_param param = {};
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+        return setNiceValue(priority == ThreadPriority::High ? HighNiceValue : 0);
+#elif defined(__APPLE__)
+        // macOS schedules by quality of service rather than priority, and
+        // user-interactive is the highest a thread can give itself.
+        const qos_class_t qos = priority == ThreadPriority::Normal ? QOS_CLASS_DEFAULT : QOS_CLASS_USER_INTERACTIVE;
+        const int result = pthread_set_qos_class_self_np(qos, 0);
+        if (result != 0) {
+            portal_log("Could not set the thread's QoS class: %d\n", result);
+            return false;
+        }
+        return true;
+#elif defined(WIN32)
+        int value = THREAD_PRIORITY_NORMAL;
+        if (priority == ThreadPriority::High) {
+            value = THREAD_PRIORITY_HIGHEST;
+        } else if (priority == ThreadPriority::Realtime) {
+            value = THREAD_PRIORITY_TIME_CRITICAL;
+        }
+
+        if (!SetThreadPriority(GetCurrentThread(), value)) {
+            portal_log("Could not set the thread priority: %lu\n", GetLastError());
+            return false;
+        }
+        return true;
+#else
+        return priority == ThreadPriority::Normal;
+#endif
+    }
+
+    bool setCurrentThreadAffinity(const std::vector<int> &cpus)
+    {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        if (cpus.empty()) {
+            // The kernel leaves out the CPUs that don't exist.
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                CPU_SET(cpu, &set);
+            }
+        }
+
+        for (int cpu : cpus) {
+            if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                return false;
+            }
+            CPU_SET(cpu, &set);
+        }
+
+        const int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (result != 0) {
+            portal_log("Could not set the thread's CPUs: %d\n", result);
+            return false;
+        }
+        return true;
+#elif defined(WIN32)
+        DWORD_PTR mask = 0;
+
+        if (cpus.empty()) {
+            DWORD_PTR systemMask;
+            if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &systemMask)) {
+                return false;
+            }
+        }
+
+        // Only the CPUs in the thread's processor group can be used.
+        for (int cpu : cpus) {
+            if (cpu < 0 || cpu >= (int)(sizeof(DWORD_PTR) * 8)) {
+                return false;
+            }
+            mask |= (DWORD_PTR)1 << cpu;
+        }
+
+        if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+            portal_log("Could not set the thread's CPUs: %lu\n", GetLastError());
+            return false;
+        }
+        return true;
+#else
+        return cpus.empty();
+#endif
+    }
+
+    bool parseCpuList(const std::string &text, std::vector<int> &cpus)
+    {
+        std::vector<int> parsed;
+        size_t offset = 0;
+
+        auto skipSpaces = [&]() {
+            while (offset < text.size() && (text[offset] == ' ' || text[offset] == '\t')) {
+                offset++;
+            }
+        };
+
+        auto parseNumber = [&](int &number) {
+            skipSpaces();
+            if (offset >= text.size() || text[offset] < '0' || text[offset] > '9') {
+                return false;
+            }
+
+            number = 0;
+            while (offset < text.size() && text[offset] >= '0' && text[offset] <= '9') {
+                number = number * 10 + (text[offset++] - '0');
+                if (number > MaxCpu) {
+                    return false;
+                }
+            }
+            skipSpaces();
+            return true;
+        };
+
+        skipSpaces();
+        while (offset < text.size()) {
+            int first;
+            if (!parseNumber(first)) {
+                return false;
+            }
+
+            int last = first;
+            if (offset < text.size() && text[offset] == '-') {
+                offset++;
+                if (!parseNumber(last) || last < first) {
+                    return false;
+                }
+            }
+
+            for (int cpu = first; cpu <= last; cpu++) {
+                parsed.push_back(cpu);
+            }
+
+            if (offset < text.size()) {
+                if (text[offset] != ',') {
+                    return false;
+                }
+                offset++;
+                skipSpaces();
+                if (offset >= text.size()) {
+                    return false;
+                }
+            }
+        }
+
+        cpus = parsed;
+        return true;
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ portal
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PORTAL_THREAD_CONFIG_H
+#define PORTAL_THREAD_CONFIG_H
+
+#include <string>
+#include <vector>
+
+namespace portal
+{
+
+    enum class ThreadPriority {
+        Normal = 0,
+        // Ahead of ordinary threads, but not of the OS's own.
+        High = 1,
+        // Ahead of everything that isn't realtime itself. Needs permission
+        // on Linux (CAP_SYS_NICE or an rtprio limit), without which the
+        // thread is given High instead.
+        Realtime = 2,
+    };
+
+    const char *threadPriorityName(ThreadPriority priority);
+
+    /**
+     These all apply to the calling thread, so that they work the same on
+     every platform (macOS can only name or prioritise itself).
+     */
+
+    // Names the thread for debuggers and profilers. Linux only keeps the first
+    // 15 characters.
+    void setCurrentThreadName(const std::string &name);
+
+    /**
+     @return false if the priority couldn't be set, in which case the thread
+     is left as close to it as it could be.
+     */
+    bool setCurrentThreadPriority(ThreadPriority priority);
+
+    /**
+     Keeps the thread to the given CPUs, or lets it run on any if there are
+     none. Threads it goes on to start inherit them.
+     *
+     @return false if it couldn't, including on macOS, which has no way of
+     pinning threads.
+     */
+    bool setCurrentThreadAffinity(const std::vector<int> &cpus);
+
+    /**
+     Parses a list of CPUs like "2,3" or "0-3,8". Empty text is no CPUs.
+     *
+     @return false if the text isn't a list of CPUs.
+     */
+    bool parseCpuList(const std::string &text, std::vector<int> &cpus);
+}
+
+#endif
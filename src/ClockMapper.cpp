@@ -0,0 +1,137 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+
+#include "ClockMapper.hpp"
+
+void ClockMapper::update(uint64_t deviceTime, uint64_t hostTime)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    // Audio and video arrive interleaved, and video a little late as it waits
+    // on the encoder, so samples can be slightly older than the window's
+    // start. The differences are signed so that those don't wrap around.
+    const int64_t sinceStart = (int64_t)(deviceTime - mCurrentStart);
+
+    // The device clock went a long way backwards, so the phone has restarted its clock.
+    if (mHasCurrent && sinceStart < -(int64_t)WindowLength) {
+        mWindows.clear();
+        mHasCurrent = false;
+        mValid = false;
+    }
+
+    const int64_t offset = (int64_t)(hostTime - deviceTime);
+
+    if (!mHasCurrent) {
+        mCurrent = {deviceTime, offset};
+        mCurrentStart = deviceTime;
+        mHasCurrent = true;
+    } else if (sinceStart >= (int64_t)WindowLength) {
+        mWindows.push_back(mCurrent);
+        if (mWindows.size() > MaxWindows) {
+            mWindows.pop_front();
+        }
+
+        mCurrent = {deviceTime, offset};
+        mCurrentStart = deviceTime;
+        fit();
+    } else if (offset < mCurrent.offset) {
+        // Including samples from just before the window started, which
+        // still belong to it.
+        mCurrent = {deviceTime, offset};
+    }
+
+    // Until there is enough history for a fit, use the smallest offset so far.
+    if (mWindows.size() < 2) {
+        mReference = mCurrent.deviceTime;
+        mOffset = (double)(mWindows.empty() ? mCurrent.offset : std::min(mWindows.front().offset, mCurrent.offset));
+        mDrift = 0;
+        mValid = true;
+    }
+}
+
+void ClockMapper::fit()
+{
+    if (mWindows.size() < 2) {
+        return;
+    }
+
+    // Least squares fit of offset against device time, relative to the oldest
+    // window to keep the numbers small.
+    const uint64_t reference = mWindows.front().deviceTime;
+    const double n = (double)mWindows.size();
+    double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+
+    for (auto &window : mWindows) {
+        // A window's smallest sample can be older than the oldest window's.
+        const double x = (double)(int64_t)(window.deviceTime - reference);
+        const double y = (double)(window.offset - mWindows.front().offset);
+        sumX += x;
+        sumY += y;
+        sumXX += x * x;
+        sumXY += x * y;
+    }
+
+    const double denominator = n * sumXX - sumX * sumX;
+    if (denominator <= 0) {
+        return;
+    }
+
+    double drift = (n * sumXY - sumX * sumY) / denominator;
+    drift = std::max(-MaxDrift, std::min(MaxDrift, drift));
+
+    const double intercept = (sumY - drift * sumX) / n;
+
+    mReference = reference;
+    mOffset = (double)mWindows.front().offset + intercept;
+    mDrift = drift;
+    mValid = true;
+}
+
+uint64_t ClockMapper::map(uint64_t deviceTime)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (!mValid) {
+        return 0;
+    }
+
+    const double elapsed = (double)(int64_t)(deviceTime - mReference);
+    const int64_t offset = (int64_t)(mOffset + mDrift * elapsed);
+
+    return deviceTime + (uint64_t)offset;
+}
+
+void ClockMapper::reset()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mWindows.clear();
+    mHasCurrent = false;
+    mValid = false;
+    mReference = 0;
+    mOffset = 0;
+    mDrift = 0;
+}
+
+double ClockMapper::getDrift()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mDrift * 1e6;
+}
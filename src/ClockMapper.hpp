@@ -0,0 +1,79 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef ClockMapper_hpp
+#define ClockMapper_hpp
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+// Translates capture times on the phone's clock into os_gettime_ns() time.
+//
+// Every timestamped packet gives a sample of host time - device time, which is
+// the offset between the clocks plus however long the packet took to arrive.
+// That delay is never negative, so the smallest samples are the closest to the
+// real offset. The mapper keeps the smallest sample of each window and fits a
+// line through the recent ones, the slope of which is the drift between the
+// two clocks.
+class ClockMapper
+{
+public:
+    // Records that a packet captured at deviceTime was received at hostTime.
+    void update(uint64_t deviceTime, uint64_t hostTime);
+
+    // Returns the host time that deviceTime corresponds to, or 0 if there
+    // haven't been any samples yet.
+    uint64_t map(uint64_t deviceTime);
+
+    // Forgets the current estimate, e.g. when a different device connects.
+    void reset();
+
+    // The estimated drift of the device's clock, in parts per million.
+    double getDrift();
+
+private:
+    struct Window {
+        uint64_t deviceTime;
+        int64_t offset;
+    };
+
+    void fit();
+
+    // Samples are grouped into windows of this many nanoseconds of device time.
+    static const uint64_t WindowLength = 1000000000ULL;
+    static const size_t MaxWindows = 30;
+
+    // Crystal oscillators are well within this, anything larger is a bad fit.
+    static constexpr double MaxDrift = 500e-6;
+
+    std::mutex mMutex;
+
+    std::deque<Window> mWindows;
+    Window mCurrent;
+    uint64_t mCurrentStart = 0;
+    bool mHasCurrent = false;
+
+    // offset(deviceTime) = mOffset + mDrift * (deviceTime - mReference)
+    bool mValid = false;
+    uint64_t mReference = 0;
+    double mOffset = 0;
+    double mDrift = 0;
+};
+
+#endif /* ClockMapper_hpp */
@@ -0,0 +1,80 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <cstring>
+
+#include "DecoderPool.hpp"
+
+DecoderPool &DecoderPool::shared()
+{
+    static DecoderPool pool;
+    return pool;
+}
+
+DecoderPool::~DecoderPool()
+{
+    clear();
+}
+
+int DecoderPool::acquire(ffmpeg_decode *decode, AVCodecID id,
+                         ffmpeg_decode_threading threading, int threadCount)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        // Prefer the most recently released context.
+        for (auto it = mDecoders.rbegin(); it != mDecoders.rend(); ++it) {
+            if (it->codec->id == id && it->threading == threading && it->thread_count == threadCount) {
+                *decode = *it;
+                mDecoders.erase(std::next(it).base());
+                return 0;
+            }
+        }
+    }
+
+    return ffmpeg_decode_init_threaded(decode, id, threading, threadCount);
+}
+
+void DecoderPool::release(ffmpeg_decode *decode)
+{
+    if (!ffmpeg_decode_valid(decode)) {
+        return;
+    }
+
+    ffmpeg_decode_flush(decode);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mDecoders.size() == MaxDecoders) {
+        ffmpeg_decode_free(&mDecoders.front());
+        mDecoders.erase(mDecoders.begin());
+    }
+
+    mDecoders.push_back(*decode);
+    memset(decode, 0, sizeof(*decode));
+}
+
+void DecoderPool::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for (auto &decode : mDecoders) {
+        ffmpeg_decode_free(&decode);
+    }
+    mDecoders.clear();
+}
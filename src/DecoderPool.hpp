@@ -0,0 +1,59 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef DecoderPool_hpp
+#define DecoderPool_hpp
+
+#include <mutex>
+#include <vector>
+
+#include "ffmpeg-decode.h"
+
+// Keeps opened FFmpeg decoder contexts around after their owner is done with
+// them, so that a source which is recreated, or switches back to a previous
+// threading mode, doesn't have to find, allocate and open a codec again.
+//
+// Contexts are flushed before they are pooled and matched on codec ID and
+// threading, since neither can be changed once the codec is open.
+class DecoderPool
+{
+public:
+    static DecoderPool &shared();
+
+    // Fills decode with a ready to use context, reusing a pooled one if there
+    // is a match. Returns the result of ffmpeg_decode_init_threaded otherwise.
+    int acquire(ffmpeg_decode *decode, AVCodecID id,
+                ffmpeg_decode_threading threading, int threadCount);
+
+    // Flushes decode and keeps it for a later acquire. decode is left empty.
+    void release(ffmpeg_decode *decode);
+
+    // Frees every pooled context.
+    void clear();
+
+private:
+    DecoderPool() {}
+    ~DecoderPool();
+
+    static const size_t MaxDecoders = 4;
+
+    std::mutex mMutex;
+    std::vector<ffmpeg_decode> mDecoders;
+};
+
+#endif /* DecoderPool_hpp */
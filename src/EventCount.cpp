@@ -0,0 +1,56 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "EventCount.hpp"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+void EventCount::wait(uint32_t key)
+{
+#ifdef __linux__
+    // The futex syscall only sleeps if the epoch still equals key, so a
+    // notify() that raced with us just makes it return straight away.
+    while (mEpoch.load(std::memory_order_seq_cst) == key) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&mEpoch), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+    }
+#else
+    std::unique_lock<std::mutex> lock(mMutex);
+    mConditionVariable.wait(lock, [&](){ return mEpoch.load(std::memory_order_seq_cst) != key; });
+#endif
+
+    mWaiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void EventCount::wake()
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&mEpoch), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+    // Taking the lock orders this wakeup after a waiter has checked the
+    // epoch, so it can't be missed.
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+    }
+    mConditionVariable.notify_all();
+#endif
+}
@@ -0,0 +1,81 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef EventCount_hpp
+#define EventCount_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+// Lets a thread sleep until another thread signals that something changed,
+// without the signalling thread taking a lock or making a syscall unless
+// somebody is actually waiting.
+//
+// Waiting is a two step process so that a wakeup can't be lost:
+//
+//     uint32_t key = event.prepareWait();
+//     if (conditionIsNowTrue()) {
+//         event.cancelWait();
+//     } else {
+//         event.wait(key);
+//     }
+//
+// On Linux the wait is a futex on the epoch counter, elsewhere it falls back
+// to a condition variable.
+class EventCount
+{
+public:
+    EventCount() {}
+
+    EventCount(const EventCount &other) = delete;
+    EventCount &operator=(const EventCount &other) = delete;
+
+    uint32_t prepareWait() {
+        mWaiters.fetch_add(1, std::memory_order_seq_cst);
+        return mEpoch.load(std::memory_order_seq_cst);
+    }
+
+    void cancelWait() {
+        mWaiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    // Blocks until notify() has been called after prepareWait() returned key.
+    void wait(uint32_t key);
+
+    void notify() {
+        mEpoch.fetch_add(1, std::memory_order_seq_cst);
+        if (mWaiters.load(std::memory_order_seq_cst) > 0) {
+            wake();
+        }
+    }
+
+private:
+    void wake();
+
+    std::atomic<uint32_t> mEpoch{0};
+    std::atomic<int> mWaiters{0};
+
+#ifndef __linux__
+    std::mutex mMutex;
+    std::condition_variable mConditionVariable;
+#endif
+};
+
+#endif /* EventCount_hpp */
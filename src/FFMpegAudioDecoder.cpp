@@ -17,10 +17,23 @@
  */
 
 #include "FFMpegAudioDecoder.h"
+#include "FFMpegPacket.h"
+#include "DecoderPool.hpp"
 #include <util/platform.h>
 #include <fstream>
 
-FFMpegAudioDecoder::FFMpegAudioDecoder()
+static void
+OutputAudioFrame(void *param, obs_source_audio *audio, long long ts)
+{
+    FFMpegAudioDecoder *decoder = static_cast<FFMpegAudioDecoder *>(param);
+    if (decoder->source != NULL) {
+        // The pts is the capture time in OBS time, if the device sent one.
+        audio->timestamp = ts != AV_NOPTS_VALUE ? (uint64_t)ts : os_gettime_ns();
+        obs_source_output_audio(decoder->source, audio);
+    }
+}
+
+FFMpegAudioDecoder::FFMpegAudioDecoder(): Thread("hs-audio-decode")
 {
     memset(&audio_frame, 0, sizeof(audio_frame));
 }
@@ -28,8 +41,8 @@ FFMpegAudioDecoder::FFMpegAudioDecoder()
 FFMpegAudioDecoder::~FFMpegAudioDecoder()
 {
     this->Shutdown();
-    // Free the video decoder.
-    ffmpeg_decode_free(audio_decoder);
+    // Keep the audio decoder for the next source.
+    DecoderPool::shared().release(audio_decoder);
 }
 
 void FFMpegAudioDecoder::Init()
@@ -40,12 +53,29 @@ void FFMpegAudioDecoder::Init()
 
 void FFMpegAudioDecoder::Flush()
 {
-    // Clear the queue
+    // Clear the queue. The decode thread resets the decoder once it has
+    // emptied it, so this doesn't wait for the packet being decoded.
+    this->mQueue.clear();
+}
+
+void FFMpegAudioDecoder::Reset()
+{
+    mMutex.lock();
+    // Reset the decoder, but keep it open for the next stream
+    ffmpeg_decode_flush(audio_decoder);
+    mMutex.unlock();
 }
 
 void FFMpegAudioDecoder::Drain()
 {
-    // Drain the queue
+    mMutex.lock();
+    // Output the frames still held by the decoder
+    if (ffmpeg_decode_valid(audio_decoder) &&
+        !ffmpeg_decode_audio_drain(audio_decoder, &audio_frame, OutputAudioFrame, this))
+    {
+        blog(LOG_WARNING, "Error draining audio decoder");
+    }
+    mMutex.unlock();
 }
 
 void FFMpegAudioDecoder::Shutdown()
@@ -54,55 +84,71 @@ void FFMpegAudioDecoder::Shutdown()
     this->join();
 }
 
-void FFMpegAudioDecoder::Input(std::vector<char> packet, int type, int tag)
+int FFMpegAudioDecoder::GetQueueDepth()
+{
+    return mQueue.size();
+}
+
+void FFMpegAudioDecoder::Input(portal::Packet packet, int type, int tag)
 {
     // Create a new packet item and enqueue it.
-    PacketItem *item = new PacketItem(packet, type, tag);
-    this->mQueue.add(item);
+    PacketItem *item = new PacketItem(std::move(packet), type, tag);
+    if (!this->mQueue.add(item)) {
+        // The decoder has stalled and the queue is full.
+        delete item;
+    }
 }
 
 void FFMpegAudioDecoder::processPacketItem(PacketItem *packetItem)
 {
-    uint64_t cur_time = os_gettime_ns();
+    std::lock_guard<std::mutex> lock(mMutex);
 
     if (!ffmpeg_decode_valid(audio_decoder))
     {
-        if (ffmpeg_decode_init(audio_decoder, AV_CODEC_ID_AAC) < 0)
+        if (DecoderPool::shared().acquire(audio_decoder, AV_CODEC_ID_AAC, FFMPEG_DECODE_THREADING_NONE, 1) < 0)
         {
             blog(LOG_WARNING, "Could not initialize audio decoder");
             return;
         }
     }
 
-    auto packet = packetItem->getPacket();
+    auto &packet = packetItem->getPacket();
     unsigned char *data = (unsigned char *)packet.data();
 
-    if (packetItem->getType() == 102) {
+    // Use the capture time from the device when it sent one.
+    long long ts = AV_NOPTS_VALUE;
+    if (packet.timestamp() != 0 && clock != NULL) {
+        const uint64_t captureTime = clock->map(packet.timestamp());
+        if (captureTime != 0) {
+            ts = (long long)captureTime;
+        }
+    }
 
-        bool got_output;
+    if (packetItem->getType() == 102) {
 
-        bool success = ffmpeg_decode_audio(audio_decoder, data, packet.size(), &audio_frame, &got_output);
+        // A packet can hold several AAC frames, each one is passed to OutputAudioFrame.
+        bool success = ffmpeg_decode_audio(audio_decoder, data, packet.size(), CreatePacketBuffer(packet),
+                                           ts, &audio_frame, OutputAudioFrame, this);
 
         if (!success)
         {
             blog(LOG_WARNING, "Error decoding audio");
             return;
         }
-
-        if (got_output && source != NULL)
-        {
-            audio_frame.timestamp = cur_time;
-            obs_source_output_audio(source, &audio_frame);
-        }
     }
 }
 
 void *FFMpegAudioDecoder::run() {
 
     while (shouldStop() == false) {
+        applyThreadConfig();
 
         PacketItem *item = (PacketItem *)mQueue.remove();
 
+        if (mQueue.takeCleared()) {
+            this->Reset();
+        }
+
         if (item != NULL) {
             this->processPacketItem(item);
             delete item;
@@ -115,8 +161,10 @@ void *FFMpegAudioDecoder::run() {
             blog(LOG_WARNING, "Audio Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
 
             if (queueSize > 25) {
-                while (mQueue.size() > 5) {
-                    mQueue.remove();
+                // Not remove(), which returns early when the queue is cleared.
+                PacketItem *dropped = NULL;
+                while (mQueue.size() > 5 && mQueue.tryRemove(dropped)) {
+                    delete dropped;
                 }
             }
         }
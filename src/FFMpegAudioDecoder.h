@@ -23,6 +23,7 @@
 #include "ffmpeg-decode.h"
 #include "Queue.hpp"
 #include "Thread.hpp"
+#include "ClockMapper.hpp"
 
 class AudioDecoder
 {
@@ -49,17 +50,27 @@ public:
     
     void Init() override;
     
-    void Input(std::vector<char> packet, int type, int tag) override;
+    void Input(portal::Packet packet, int type, int tag) override;
     
     void Flush() override;
     void Drain() override;
     void Shutdown() override;
+
+    using Thread::setAffinity;
+
+    int GetQueueDepth() override;
     
     obs_source_t *source;
+
+    // Maps the device timestamps of packets to OBS time.
+    ClockMapper *clock = NULL;
     
 private:
     
     void *run() override;
+
+    // Called on the decode thread after the queue was flushed.
+    void Reset();
     
     void processPacketItem(PacketItem *packetItem);
     
@@ -68,5 +79,6 @@ private:
     obs_source_audio audio_frame;
     
     AudioDecoder audio_decoder;
-    
+
+    std::mutex mMutex;
 };
@@ -0,0 +1,48 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include "FFMpegPacket.h"
+
+static_assert(portal::Packet::Padding >= AV_INPUT_BUFFER_PADDING_SIZE,
+              "Packets must be padded for libavcodec");
+
+static void ReleasePacket(void *opaque, uint8_t *data)
+{
+    UNUSED_PARAMETER(data);
+    delete static_cast<portal::Packet *>(opaque);
+}
+
+AVBufferRef *CreatePacketBuffer(portal::Packet &packet)
+{
+    if (packet.empty()) {
+        return NULL;
+    }
+
+    portal::Packet *reference = new portal::Packet(packet.share());
+
+    // The storage is shared with the capture writer and anything else holding
+    // the packet, so libavcodec mustn't write to it even though it has the
+    // only AVBufferRef.
+    AVBufferRef *buffer = av_buffer_create((uint8_t *)reference->data(), (int)reference->size(),
+                                           ReleasePacket, reference, AV_BUFFER_FLAG_READONLY);
+    if (!buffer) {
+        delete reference;
+    }
+
+    return buffer;
+}
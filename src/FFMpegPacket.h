@@ -0,0 +1,31 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+ 
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef FFMpegPacket_h
+#define FFMpegPacket_h
+
+#include <Packet.hpp>
+
+#include "ffmpeg-decode.h"
+
+// Wraps the payload of a packet in a ref-counted AVBufferRef without copying it.
+// The buffer holds its own reference to the packet, so libavcodec can keep it
+// for as long as it needs to. Returns NULL if the buffer couldn't be created.
+AVBufferRef *CreatePacketBuffer(portal::Packet &packet);
+
+#endif /* FFMpegPacket_h */
@@ -17,9 +17,25 @@
  */
 
 #include "FFMpegVideoDecoder.h"
+#include "FFMpegPacket.h"
+#include "DecoderPool.hpp"
 #include <util/platform.h>
 
-FFMpegVideoDecoder::FFMpegVideoDecoder()
+static void
+OutputVideoFrame(void *param, obs_source_frame *frame, long long ts)
+{
+    FFMpegVideoDecoder *decoder = static_cast<FFMpegVideoDecoder *>(param);
+    decoder->OutputFrame(frame, ts);
+}
+
+static void
+ReleaseVideoFrame(void *opaque)
+{
+    AVFrame *frame = static_cast<AVFrame *>(opaque);
+    av_frame_free(&frame);
+}
+
+FFMpegVideoDecoder::FFMpegVideoDecoder(): Thread("hs-video-decode"), mOverloadPolicy("Video")
 {
     memset(&video_frame, 0, sizeof(video_frame));
 }
@@ -27,8 +43,8 @@ FFMpegVideoDecoder::FFMpegVideoDecoder()
 FFMpegVideoDecoder::~FFMpegVideoDecoder()
 {
     this->Shutdown();
-    // Free the video decoder.
-    ffmpeg_decode_free(video_decoder);
+    // Keep the video decoder for the next source.
+    DecoderPool::shared().release(video_decoder);
 }
 
 void FFMpegVideoDecoder::Init()
@@ -39,20 +55,36 @@ void FFMpegVideoDecoder::Init()
 
 void FFMpegVideoDecoder::Flush()
 {
-    // Clear the queue
-    while(this->mQueue.size() > 0) {
-        this->mQueue.remove();
-    }
+    // Clear the queue. The decode thread resets the decoder once it has
+    // emptied it, so this doesn't wait for the packet being decoded.
+    this->mQueue.clear();
+}
 
+void FFMpegVideoDecoder::Reset()
+{
     mMutex.lock();
-    // Re-initialize the decoder
-    ffmpeg_decode_free(video_decoder);
+    // Reset the decoder, but keep it open for the next stream
+    ffmpeg_decode_flush(video_decoder);
     mMutex.unlock();
+
+    // Whatever comes next refers to frames that were thrown away.
+    mOverloadPolicy.resync();
 }
 
 void FFMpegVideoDecoder::Drain()
 {
-    // Drain the queue
+    mMutex.lock();
+    // These frames don't belong to a packet being decoded.
+    mReceiveTime = 0;
+    mDecodeStartTime = 0;
+
+    // Output the frames still held by the decoder
+    if (ffmpeg_decode_valid(video_decoder) &&
+        !ffmpeg_decode_video_drain(video_decoder, &video_frame, OutputVideoFrame, this))
+    {
+        blog(LOG_WARNING, "Error draining video decoder");
+    }
+    mMutex.unlock();
 }
 
 void FFMpegVideoDecoder::Shutdown()
@@ -61,51 +93,145 @@ void FFMpegVideoDecoder::Shutdown()
     this->join();
 }
 
-void FFMpegVideoDecoder::Input(std::vector<char> packet, int type, int tag)
+void FFMpegVideoDecoder::Input(portal::Packet packet, int type, int tag)
 {
+    const uint64_t queueTime = PipelineStats::now();
+    if (stats != NULL) {
+        stats->record(PIPELINE_STAGE_DELIVERY, packet.parseTime(), queueTime);
+    }
+
     // Create a new packet item and enqueue it.
-    PacketItem *item = new PacketItem(packet, type, tag);
-    this->mQueue.add(item);
+    PacketItem *item = new PacketItem(std::move(packet), type, tag);
+    item->setQueueTime(queueTime);
+    if (!this->mQueue.add(item)) {
+        // The decoder has stalled and the queue is full.
+        mOverloadPolicy.queueFull();
+        delete item;
+    }
+}
+
+void FFMpegVideoDecoder::SetThreading(ffmpeg_decode_threading threading, int threadCount)
+{
+    mMutex.lock();
+    if (threading != mThreading || threadCount != mThreadCount) {
+        mThreading = threading;
+        mThreadCount = threadCount;
+
+        // A decoder with the new threading will be acquired on the next packet.
+        DecoderPool::shared().release(video_decoder);
+    }
+    mMutex.unlock();
+}
+
+void FFMpegVideoDecoder::SetOverloadPolicy(OverloadMode mode, int maxQueuedFrames)
+{
+    mOverloadPolicy.configure(mode, maxQueuedFrames);
+}
+
+int FFMpegVideoDecoder::GetQueueDepth()
+{
+    return mQueue.size();
+}
+
+OverloadStats FFMpegVideoDecoder::GetOverloadStats()
+{
+    return mOverloadPolicy.getStats();
+}
+
+uint64_t FFMpegVideoDecoder::GetDecodeErrors()
+{
+    return mDecodeErrors.load(std::memory_order_relaxed);
+}
+
+void FFMpegVideoDecoder::OutputFrame(obs_source_frame *frame, long long ts)
+{
+    if (source == NULL) {
+        return;
+    }
+
+    const uint64_t decodeTime = PipelineStats::now();
+    if (stats != NULL) {
+        // Only the first frame of a packet took the whole decode to produce.
+        stats->record(PIPELINE_STAGE_DECODE, mDecodeStartTime, decodeTime);
+        mDecodeStartTime = 0;
+    }
+
+    // FFmpeg hides missing references by concealing them, which shows until the next keyframe.
+    const AVFrame *decoded = video_decoder->frame;
+    if (keyframeRequester != NULL && decoded != NULL &&
+        (decoded->decode_error_flags != 0 || (decoded->flags & AV_FRAME_FLAG_CORRUPT) != 0)) {
+        keyframeRequester->request("corrupt frame");
+    }
+
+    // The pts is the capture time in OBS time, if the device sent one.
+    const bool hasCaptureTime = ts != AV_NOPTS_VALUE;
+    frame->timestamp = hasCaptureTime ? (uint64_t)ts : os_gettime_ns();
+
+    if (jitterBuffer != NULL && jitterBuffer->isEnabled()) {
+        // Keep a reference to the picture until the jitter buffer has output it.
+        AVFrame *reference = ffmpeg_decode_ref_frame(video_decoder);
+        if (reference != NULL) {
+            jitterBuffer->push(*frame, hasCaptureTime, mReceiveTime, decodeTime, ReleaseVideoFrame, reference);
+            return;
+        }
+    }
+
+    obs_source_output_video(source, frame);
+
+    if (stats != NULL) {
+        const uint64_t outputTime = PipelineStats::now();
+        stats->record(PIPELINE_STAGE_OUTPUT, decodeTime, outputTime);
+        stats->record(PIPELINE_STAGE_TOTAL, mReceiveTime, outputTime);
+        stats->countFrame();
+    }
 }
 
 void FFMpegVideoDecoder::processPacketItem(PacketItem *packetItem)
 {
     mMutex.lock();
-    uint64_t cur_time = os_gettime_ns();
     if (!ffmpeg_decode_valid(video_decoder))
     {
-        if (ffmpeg_decode_init(video_decoder, AV_CODEC_ID_H264) < 0)
+        if (DecoderPool::shared().acquire(video_decoder, AV_CODEC_ID_H264, mThreading, mThreadCount) < 0)
         {
             blog(LOG_WARNING, "Could not initialize video decoder");
+            mMutex.unlock();
             return;
         }
+
+        auto context = video_decoder->decoder;
+        blog(LOG_INFO, "Video decoder using %s threading with %d threads",
+             context->active_thread_type == FF_THREAD_FRAME ? "frame" :
+             context->active_thread_type == FF_THREAD_SLICE ? "slice" : "no",
+             context->thread_count);
     }
 
-    auto packet = packetItem->getPacket();
+    auto &packet = packetItem->getPacket();
     unsigned char *data = (unsigned char *)packet.data();
-    long long ts = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    // Use the capture time from the device when it sent one.
+    long long ts = AV_NOPTS_VALUE;
+    if (packet.timestamp() != 0 && clock != NULL) {
+        const uint64_t captureTime = clock->map(packet.timestamp());
+        if (captureTime != 0) {
+            ts = (long long)captureTime;
+        }
+    }
 
     if (packetItem->getType() == 101) {
+        mReceiveTime = packet.receiveTime();
+        mDecodeStartTime = PipelineStats::now();
 
-        int naluType = (packet[4] & 0x1F);
-        // blog(LOG_INFO, "NALU Type %d", naluType);
-        // blog(LOG_INFO, "packet size %d", packet.size());
-
-
-        bool got_output;
-        bool success = ffmpeg_decode_video(video_decoder, data, packet.size(), &ts,
-                                           &video_frame, &got_output);
+        // Every frame the decoder has ready is passed to OutputVideoFrame.
+        bool success = ffmpeg_decode_video(video_decoder, data, packet.size(),
+                                           CreatePacketBuffer(packet), ts,
+                                           &video_frame, OutputVideoFrame, this);
         if (!success)
         {
+            mDecodeErrors.fetch_add(1, std::memory_order_relaxed);
             blog(LOG_WARNING, "Error decoding video");
-            mMutex.unlock();
-            return;
-        }
 
-        if (got_output && source != NULL)
-        {
-            video_frame.timestamp = cur_time;
-            obs_source_output_video(source, &video_frame);
+            if (keyframeRequester != NULL) {
+                keyframeRequester->request("decode error");
+            }
         }
     }
     mMutex.unlock();
@@ -114,25 +240,26 @@ void FFMpegVideoDecoder::processPacketItem(PacketItem *packetItem)
 void *FFMpegVideoDecoder::run() {
 
     while (shouldStop() == false) {
+        applyThreadConfig();
 
         PacketItem *item = (PacketItem *)mQueue.remove();
 
-        if (item != NULL) {
-            this->processPacketItem(item);
-            delete item;
+        if (mQueue.takeCleared()) {
+            this->Reset();
         }
 
-        // Check queue lengths
-
-        const int queueSize = mQueue.size();
-        if (queueSize > 25) {
-            blog(LOG_WARNING, "Video Decoding queue overloaded. %d frames behind. Please use a lower quality setting.", queueSize);
+        if (item != NULL) {
+            if (stats != NULL) {
+                stats->record(PIPELINE_STAGE_QUEUE, item->getQueueTime(), PipelineStats::now());
+            }
 
-            if (queueSize > 25) {
-                while (mQueue.size() > 5) {
-                    mQueue.remove();
-                }
+            // Skip the rest of the GOP if we have fallen too far behind.
+            if (mOverloadPolicy.shouldDecode(item->getPacket(), mQueue.size())) {
+                this->processPacketItem(item);
+            } else if (keyframeRequester != NULL) {
+                keyframeRequester->request("skipping to keyframe");
             }
+            delete item;
         }
     }
     return NULL;
@@ -23,6 +23,11 @@
 #include "ffmpeg-decode.h"
 #include "Queue.hpp"
 #include "Thread.hpp"
+#include "ClockMapper.hpp"
+#include "JitterBuffer.hpp"
+#include "KeyframeRequester.hpp"
+#include "OverloadPolicy.hpp"
+#include "PipelineStats.hpp"
 
 class Decoder
 {
@@ -49,25 +54,65 @@ public:
     
     void Init() override;
     
-    void Input(std::vector<char> packet, int type, int tag) override;
+    void Input(portal::Packet packet, int type, int tag) override;
     
     void Flush() override;
     void Drain() override;
     void Shutdown() override;
+
+    void SetThreading(ffmpeg_decode_threading threading, int threadCount);
+    void SetOverloadPolicy(OverloadMode mode, int maxQueuedFrames);
+
+    // The CPUs the decode thread runs on, any if empty.
+    using Thread::setAffinity;
+
+    int GetQueueDepth() override;
+    OverloadStats GetOverloadStats() override;
+    uint64_t GetDecodeErrors() override;
+
+    void OutputFrame(obs_source_frame *frame, long long ts);
     
     obs_source_t *source;
 
+    // Maps the device timestamps of packets to OBS time.
+    ClockMapper *clock = NULL;
+
+    // Frames go through this when it is enabled, instead of straight to OBS.
+    JitterBuffer *jitterBuffer = NULL;
+
+    // Records how long each packet spends in each stage.
+    PipelineStats *stats = NULL;
+
+    // Asked for a keyframe whenever the decoder is missing data.
+    KeyframeRequester *keyframeRequester = NULL;
+
 private:
     
     void *run() override;
+
+    // Called on the decode thread after the queue was flushed.
+    void Reset();
     
     void processPacketItem(PacketItem *packetItem);
     
     WorkQueue<PacketItem *> mQueue;
+
+    OverloadPolicy mOverloadPolicy;
+
+    std::atomic<uint64_t> mDecodeErrors{0};
     
     obs_source_frame video_frame;
     
     Decoder video_decoder;
 
+    ffmpeg_decode_threading mThreading = FFMPEG_DECODE_THREADING_SLICE;
+    int mThreadCount = 0;
+
+    // The packet being decoded, for the frames it outputs. With frame
+    // threading a frame comes out while a later packet is being decoded, so
+    // it is measured against that later packet.
+    uint64_t mReceiveTime = 0;
+    uint64_t mDecodeStartTime = 0;
+
     std::mutex mMutex;
 };
@@ -0,0 +1,233 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <util/platform.h>
+
+#include "JitterBuffer.hpp"
+
+// Assume 60 fps until the frame interval has been measured.
+static const double DefaultInterval = 1000000000.0 / 60.0;
+
+// Frames further apart than this are a pause in the stream, not a frame interval.
+static const uint64_t MaxInterval = 200000000ULL;
+
+JitterBuffer::JitterBuffer(): Thread("hs-jitter")
+{
+    resetEstimates();
+    this->start();
+}
+
+JitterBuffer::~JitterBuffer()
+{
+    this->Shutdown();
+}
+
+void JitterBuffer::setEnabled(bool enabled)
+{
+    if (mEnabled.exchange(enabled) && !enabled) {
+        flush();
+    }
+}
+
+void JitterBuffer::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mConditionVariable.notify_all();
+
+    this->join();
+    flush();
+}
+
+void JitterBuffer::resetEstimates()
+{
+    mHasPrevious = false;
+    mLastArrival = 0;
+    mLastTimestamp = 0;
+    mLastTransit = 0;
+    mInterval = DefaultInterval;
+    mJitter = 0;
+    mTransitFloor = 0;
+    mDelay = 0;
+}
+
+void JitterBuffer::flush()
+{
+    std::deque<Entry> frames;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        frames.swap(mFrames);
+        resetEstimates();
+    }
+
+    for (auto &entry : frames) {
+        entry.release(entry.opaque);
+    }
+}
+
+void JitterBuffer::push(const obs_source_frame &frame, bool hasCaptureTime,
+                        uint64_t receiveTime, uint64_t decodeTime,
+                        JitterBufferRelease release, void *opaque)
+{
+    const uint64_t now = os_gettime_ns();
+    Entry dropped = {};
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        uint64_t timestamp = hasCaptureTime ? frame.timestamp : now;
+
+        if (mHasPrevious) {
+            const uint64_t interval = hasCaptureTime ? timestamp - mLastTimestamp : now - mLastArrival;
+            if (interval > 0 && interval < MaxInterval) {
+                mInterval += ((double)interval - mInterval) / 16.0;
+            }
+
+            // Without a capture time the arrival times are all there is, so
+            // put the frame on an even grid and measure against that instead.
+            if (!hasCaptureTime) {
+                timestamp = mLastTimestamp + (uint64_t)mInterval;
+                if (now < timestamp || now - timestamp > MaxInterval) {
+                    timestamp = now;
+                }
+            }
+        }
+
+        const int64_t transit = (int64_t)(now - timestamp);
+
+        if (!mHasPrevious) {
+            mTransitFloor = (double)transit;
+            mDelay = (double)transit + mInterval;
+        } else {
+            // RFC 3550 style jitter, from the change in transit time.
+            mJitter += (std::fabs((double)(transit - mLastTransit)) - mJitter) / 16.0;
+
+            // The smallest transit time, allowed to creep up in case the
+            // clocks drift or the route gets slower.
+            if ((double)transit < mTransitFloor) {
+                mTransitFloor = (double)transit;
+            } else {
+                mTransitFloor += ((double)transit - mTransitFloor) / 512.0;
+            }
+        }
+
+        mHasPrevious = true;
+        mLastArrival = now;
+        mLastTimestamp = timestamp;
+        mLastTransit = transit;
+
+        const double margin = std::min(std::max(3.0 * mJitter, 0.5 * mInterval), MaxMarginFrames * mInterval);
+        const double target = mTransitFloor + margin;
+
+        if (mDelay < target) {
+            mDelay = target;
+        } else {
+            mDelay -= (mDelay - target) / 64.0;
+        }
+
+        uint64_t due = timestamp + (uint64_t)(int64_t)mDelay;
+        if (due < now) {
+            // Late, so wait longer for the frames that follow it.
+            mLateFrames++;
+            mDelay += (double)(now - due);
+            due = now;
+        }
+
+        Entry entry;
+        entry.frame = frame;
+        entry.due = due;
+        entry.receiveTime = receiveTime;
+        entry.decodeTime = decodeTime;
+        entry.release = release;
+        entry.opaque = opaque;
+        mFrames.push_back(entry);
+
+        if (mFrames.size() > MaxFrames) {
+            mDroppedFrames++;
+            dropped = mFrames.front();
+            mFrames.pop_front();
+        }
+    }
+
+    mConditionVariable.notify_one();
+
+    if (dropped.release != NULL) {
+        dropped.release(dropped.opaque);
+    }
+}
+
+JitterBufferStats JitterBuffer::getStats()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    JitterBufferStats stats;
+    stats.depth = (int)mFrames.size();
+    stats.delay = mDelay > 0 ? (uint64_t)mDelay : 0;
+    stats.jitter = (uint64_t)mJitter;
+    stats.lateFrames = mLateFrames;
+    stats.droppedFrames = mDroppedFrames;
+    return stats;
+}
+
+void *JitterBuffer::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (!mStopping) {
+        if (mFrames.empty()) {
+            mConditionVariable.wait(lock);
+            continue;
+        }
+
+        const uint64_t now = os_gettime_ns();
+        const uint64_t due = mFrames.front().due;
+
+        if (now < due) {
+            // Wake up early if a flush or shutdown happens in the meantime.
+            mConditionVariable.wait_for(lock, std::chrono::nanoseconds(due - now));
+            continue;
+        }
+
+        Entry entry = mFrames.front();
+        mFrames.pop_front();
+
+        lock.unlock();
+
+        if (source != NULL) {
+            entry.frame.timestamp = entry.due;
+            obs_source_output_video(source, &entry.frame);
+
+            if (stats != NULL) {
+                const uint64_t outputTime = PipelineStats::now();
+                stats->record(PIPELINE_STAGE_OUTPUT, entry.decodeTime, outputTime);
+                stats->record(PIPELINE_STAGE_TOTAL, entry.receiveTime, outputTime);
+                stats->countFrame();
+            }
+        }
+        entry.release(entry.opaque);
+
+        lock.lock();
+    }
+
+    return NULL;
+}
@@ -0,0 +1,132 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef JitterBuffer_hpp
+#define JitterBuffer_hpp
+
+#include <obs.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+#include "Thread.hpp"
+#include "PipelineStats.hpp"
+
+// Called once a buffered frame has been output, or dropped, so that the
+// decoder can release the memory the frame points to.
+typedef void (*JitterBufferRelease)(void *opaque);
+
+struct JitterBufferStats {
+    // Frames waiting to be output.
+    int depth;
+    // How long after its timestamp each frame is output.
+    uint64_t delay;
+    // Smoothed variation in the time frames take to arrive.
+    uint64_t jitter;
+    // Frames that arrived after they should have been output.
+    uint64_t lateFrames;
+    // Frames dropped because the buffer was full.
+    uint64_t droppedFrames;
+};
+
+// Holds decoded video frames for a short, adaptive amount of time and outputs
+// them to OBS at an even pace.
+//
+// Each frame is due at its timestamp plus a playout delay. The delay is kept
+// just above the smallest transit time seen (arrival time - timestamp) plus a
+// margin of three times the measured jitter, which is usually one or two
+// frames. A frame that arrives late raises the delay straight away; the delay
+// then decays back to the target slowly so that it doesn't oscillate.
+//
+// Frames without a capture time from the device are given timestamps on an
+// even grid at the measured frame interval.
+class JitterBuffer: private Thread
+{
+public:
+    JitterBuffer();
+    ~JitterBuffer();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() {
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+
+    // Queues a frame, whose data stays valid until release(opaque) is called.
+    // hasCaptureTime is false if frame.timestamp is just when it was decoded.
+    // receiveTime and decodeTime are the PipelineStats times of its packet.
+    void push(const obs_source_frame &frame, bool hasCaptureTime,
+              uint64_t receiveTime, uint64_t decodeTime,
+              JitterBufferRelease release, void *opaque);
+
+    // Drops every queued frame and starts measuring from scratch.
+    void flush();
+
+    void Shutdown();
+
+    JitterBufferStats getStats();
+
+    // The OBS Source to update.
+    obs_source_t *source = NULL;
+
+    // Records the output and total latency of each frame.
+    PipelineStats *stats = NULL;
+
+private:
+    struct Entry {
+        obs_source_frame frame;
+        uint64_t due;
+        uint64_t receiveTime;
+        uint64_t decodeTime;
+        JitterBufferRelease release;
+        void *opaque;
+    };
+
+    void *run() override;
+
+    void resetEstimates();
+
+    // Frames beyond this are dropped, oldest first.
+    static const size_t MaxFrames = 8;
+    // The margin is kept between half a frame and this many frames.
+    static constexpr double MaxMarginFrames = 4.0;
+
+    std::atomic<bool> mEnabled{false};
+
+    std::mutex mMutex;
+    std::condition_variable mConditionVariable;
+    bool mStopping = false;
+
+    std::deque<Entry> mFrames;
+
+    bool mHasPrevious = false;
+    uint64_t mLastArrival = 0;
+    uint64_t mLastTimestamp = 0;
+    int64_t mLastTransit = 0;
+
+    double mInterval = 0;
+    double mJitter = 0;
+    double mTransitFloor = 0;
+    double mDelay = 0;
+
+    uint64_t mLateFrames = 0;
+    uint64_t mDroppedFrames = 0;
+};
+
+#endif /* JitterBuffer_hpp */
@@ -0,0 +1,50 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <obs.h>
+#include <Packet.hpp>
+
+#include "KeyframeRequester.hpp"
+
+void KeyframeRequester::request(const char *reason)
+{
+    const uint64_t now = portal::monotonicTime();
+
+    const uint64_t last = lastSent.load(std::memory_order_acquire);
+    if (last != 0 && now - last < MinInterval) {
+        // Every packet until the keyframe asks, so only count the first.
+        if (suppressedAfter.exchange(last, std::memory_order_relaxed) != last) {
+            suppressed.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    // Both decoders may get here at once, and only one of them sends it.
+    if (sending.exchange(true, std::memory_order_acquire)) {
+        return;
+    }
+
+    // Nothing was sent if there is no device, so the next request tries again.
+    if (sender && sender()) {
+        lastSent.store(now, std::memory_order_release);
+        sent.fetch_add(1, std::memory_order_relaxed);
+        blog(LOG_INFO, "Asked the device for a keyframe (%s)", reason);
+    }
+
+    sending.store(false, std::memory_order_release);
+}
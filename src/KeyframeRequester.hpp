@@ -0,0 +1,74 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef KeyframeRequester_hpp
+#define KeyframeRequester_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+// Asks the phone for an IDR frame when a decoder can't carry on without one,
+// e.g. after packets were dropped or failed to decode, rather than waiting
+// for the encoder's next one, which can be several seconds away.
+//
+// Decoders call request() for every packet they can't use, from their own
+// threads. Only one request is sent per MinInterval, as an IDR frame is many
+// times the size of the frames around it.
+class KeyframeRequester
+{
+public:
+    // Sends the request to the device, returning false if there isn't one.
+    typedef std::function<bool()> Sender;
+
+    // Longer than a keyframe takes to arrive, so that it isn't asked for
+    // again while it is on its way.
+    static const uint64_t MinInterval = 500000000; // ns
+
+    // Set before the decoders are given any packets.
+    void setSender(Sender sender_) {
+        sender = sender_;
+    }
+
+    // *reason* is only for the log.
+    void request(const char *reason);
+
+    // Requests that were sent, and how many of those were asked for again
+    // before MinInterval had passed.
+    uint64_t getSent() {
+        return sent.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getSuppressed() {
+        return suppressed.load(std::memory_order_relaxed);
+    }
+
+private:
+    Sender sender;
+
+    std::atomic<uint64_t> lastSent{0};
+    std::atomic<bool> sending{false};
+
+    // The lastSent of the last request that was counted as suppressed.
+    std::atomic<uint64_t> suppressedAfter{0};
+
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> suppressed{0};
+};
+
+#endif /* KeyframeRequester_hpp */
@@ -0,0 +1,152 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018 Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef OverloadPolicy_hpp
+#define OverloadPolicy_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <Packet.hpp>
+
+#include "hyperstream-source.h"
+
+enum OverloadMode {
+    // Discard the rest of the GOP and resume at the next IDR frame.
+    OVERLOAD_MODE_SKIP_TO_KEYFRAME = 0,
+    // Decode everything, however far behind the decoder gets.
+    OVERLOAD_MODE_NEVER_DROP = 1,
+};
+
+struct OverloadStats {
+    // How many times the decoder fell behind and started skipping.
+    uint64_t overloads;
+    // Slices discarded while waiting for the next keyframe.
+    uint64_t skippedFrames;
+    // Packets that could not be queued because the queue was full.
+    uint64_t queueFullDrops;
+};
+
+// Decides which H.264 packets the video decoder should skip when it can't keep up.
+//
+// Each packet from the phone holds a single NAL unit behind a 4 byte start code.
+// Once the queue grows past the limit (or a packet has been lost before it was
+// queued) every slice is discarded until the next IDR frame, so the decoder is
+// never fed frames whose references are missing. Parameter sets are always kept.
+class OverloadPolicy
+{
+public:
+    OverloadPolicy(const char *name_) : name(name_) {}
+
+    void configure(OverloadMode mode_, int maxQueuedFrames_) {
+        mode = mode_;
+        maxQueuedFrames = maxQueuedFrames_;
+    }
+
+    // Called by the decoder thread for each packet it removes from the queue.
+    bool shouldDecode(const portal::Packet &packet, int queueSize) {
+        const int naluType = packet.size() > 4 ? (packet[4] & 0x1F) : -1;
+
+        if (mode == OVERLOAD_MODE_NEVER_DROP) {
+            packetLost.store(false, std::memory_order_relaxed);
+            resyncing.store(false, std::memory_order_relaxed);
+            return true;
+        }
+
+        const bool lost = packetLost.exchange(false, std::memory_order_relaxed);
+        const bool resync = resyncing.exchange(false, std::memory_order_relaxed);
+
+        if (!skipping && (lost || resync || queueSize > maxQueuedFrames)) {
+            skipping = true;
+            skippedThisOverload = 0;
+
+            // A new stream isn't the decoder falling behind.
+            if (!resync || lost) {
+                overloads++;
+            }
+
+            if (!lost && !resync) {
+                blog(LOG_WARNING, "%s decoding queue overloaded. %d frames behind. Please use a lower quality setting.", name, queueSize);
+            }
+        }
+
+        if (!skipping) {
+            return true;
+        }
+
+        // Keep the parameter sets so that the next IDR can be decoded.
+        if (naluType == 7 || naluType == 8) {
+            return true;
+        }
+
+        if (naluType == 5) {
+            skipping = false;
+            if (skippedThisOverload > 0) {
+                blog(LOG_INFO, "%s decoder resumed at keyframe after skipping %d frames", name, skippedThisOverload);
+            }
+            return true;
+        }
+
+        // Only coded slices depend on the skipped frames, anything else (SEI etc.) can go through.
+        if (naluType >= 1 && naluType <= 4) {
+            skippedThisOverload++;
+            skippedFrames++;
+            return false;
+        }
+
+        return true;
+    }
+
+    // Called by the receiving thread when a packet couldn't be queued.
+    void queueFull() {
+        queueFullDrops++;
+        packetLost.store(true, std::memory_order_relaxed);
+    }
+
+    // Called when the stream starts again part way through, e.g. after the
+    // decoder was flushed, so that it waits for the next keyframe.
+    void resync() {
+        resyncing.store(true, std::memory_order_relaxed);
+    }
+
+    OverloadStats getStats() {
+        OverloadStats stats;
+        stats.overloads = overloads.load(std::memory_order_relaxed);
+        stats.skippedFrames = skippedFrames.load(std::memory_order_relaxed);
+        stats.queueFullDrops = queueFullDrops.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    const char *name;
+
+    std::atomic<OverloadMode> mode{OVERLOAD_MODE_SKIP_TO_KEYFRAME};
+    std::atomic<int> maxQueuedFrames{25};
+
+    // Only touched by the decoder thread.
+    bool skipping = false;
+    int skippedThisOverload = 0;
+
+    std::atomic<bool> packetLost{false};
+    std::atomic<bool> resyncing{false};
+
+    std::atomic<uint64_t> overloads{0};
+    std::atomic<uint64_t> skippedFrames{0};
+    std::atomic<uint64_t> queueFullDrops{0};
+};
+
+#endif /* OverloadPolicy_hpp */
@@ -0,0 +1,160 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+
+#include "PipelineStats.hpp"
+
+int LatencyHistogram::bucketIndex(uint64_t value)
+{
+    if (value < 2 * SubBuckets) {
+        return (int)value;
+    }
+
+    if (value >> 32) {
+        return BucketCount - 1;
+    }
+
+    // The top SubBucketBits + 1 bits of the value pick the bucket.
+    int shift = 1;
+    while ((value >> shift) >= 2 * SubBuckets) {
+        shift++;
+    }
+    const int subBucket = (int)(value >> shift) - SubBuckets;
+    return 2 * SubBuckets + (shift - 1) * SubBuckets + subBucket;
+}
+
+uint64_t LatencyHistogram::bucketValue(int index)
+{
+    if (index < 2 * SubBuckets) {
+        return index;
+    }
+
+    const int shift = (index - 2 * SubBuckets) / SubBuckets + 1;
+    const int subBucket = (index - 2 * SubBuckets) % SubBuckets;
+
+    // The middle of the bucket.
+    const uint64_t lowest = (uint64_t)(SubBuckets + subBucket) << shift;
+    return lowest + ((1ULL << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds)
+{
+    const uint64_t value = nanoseconds / 1000;
+
+    mCounts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    mTotal.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t max = mMax.load(std::memory_order_relaxed);
+    while (value > max && !mMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+LatencySummary LatencyHistogram::summarize(bool reset)
+{
+    uint64_t counts[BucketCount];
+    uint64_t count = 0;
+
+    for (int i = 0; i < BucketCount; i++) {
+        counts[i] = reset ? mCounts[i].exchange(0, std::memory_order_relaxed)
+                          : mCounts[i].load(std::memory_order_relaxed);
+        count += counts[i];
+    }
+
+    const uint64_t total = reset ? mTotal.exchange(0, std::memory_order_relaxed) : mTotal.load(std::memory_order_relaxed);
+    const uint64_t max = reset ? mMax.exchange(0, std::memory_order_relaxed) : mMax.load(std::memory_order_relaxed);
+
+    LatencySummary summary = {};
+    summary.count = count;
+    summary.max = max;
+
+    if (count == 0) {
+        return summary;
+    }
+
+    summary.mean = total / count;
+
+    const uint64_t ranks[] = {(count * 50 + 99) / 100, (count * 90 + 99) / 100, (count * 99 + 99) / 100};
+    uint64_t *percentiles[] = {&summary.p50, &summary.p90, &summary.p99};
+
+    uint64_t seen = 0;
+    int next = 0;
+    for (int i = 0; i < BucketCount && next < 3; i++) {
+        seen += counts[i];
+        while (next < 3 && seen >= ranks[next]) {
+            // A bucket's middle may be a little above the largest value in it.
+            *percentiles[next] = std::min(bucketValue(i), max);
+            next++;
+        }
+    }
+
+    return summary;
+}
+
+const char *PipelineStats::stageName(PipelineStage stage)
+{
+    switch (stage) {
+        case PIPELINE_STAGE_FRAMING:
+            return "framing";
+        case PIPELINE_STAGE_DELIVERY:
+            return "delivery";
+        case PIPELINE_STAGE_QUEUE:
+            return "queue";
+        case PIPELINE_STAGE_DECODE:
+            return "decode";
+        case PIPELINE_STAGE_OUTPUT:
+            return "output";
+        case PIPELINE_STAGE_TOTAL:
+            return "total";
+        default:
+            return "unknown";
+    }
+}
+
+void PipelineStats::recordRecovery()
+{
+    // Only the first frame after the loss gets it.
+    const uint64_t lostTime = mLostTime.exchange(0);
+    if (lostTime == 0) {
+        return;
+    }
+
+    const uint64_t recovery = now() - lostTime;
+    mRecovery.record(recovery);
+    mLastRecovery.store(recovery / 1000, std::memory_order_relaxed);
+    mRecoveries.fetch_add(1, std::memory_order_relaxed);
+}
+
+PipelineSnapshot PipelineStats::snapshot(bool reset)
+{
+    PipelineSnapshot snapshot = {};
+
+    for (int i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+        snapshot.stages[i] = mStages[i].summarize(reset);
+    }
+
+    snapshot.videoPackets = mVideoPackets.load(std::memory_order_relaxed);
+    snapshot.audioPackets = mAudioPackets.load(std::memory_order_relaxed);
+    snapshot.bytes = mBytes.load(std::memory_order_relaxed);
+    snapshot.frames = mFrames.load(std::memory_order_relaxed);
+    snapshot.recovery = mRecovery.summarize(reset);
+    snapshot.recoveries = mRecoveries.load(std::memory_order_relaxed);
+    snapshot.lastRecovery = mLastRecovery.load(std::memory_order_relaxed);
+    snapshot.time = now();
+
+    return snapshot;
+}
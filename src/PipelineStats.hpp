@@ -0,0 +1,169 @@
+/*
+ hyperstream-source
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+#ifndef PipelineStats_hpp
+#define PipelineStats_hpp
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <Packet.hpp>
+
+// The latency of each step a video packet goes through, in order.
+enum PipelineStage {
+    // The frame header was read from the socket -> the whole payload was read.
+    PIPELINE_STAGE_FRAMING = 0,
+    // Parsed -> added to the decoder's queue.
+    PIPELINE_STAGE_DELIVERY,
+    // Added to the queue -> taken off it by the decoder thread.
+    PIPELINE_STAGE_QUEUE,
+    // Handed to the decoder -> the decoder output a frame.
+    PIPELINE_STAGE_DECODE,
+    // Decoded -> obs_source_output_video returned, including any time spent
+    // in the jitter buffer.
+    PIPELINE_STAGE_OUTPUT,
+    // Read from the socket -> output to OBS.
+    PIPELINE_STAGE_TOTAL,
+    PIPELINE_STAGE_COUNT
+};
+
+// Latencies in microseconds.
+struct LatencySummary {
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+};
+
+// A histogram of latencies that can be recorded from any thread without a lock.
+//
+// Like an HdrHistogram, the buckets are linear within each power of two, so
+// every value is kept to within 1/16th (about 6%) of what was recorded, from
+// a microsecond up to over an hour, in a fixed amount of memory.
+class LatencyHistogram
+{
+public:
+    void record(uint64_t nanoseconds);
+
+    // Summarises what has been recorded, optionally starting again.
+    LatencySummary summarize(bool reset);
+
+private:
+    static const int SubBucketBits = 4;
+    static const int SubBuckets = 1 << SubBucketBits;
+    // Values below 2 * SubBuckets get a bucket each, then SubBuckets for
+    // each power of two up to 2^32 microseconds.
+    static const int BucketCount = 2 * SubBuckets + (32 - SubBucketBits - 1) * SubBuckets;
+
+    static int bucketIndex(uint64_t value);
+    static uint64_t bucketValue(int index);
+
+    std::atomic<uint64_t> mCounts[BucketCount] = {};
+    std::atomic<uint64_t> mTotal{0};
+    std::atomic<uint64_t> mMax{0};
+};
+
+struct PipelineSnapshot {
+    // Latency since the histograms were last reset.
+    LatencySummary stages[PIPELINE_STAGE_COUNT];
+
+    // Running totals, never reset. Rates come from the difference between
+    // two snapshots.
+    uint64_t videoPackets;
+    uint64_t audioPackets;
+    uint64_t bytes;
+    uint64_t frames;
+
+    // How long video took to come back after the connection was lost, since
+    // the histograms were last reset. The count and the latest (in
+    // microseconds) are never reset.
+    LatencySummary recovery;
+    uint64_t recoveries;
+    uint64_t lastRecovery;
+
+    // When the snapshot was taken, in PipelineStats::now().
+    uint64_t time;
+};
+
+// Collects the per stage latency and throughput of a source.
+//
+// Each stage is recorded by whichever thread sees the end of it, with start
+// and end times from PipelineStats::now().
+class PipelineStats
+{
+public:
+    static uint64_t now() {
+        return portal::monotonicTime();
+    }
+
+    static const char *stageName(PipelineStage stage);
+
+    // Ignores stages that didn't have a start time recorded.
+    void record(PipelineStage stage, uint64_t start, uint64_t end) {
+        if (start != 0 && end >= start) {
+            mStages[stage].record(end - start);
+        }
+    }
+
+    void countPacket(size_t size, bool audio) {
+        (audio ? mAudioPackets : mVideoPackets).fetch_add(1, std::memory_order_relaxed);
+        mBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void countFrame() {
+        mFrames.fetch_add(1, std::memory_order_relaxed);
+
+        if (mLostTime.load(std::memory_order_relaxed) != 0) {
+            recordRecovery();
+        }
+    }
+
+    // Starts timing how long video takes to come back, which the next frame
+    // stops. Losing the connection again before then keeps the first time.
+    void connectionLost() {
+        uint64_t expected = 0;
+        mLostTime.compare_exchange_strong(expected, now());
+    }
+
+    // Stops timing without recording anything, e.g. if the device was changed.
+    void cancelRecovery() {
+        mLostTime.store(0);
+    }
+
+    // Optionally resets the histograms once they have been read.
+    PipelineSnapshot snapshot(bool reset);
+
+private:
+    void recordRecovery();
+
+    LatencyHistogram mStages[PIPELINE_STAGE_COUNT];
+
+    std::atomic<uint64_t> mLostTime{0};
+    LatencyHistogram mRecovery;
+    std::atomic<uint64_t> mRecoveries{0};
+    std::atomic<uint64_t> mLastRecovery{0};
+
+    std::atomic<uint64_t> mVideoPackets{0};
+    std::atomic<uint64_t> mAudioPackets{0};
+    std::atomic<uint64_t> mBytes{0};
+    std::atomic<uint64_t> mFrames{0};
+};
+
+#endif /* PipelineStats_hpp */
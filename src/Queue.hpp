@@ -19,20 +19,26 @@
 #ifndef WorkQueue_hpp
 #define WorkQueue_hpp
 
-#include <list>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <Packet.hpp>
+
+#include "EventCount.hpp"
 
 class PacketItem
 {
-    std::vector<char> mPacket;
+    portal::Packet mPacket;
     int mType;
     int mTag;
+    uint64_t mQueueTime = 0;
     
 public:
-    PacketItem(std::vector<char> packet, int type, int tag): mPacket(packet), mType(type), mTag(tag) { }
+    PacketItem(portal::Packet packet, int type, int tag): mPacket(std::move(packet)), mType(type), mTag(tag) { }
     
-    std::vector<char> getPacket() {
+    portal::Packet &getPacket() {
         return mPacket;
     }
     
@@ -43,20 +49,46 @@ public:
     int getTag() {
         return mTag;
     }
+
+    // When the item was added to the queue, for PipelineStats.
+    uint64_t getQueueTime() {
+        return mQueueTime;
+    }
+
+    void setQueueTime(uint64_t queueTime) {
+        mQueueTime = queueTime;
+    }
 };
 
+// A bounded, lock-free single-producer/single-consumer queue.
+//
+// add() must only be called from one thread (the Channel receive thread) and
+// remove()/tryRemove() from one other thread (the decoder thread). The
+// consumer sleeps on an EventCount while the queue is empty, so the producer
+// never takes a lock and only makes a syscall when the consumer is asleep.
 template <typename T> class WorkQueue
 {
-    // The Queue that will contain the work items
-    std::list<T> m_queue;
-    
-    // The mutext that we'll use to lock access to the queue
-    std::mutex mMutex;
-    
-    // The Condition variable that determines when remove() can stop
-    // waiting because there is either a new item in the queue, or
-    // the queue should stop.
-    std::condition_variable mConditionVariable;
+    static constexpr size_t CacheLineSize = 64;
+    static constexpr size_t DefaultCapacity = 512;
+
+    // The indexes written by each side live on their own cache line so that the
+    // producer and consumer don't keep invalidating each other's cache. Each side
+    // also keeps a cached copy of the other side's index so that it only has to
+    // read the shared one when the queue looks full (or empty).
+
+    // Written by the consumer.
+    alignas(CacheLineSize) std::atomic<size_t> mHead{0};
+    size_t mCachedTail = 0;
+
+    // Written by the producer.
+    alignas(CacheLineSize) std::atomic<size_t> mTail{0};
+    size_t mCachedHead = 0;
+
+    alignas(CacheLineSize) std::unique_ptr<T[]> mSlots;
+    size_t mCapacity;
+
+    // Signalled whenever an item is added, or the queue should stop or be cleared.
+    EventCount mEvent;
     
     // Whether the queue should stop.
     // This is required becuase there was an deadlock issue where trying to
@@ -64,49 +96,163 @@ template <typename T> class WorkQueue
     // return.
     // This stackoverflow question explains in more detail
     // https://stackoverflow.com/q/21757124
-    bool m_shouldStop = false;
-    
+    std::atomic<bool> m_shouldStop{false};
+
+    // clear() can be called from any thread, so it only marks how far the
+    // queue should be emptied and leaves the emptying to the consumer. Each
+    // clear() bumps the generation, which the consumer compares with the last
+    // one it handled.
+    std::atomic<uint64_t> mClearGeneration{0};
+    std::atomic<size_t> mClearTail{0};
+    uint64_t mHandledGeneration = 0;
+    bool mCleared = false;
+
+    static void discard(T &item) {
+        if constexpr (std::is_pointer<T>::value) {
+            delete item;
+        }
+        item = T();
+    }
+
+    void discardAll() {
+        T item = T();
+        while (tryRemove(item)) {
+            discard(item);
+        }
+    }
+
+    bool empty() {
+        return mHead.load(std::memory_order_relaxed) == mTail.load(std::memory_order_acquire);
+    }
+
+    bool clearRequested() {
+        return mClearGeneration.load(std::memory_order_acquire) != mHandledGeneration;
+    }
+
+    // Consumer only. Discards what was queued before the last clear(), but
+    // not what the producer has added since.
+    void handleClear() {
+        mHandledGeneration = mClearGeneration.load(std::memory_order_acquire);
+        const size_t clearTail = mClearTail.load(std::memory_order_acquire);
+
+        T item = T();
+        while ((ptrdiff_t)(clearTail - mHead.load(std::memory_order_relaxed)) > 0 && tryRemove(item)) {
+            discard(item);
+        }
+        mCleared = true;
+    }
+
 public:
     
-    WorkQueue() {
+    explicit WorkQueue(size_t capacity = DefaultCapacity) {
+        // Round up to a power of two so that indexes can be masked.
+        mCapacity = 1;
+        while (mCapacity < capacity) {
+            mCapacity <<= 1;
+        }
+        mSlots.reset(new T[mCapacity]());
     }
     ~WorkQueue() {
+        discardAll();
+    }
+
+    // Producer only. Returns false if the queue is full, in which case the
+    // caller still owns the item.
+    bool add(T item) {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mCachedHead >= mCapacity) {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            if (tail - mCachedHead >= mCapacity) {
+                return false;
+            }
+        }
+
+        mSlots[tail & (mCapacity - 1)] = std::move(item);
+        mTail.store(tail + 1, std::memory_order_release);
+        mEvent.notify();
+        return true;
     }
-    void add(T item) {
-        mMutex.lock();
-        m_queue.push_back(item);
-        mConditionVariable.notify_all();
-        mMutex.unlock();
-//        printf("Added item. item count: %d\n", this->size());
+
+    // Consumer only. Returns false straight away if the queue is empty.
+    bool tryRemove(T &item) {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mCachedTail) {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            if (head == mCachedTail) {
+                return false;
+            }
+        }
+
+        item = std::move(mSlots[head & (mCapacity - 1)]);
+        mSlots[head & (mCapacity - 1)] = T();
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
     }
+
+    // Consumer only. Blocks until there is an item, or returns NULL once the
+    // queue has been stopped or has just been cleared (see takeCleared()).
     T remove() {
-        std::unique_lock<std::mutex> lock (mMutex);
-
-        mConditionVariable.wait(lock, [&](){ return m_shouldStop || !m_queue.empty(); });
-        
-        if (m_queue.size() > 0) {
-            T item = m_queue.front();
-            m_queue.pop_front();
-            lock.unlock();
-//            printf("Removed item. item count: %d\n", this->size());
-            return item;
-        } else {
-            lock.unlock();
-            printf("No item to remove. item count: %d\n", this->size());
-            return NULL;
+        T item = T();
+
+        while (true) {
+            if (m_shouldStop) {
+                return T();
+            }
+
+            if (clearRequested()) {
+                handleClear();
+                return T();
+            }
+
+            if (tryRemove(item)) {
+                return item;
+            }
+
+            uint32_t key = mEvent.prepareWait();
+            if (m_shouldStop || clearRequested() || !empty()) {
+                mEvent.cancelWait();
+                continue;
+            }
+            mEvent.wait(key);
         }
-        
     }
+
+    // The number of items in the queue. This doesn't take a lock, so it is
+    // only a snapshot when called from the producer.
     int size() {
-        mMutex.lock();
-        int size = m_queue.size();
-        mMutex.unlock();
-        return size;
+        const size_t head = mHead.load(std::memory_order_acquire);
+        const size_t tail = mTail.load(std::memory_order_acquire);
+        return (int)(tail - head);
+    }
+
+    // Discards every item in the queue. It doesn't wait: the consumer empties
+    // the queue before it next returns from remove(), which may be after the
+    // item it is working on, so this can be called from any thread, including
+    // the reactor. The items are deleted by the destructor once the queue has
+    // been stopped.
+    void clear() {
+        // Only ever moves forwards, in case two threads clear at once.
+        size_t tail = mTail.load(std::memory_order_acquire);
+        size_t clearTail = mClearTail.load(std::memory_order_relaxed);
+        while ((ptrdiff_t)(tail - clearTail) > 0 &&
+               !mClearTail.compare_exchange_weak(clearTail, tail, std::memory_order_release)) {
+        }
+
+        mClearGeneration.fetch_add(1, std::memory_order_acq_rel);
+        mEvent.notify();
+    }
+
+    // Consumer only. Returns true once after remove() has cleared the queue,
+    // so the consumer can reset whatever state belonged to the old items.
+    bool takeCleared() {
+        const bool cleared = mCleared;
+        mCleared = false;
+        return cleared;
     }
     
     void stop(){
         m_shouldStop = true;
-        mConditionVariable.notify_all();
+        mEvent.notify();
     }
 };
 
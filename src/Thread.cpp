@@ -16,9 +16,16 @@
  with this program. If not, see <https://www.gnu.org/licenses/>
  */
 
+#include <obs.h>
+
 #include "Thread.hpp"
 
-Thread::Thread(): mThread(nullptr), mRunning(false), mShouldStop(false) { }
+Thread::Thread(): mThread(nullptr), mRunning(false), mShouldStop(false), mConfigChanged(false) { }
+
+Thread::Thread(const char *name): Thread()
+{
+    mName = name;
+}
 
 Thread::~Thread()
 {
@@ -44,6 +51,17 @@ void Thread::start()
     mShouldStop = false;
 
     mThread = new std::thread([this]{
+        if (!mName.empty()) {
+            portal::setCurrentThreadName(mName);
+        }
+
+        // Only what has been changed from the defaults needs applying.
+        {
+            std::lock_guard<std::mutex> lock(mConfigMutex);
+            mConfigChanged = mPriority != portal::ThreadPriority::Normal || !mCpus.empty();
+        }
+        this->applyThreadConfig();
+
         this->run();
     });
 
@@ -68,3 +86,44 @@ void Thread::join()
     mRunning = false;
 }
 
+
+void Thread::setPriority(portal::ThreadPriority priority)
+{
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    if (priority != mPriority) {
+        mPriority = priority;
+        mConfigChanged = true;
+    }
+}
+
+void Thread::setAffinity(const std::vector<int> &cpus)
+{
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    if (cpus != mCpus) {
+        mCpus = cpus;
+        mConfigChanged = true;
+    }
+}
+
+void Thread::applyThreadConfig()
+{
+    if (!mConfigChanged.exchange(false)) {
+        return;
+    }
+
+    portal::ThreadPriority priority;
+    std::vector<int> cpus;
+    {
+        std::lock_guard<std::mutex> lock(mConfigMutex);
+        priority = mPriority;
+        cpus = mCpus;
+    }
+
+    if (!portal::setCurrentThreadPriority(priority)) {
+        blog(LOG_WARNING, "Could not give the %s thread %s priority", mName.c_str(), portal::threadPriorityName(priority));
+    }
+
+    if (!portal::setCurrentThreadAffinity(cpus)) {
+        blog(LOG_WARNING, "Could not keep the %s thread to the chosen CPUs", mName.c_str());
+    }
+}
@@ -22,11 +22,17 @@
 #include <stdio.h>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <ThreadConfig.hpp>
 
 class Thread
 {
 public:
     Thread();
+    // *name* shows up in debuggers and profilers, Linux keeps 15 characters.
+    explicit Thread(const char *name);
     virtual ~Thread();
     
     void start();
@@ -39,12 +45,28 @@ public:
     bool shouldStop() {
         return mShouldStop.load();
     }
+
+    // Take effect when the thread starts, or when it next calls
+    // applyThreadConfig() if it is already running.
+    void setPriority(portal::ThreadPriority priority);
+    void setAffinity(const std::vector<int> &cpus);
+
+protected:
+    // Called by run() loops to pick up changes to the priority or affinity.
+    void applyThreadConfig();
     
 private:
     
     std::thread *mThread;
     std::atomic<bool> mRunning;
     std::atomic<bool> mShouldStop;
+
+    std::string mName;
+
+    std::mutex mConfigMutex;
+    portal::ThreadPriority mPriority = portal::ThreadPriority::Normal;
+    std::vector<int> mCpus;
+    std::atomic<bool> mConfigChanged;
 };
 
 #endif /* Thread_hpp */
@@ -21,6 +21,9 @@
 
 #include <obs.h>
 #include <vector>
+#include <Packet.hpp>
+
+#include "OverloadPolicy.hpp"
 
 class VideoDecoderCallback {
 public:
@@ -32,10 +35,16 @@ protected:
     virtual ~VideoDecoder() {};
 public:
     virtual void Init() = 0;
-    virtual void Input(std::vector<char> packet, int type, int tag) = 0;
+    virtual void Input(portal::Packet packet, int type, int tag) = 0;
     virtual void Flush() = 0;
     virtual void Drain() = 0;
     virtual void Shutdown() = 0;
+
+    // For the stats panel. Packets waiting to be decoded, packets that were
+    // dropped to catch up, and packets that failed to decode.
+    virtual int GetQueueDepth() { return 0; }
+    virtual OverloadStats GetOverloadStats() { return OverloadStats{}; }
+    virtual uint64_t GetDecodeErrors() { return 0; }
 };
 
 #endif /* VideoDecoderCallback_h */
@@ -20,7 +20,7 @@
 
 #define NAL_LENGTH_PREFIX_SIZE 4
 
-VideoToolboxDecoder::VideoToolboxDecoder()
+VideoToolboxDecoder::VideoToolboxDecoder(): Thread("hs-vt-decode"), mOverloadPolicy("VideoToolbox")
 {
     waitingForSps = true;
     waitingForPps = true;
@@ -43,13 +43,20 @@ void VideoToolboxDecoder::Init()
 
 void VideoToolboxDecoder::Flush()
 {
-    // Clear the queue
-    while(this->mQueue.size() > 0) {
-        this->mQueue.remove();
-    }
+    // Clear the queue. The decode thread resets the session once it has
+    // emptied it, so this doesn't wait for the frame being decoded.
+    this->mQueue.clear();
+}
 
-    VTDecompressionSessionInvalidate(mSession);
+void VideoToolboxDecoder::Reset()
+{
+    if (mSession != NULL) {
+        VTDecompressionSessionInvalidate(mSession);
+    }
     mSession = NULL;
+
+    // Whatever comes next refers to frames that were thrown away.
+    mOverloadPolicy.resync();
 }
 
 void VideoToolboxDecoder::Drain()
@@ -73,9 +80,25 @@ void VideoToolboxDecoder::Shutdown()
 void *VideoToolboxDecoder::run() {
 
     while (shouldStop() == false) {
+        applyThreadConfig();
+
         PacketItem *item = (PacketItem *)mQueue.remove();
+
+        if (mQueue.takeCleared()) {
+            this->Reset();
+        }
+
         if (item != NULL) {
-            this->processPacketItem(item);
+            if (stats != NULL) {
+                stats->record(PIPELINE_STAGE_QUEUE, item->getQueueTime(), PipelineStats::now());
+            }
+
+            // Skip the rest of the GOP if we have fallen too far behind.
+            if (mOverloadPolicy.shouldDecode(item->getPacket(), mQueue.size())) {
+                this->processPacketItem(item);
+            } else if (keyframeRequester != NULL) {
+                keyframeRequester->request("skipping to keyframe");
+            }
         }
         delete item;
     }
@@ -85,7 +108,7 @@ void *VideoToolboxDecoder::run() {
 
 void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
 {
-    auto packet = packetItem->getPacket();
+    auto &packet = packetItem->getPacket();
 
     //    blog(LOG_INFO, "Input");
 
@@ -106,7 +129,7 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
         // NALU is the SPS Parameter
         if (naluType == 7) {
 
-            spsData = std::vector<char>(packet.begin() + 4, packet.end() + (frameSize - 4));
+            spsData = std::vector<char>(packet.data() + 4, packet.data() + frameSize);
 
             waitingForSps = false;
             waitingForPps = true;
@@ -116,7 +139,7 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
         // NALU is the PPS Parameter
         if (naluType == 8) {
 
-            ppsData = std::vector<char>(packet.begin() + 4, packet.end() + (frameSize - 4));
+            ppsData = std::vector<char>(packet.data() + 4, packet.data() + frameSize);
 
             waitingForPps = false;
         }
@@ -258,28 +281,81 @@ void VideoToolboxDecoder::processPacketItem(PacketItem *packetItem)
     VTDecodeFrameFlags flags = 0;
     VTDecodeInfoFlags flagOut;
 
-    auto now = os_gettime_ns();
+    // Pass the capture time through to the output callback, 0 if the device didn't send one.
+    uint64_t timestamp = 0;
+    if (packet.timestamp() != 0 && clock != NULL) {
+        timestamp = clock->map(packet.timestamp());
+    }
+
+    mReceiveTime = packet.receiveTime();
+    mDecodeStartTime = PipelineStats::now();
 
     VTDecompressionSessionDecodeFrame(mSession, sampleBuffer, flags,
-                                      (void*)now, &flagOut);
+                                      (void*)(uintptr_t)timestamp, &flagOut);
+
+    mReceiveTime = 0;
+    mDecodeStartTime = 0;
 
     CFRelease(sampleBuffer);
 }
 
 
 
-void VideoToolboxDecoder::Input(std::vector<char> packet, int type, int tag)
+void VideoToolboxDecoder::Input(portal::Packet packet, int type, int tag)
 {
+    const uint64_t queueTime = PipelineStats::now();
+    if (stats != NULL) {
+        stats->record(PIPELINE_STAGE_DELIVERY, packet.parseTime(), queueTime);
+    }
+
     // Create a new packet item and enqueue it.
-    PacketItem *item = new PacketItem(packet, type, tag);
-    this->mQueue.add(item);
+    PacketItem *item = new PacketItem(std::move(packet), type, tag);
+    item->setQueueTime(queueTime);
+    if (!this->mQueue.add(item)) {
+        // The decoder has stalled and the queue is full.
+        mOverloadPolicy.queueFull();
+        delete item;
+    }
+}
+
+void VideoToolboxDecoder::SetOverloadPolicy(OverloadMode mode, int maxQueuedFrames)
+{
+    mOverloadPolicy.configure(mode, maxQueuedFrames);
 }
 
-void VideoToolboxDecoder::OutputFrame(CVPixelBufferRef pixelBufferRef)
+int VideoToolboxDecoder::GetQueueDepth()
+{
+    return mQueue.size();
+}
+
+OverloadStats VideoToolboxDecoder::GetOverloadStats()
+{
+    return mOverloadPolicy.getStats();
+}
+
+uint64_t VideoToolboxDecoder::GetDecodeErrors()
+{
+    return mDecodeErrors.load(std::memory_order_relaxed);
+}
+
+static void
+ReleasePixelBuffer(void *opaque)
+{
+    CVPixelBufferRef image = static_cast<CVPixelBufferRef>(opaque);
+    CVPixelBufferUnlockBaseAddress(image, kCVPixelBufferLock_ReadOnly);
+    CVPixelBufferRelease(image);
+}
+
+void VideoToolboxDecoder::OutputFrame(CVPixelBufferRef pixelBufferRef, uint64_t timestamp)
 {
     CVImageBufferRef     image = pixelBufferRef;
     //        obs_source_frame *frame = frame;
 
+    const uint64_t decodeTime = PipelineStats::now();
+    if (stats != NULL) {
+        stats->record(PIPELINE_STAGE_DECODE, mDecodeStartTime, decodeTime);
+    }
+
     // CMTime target_pts =
     // CMSampleBufferGetOutputPresentationTimeStamp(sampleBuffer);
     // CMTime target_pts_nano = CMTimeConvertScale(target_pts, NANO_TIMESCALE,
@@ -292,8 +368,26 @@ void VideoToolboxDecoder::OutputFrame(CVPixelBufferRef pixelBufferRef)
         return;
     }
 
+    if (timestamp != 0) {
+        frame.timestamp = timestamp;
+    }
+
+    if (jitterBuffer != NULL && jitterBuffer->isEnabled()) {
+        // Keep the pixel buffer locked until the jitter buffer has output it.
+        CVPixelBufferRetain(image);
+        jitterBuffer->push(frame, timestamp != 0, mReceiveTime, decodeTime, ReleasePixelBuffer, image);
+        return;
+    }
+
     obs_source_output_video(source, &frame);
 
+    if (stats != NULL) {
+        const uint64_t outputTime = PipelineStats::now();
+        stats->record(PIPELINE_STAGE_OUTPUT, decodeTime, outputTime);
+        stats->record(PIPELINE_STAGE_TOTAL, mReceiveTime, outputTime);
+        stats->countFrame();
+    }
+
     CVPixelBufferUnlockBaseAddress(image, kCVPixelBufferLock_ReadOnly);
 }
 
@@ -306,19 +400,19 @@ DecompressionSessionDecodeFrameCallback(void *decompressionOutputRefCon,
                                         CMTime presentationTimeStamp,
                                         CMTime presentationDuration)
 {
-    UNUSED_PARAMETER(sourceFrameRefCon);
     UNUSED_PARAMETER(presentationTimeStamp);
     UNUSED_PARAMETER(presentationDuration);
 
     VideoToolboxDecoder* decoder = static_cast<VideoToolboxDecoder*>(decompressionOutputRefCon);
 
     if (status != noErr || !imageBuffer) {
+        decoder->DecodeError();
         blog(LOG_INFO, "VideoToolbox decoder returned no image");
     } else if (infoFlags & kVTDecodeInfo_FrameDropped) {
         blog(LOG_INFO, "VideoToolbox dropped frame");
     }
 
-    decoder->OutputFrame(imageBuffer);
+    decoder->OutputFrame(imageBuffer, (uint64_t)(uintptr_t)sourceFrameRefCon);
 }
 
 void VideoToolboxDecoder::createDecompressionSession()
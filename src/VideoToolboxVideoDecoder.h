@@ -26,6 +26,11 @@
 #include "Queue.hpp"
 #include "Thread.hpp"
 #include "VideoDecoder.h"
+#include "OverloadPolicy.hpp"
+#include "ClockMapper.hpp"
+#include "JitterBuffer.hpp"
+#include "KeyframeRequester.hpp"
+#include "PipelineStats.hpp"
 
 class VideoToolboxDecoder: public VideoDecoder, private Thread
 {
@@ -35,22 +40,53 @@ public:
 
     void Init() override;
     
-    void Input(std::vector<char> packet, int type, int tag) override;
+    void Input(portal::Packet packet, int type, int tag) override;
     
     void Flush() override;
     void Drain() override;
     void Shutdown() override;
+
+    void SetOverloadPolicy(OverloadMode mode, int maxQueuedFrames);
+
+    using Thread::setAffinity;
+
+    int GetQueueDepth() override;
+    OverloadStats GetOverloadStats() override;
+    uint64_t GetDecodeErrors() override;
+
+    void DecodeError() {
+        mDecodeErrors.fetch_add(1, std::memory_order_relaxed);
+
+        if (keyframeRequester != NULL) {
+            keyframeRequester->request("decode error");
+        }
+    }
     
-    void OutputFrame(CVPixelBufferRef pixelBufferRef);
+    void OutputFrame(CVPixelBufferRef pixelBufferRef, uint64_t timestamp);
         
     bool update_frame(obs_source_t *capture, obs_source_frame *frame, CVImageBufferRef imageBufferRef, CMVideoFormatDescriptionRef formatDesc);
     
     // The OBS Source to update.
     obs_source_t *source;
+
+    // Maps the device timestamps of packets to OBS time.
+    ClockMapper *clock = NULL;
+
+    // Frames go through this when it is enabled, instead of straight to OBS.
+    JitterBuffer *jitterBuffer = NULL;
+
+    // Records how long each packet spends in each stage.
+    PipelineStats *stats = NULL;
+
+    // Asked for a keyframe whenever the decoder is missing data.
+    KeyframeRequester *keyframeRequester = NULL;
     
 private:
     
     void *run() override; // Thread
+
+    // Called on the decode thread after the queue was flushed.
+    void Reset();
     void processPacketItem(PacketItem *packetItem);
     
     void createDecompressionSession();
@@ -65,6 +101,15 @@ private:
     std::vector<char> ppsData;
     
     WorkQueue<PacketItem *> mQueue;
+
+    OverloadPolicy mOverloadPolicy;
+
+    std::atomic<uint64_t> mDecodeErrors{0};
+
+    // The packet being decoded. Decoding is synchronous, so its frame is
+    // output before VTDecompressionSessionDecodeFrame returns.
+    uint64_t mReceiveTime = 0;
+    uint64_t mDecodeStartTime = 0;
     
     obs_source_frame frame;
 };
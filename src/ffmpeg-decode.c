@@ -20,6 +20,14 @@
 #include <obs-avc.h>
 
 int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id)
+{
+    return ffmpeg_decode_init_threaded(decode, id,
+                                       FFMPEG_DECODE_THREADING_NONE, 1);
+}
+
+int ffmpeg_decode_init_threaded(struct ffmpeg_decode *decode, enum AVCodecID id,
+                                enum ffmpeg_decode_threading threading,
+                                int thread_count)
 {
     int ret;
 
@@ -30,6 +38,34 @@ int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id)
         return -1;
 
     decode->decoder = avcodec_alloc_context3(decode->codec);
+    decode->threading = threading;
+    decode->thread_count = thread_count;
+
+    /* The threading and flags have to be set before the codec is opened,
+     * otherwise libavcodec has already set up its threads. */
+    switch (threading)
+    {
+        case FFMPEG_DECODE_THREADING_SLICE:
+            decode->decoder->thread_type = FF_THREAD_SLICE;
+            decode->decoder->thread_count = thread_count;
+            break;
+        case FFMPEG_DECODE_THREADING_FRAME:
+            decode->decoder->thread_type = FF_THREAD_FRAME;
+            decode->decoder->thread_count = thread_count;
+            break;
+        default:
+            decode->decoder->thread_count = 1;
+            break;
+    }
+
+    if (threading != FFMPEG_DECODE_THREADING_FRAME)
+    {
+        if (decode->codec->capabilities & CODEC_CAP_TRUNC)
+            decode->decoder->flags |= CODEC_FLAG_TRUNC;
+
+        decode->decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        decode->decoder->flags2 = AV_CODEC_FLAG2_CHUNKS;
+    }
 
     ret = avcodec_open2(decode->decoder, decode->codec, NULL);
     if (ret < 0)
@@ -38,12 +74,6 @@ int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id)
         return ret;
     }
 
-    if (decode->codec->capabilities & CODEC_CAP_TRUNC)
-        decode->decoder->flags |= CODEC_FLAG_TRUNC;
-
-    decode->decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
-    decode->decoder->flags2 = AV_CODEC_FLAG2_CHUNKS;
-
     return 0;
 }
 
@@ -64,6 +94,12 @@ void ffmpeg_decode_free(struct ffmpeg_decode *decode)
     memset(decode, 0, sizeof(*decode));
 }
 
+void ffmpeg_decode_flush(struct ffmpeg_decode *decode)
+{
+    if (decode->decoder)
+        avcodec_flush_buffers(decode->decoder);
+}
+
 static inline enum video_format convert_pixel_format(int f)
 {
     switch (f)
@@ -159,45 +195,30 @@ static inline void copy_data(struct ffmpeg_decode *decode, uint8_t *data,
     memcpy(decode->packet_buffer, data, size);
 }
 
-bool ffmpeg_decode_audio(struct ffmpeg_decode *decode,
-                         uint8_t *data, size_t size,
-                         struct obs_source_audio *audio,
-                         bool *got_output)
+static inline void init_packet(struct ffmpeg_decode *decode, AVPacket *packet,
+                               uint8_t *data, size_t size, AVBufferRef *buf)
 {
-    AVPacket packet = {0};
-    int got_frame = false;
-    int ret = 0;
-
-    *got_output = false;
-
-    copy_data(decode, data, size);
-
-    av_init_packet(&packet);
-    packet.data = decode->packet_buffer;
-    packet.size = (int)size;
+    av_init_packet(packet);
 
-    if (!decode->frame)
+    if (buf)
     {
-        decode->frame = av_frame_alloc();
-        if (!decode->frame)
-            return false;
+        /* The caller's buffer is already padded, so it can be decoded in
+         * place. The packet takes the reference and releases it on unref. */
+        packet->buf = buf;
+        packet->data = data;
+    }
+    else
+    {
+        copy_data(decode, data, size);
+        packet->data = decode->packet_buffer;
     }
 
-    if (data && size)
-        ret = avcodec_send_packet(decode->decoder, &packet);
-    if (ret == 0)
-        ret = avcodec_receive_frame(decode->decoder, decode->frame);
-
-    got_frame = (ret == 0);
-
-    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
-        ret = 0;
-
-    if (ret < 0)
-        return false;
-    else if (!got_frame)
-        return true;
+    packet->size = (int)size;
+}
 
+static bool output_audio_frame(struct ffmpeg_decode *decode,
+                               struct obs_source_audio *audio)
+{
     for (size_t i = 0; i < MAX_AV_PLANES; i++)
         audio->data[i] = decode->frame->data[i];
 
@@ -208,57 +229,13 @@ bool ffmpeg_decode_audio(struct ffmpeg_decode *decode,
 
     audio->frames = decode->frame->nb_samples;
 
-    if (audio->format == AUDIO_FORMAT_UNKNOWN)
-        return false;
-
-    *got_output = true;
-    return true;
+    return audio->format != AUDIO_FORMAT_UNKNOWN;
 }
 
-bool ffmpeg_decode_video(struct ffmpeg_decode *decode,
-                         uint8_t *data, size_t size, long long *ts,
-                         struct obs_source_frame *frame,
-                         bool *got_output)
+static bool output_video_frame(struct ffmpeg_decode *decode,
+                               struct obs_source_frame *frame)
 {
-    AVPacket packet = {0};
-    int got_frame = false;
     enum video_format new_format;
-    int ret;
-
-    *got_output = false;
-
-    copy_data(decode, data, size);
-
-    av_init_packet(&packet);
-    packet.data = decode->packet_buffer;
-    packet.size = (int)size;
-    packet.pts = *ts;
-
-    if (decode->codec->id == AV_CODEC_ID_H264 && obs_avc_keyframe(data, size))
-    {
-        packet.flags |= AV_PKT_FLAG_KEY;
-    }
-
-    if (!decode->frame)
-    {
-        decode->frame = av_frame_alloc();
-        if (!decode->frame)
-            return false;
-    }
-
-    ret = avcodec_send_packet(decode->decoder, &packet);
-    if (ret == 0)
-        ret = avcodec_receive_frame(decode->decoder, decode->frame);
-
-    got_frame = (ret == 0);
-
-    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
-        ret = 0;
-
-    if (ret < 0)
-        return false;
-    else if (!got_frame)
-        return true;
 
     for (size_t i = 0; i < MAX_AV_PLANES; i++)
     {
@@ -290,15 +267,218 @@ bool ffmpeg_decode_video(struct ffmpeg_decode *decode,
         }
     }
 
-    *ts = decode->frame->pts;
-
     frame->width = decode->frame->width;
     frame->height = decode->frame->height;
     frame->flip = false;
 
-    if (frame->format == VIDEO_FORMAT_NONE)
+    return frame->format != VIDEO_FORMAT_NONE;
+}
+
+/* Hands every frame the decoder has ready to the callback. Returns 0 once the
+ * decoder needs more input or has been fully drained, otherwise an AVERROR. */
+static int receive_audio_frames(struct ffmpeg_decode *decode,
+                                struct obs_source_audio *audio,
+                                ffmpeg_decode_audio_callback callback,
+                                void *param, int *received)
+{
+    int ret;
+
+    while ((ret = avcodec_receive_frame(decode->decoder, decode->frame)) == 0)
+    {
+        if (!output_audio_frame(decode, audio))
+            return AVERROR(EINVAL);
+
+        callback(param, audio, decode->frame->pts);
+        (*received)++;
+    }
+
+    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+        ret = 0;
+
+    return ret;
+}
+
+static int receive_video_frames(struct ffmpeg_decode *decode,
+                                struct obs_source_frame *frame,
+                                ffmpeg_decode_video_callback callback,
+                                void *param, int *received)
+{
+    int ret;
+
+    while ((ret = avcodec_receive_frame(decode->decoder, decode->frame)) == 0)
+    {
+        if (!output_video_frame(decode, frame))
+            return AVERROR(EINVAL);
+
+        callback(param, frame, decode->frame->pts);
+        (*received)++;
+    }
+
+    if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+        ret = 0;
+
+    return ret;
+}
+
+bool ffmpeg_decode_audio(struct ffmpeg_decode *decode,
+                         uint8_t *data, size_t size, AVBufferRef *buf,
+                         long long ts,
+                         struct obs_source_audio *audio,
+                         ffmpeg_decode_audio_callback callback, void *param)
+{
+    AVPacket packet = {0};
+    int received = 0;
+    int ret = 0;
+
+    if (!decode->frame)
+    {
+        decode->frame = av_frame_alloc();
+        if (!decode->frame)
+        {
+            av_buffer_unref(&buf);
+            return false;
+        }
+    }
+
+    init_packet(decode, &packet, data, size, buf);
+    packet.pts = ts;
+
+    if (data && size)
+    {
+        ret = avcodec_send_packet(decode->decoder, &packet);
+
+        /* The decoder won't take more input until the frames it already
+         * has are received. It always has at least one when it says so. */
+        while (ret == AVERROR(EAGAIN))
+        {
+            int drained = 0;
+
+            ret = receive_audio_frames(decode, audio, callback, param,
+                                       &drained);
+            if (ret < 0)
+                break;
+            if (drained == 0)
+            {
+                ret = AVERROR_BUG;
+                break;
+            }
+
+            ret = avcodec_send_packet(decode->decoder, &packet);
+        }
+    }
+    av_packet_unref(&packet);
+
+    if (ret < 0 && ret != AVERROR_EOF)
         return false;
 
-    *got_output = true;
-    return true;
+    return receive_audio_frames(decode, audio, callback, param,
+                                &received) == 0;
+}
+
+bool ffmpeg_decode_video(struct ffmpeg_decode *decode,
+                         uint8_t *data, size_t size, AVBufferRef *buf,
+                         long long ts,
+                         struct obs_source_frame *frame,
+                         ffmpeg_decode_video_callback callback, void *param)
+{
+    AVPacket packet = {0};
+    int received = 0;
+    int ret;
+
+    if (!decode->frame)
+    {
+        decode->frame = av_frame_alloc();
+        if (!decode->frame)
+        {
+            av_buffer_unref(&buf);
+            return false;
+        }
+    }
+
+    init_packet(decode, &packet, data, size, buf);
+    packet.pts = ts;
+
+    if (decode->codec->id == AV_CODEC_ID_H264 && obs_avc_keyframe(data, size))
+    {
+        packet.flags |= AV_PKT_FLAG_KEY;
+    }
+
+    ret = avcodec_send_packet(decode->decoder, &packet);
+
+    /* With frame threading or reordering the decoder can hold several
+     * frames, and won't take more input until they have been received. */
+    while (ret == AVERROR(EAGAIN))
+    {
+        int drained = 0;
+
+        ret = receive_video_frames(decode, frame, callback, param, &drained);
+        if (ret < 0)
+            break;
+        if (drained == 0)
+        {
+            ret = AVERROR_BUG;
+            break;
+        }
+
+        ret = avcodec_send_packet(decode->decoder, &packet);
+    }
+    av_packet_unref(&packet);
+
+    if (ret < 0 && ret != AVERROR_EOF)
+        return false;
+
+    return receive_video_frames(decode, frame, callback, param,
+                                &received) == 0;
+}
+
+AVFrame *ffmpeg_decode_ref_frame(struct ffmpeg_decode *decode)
+{
+    if (!decode->frame)
+        return NULL;
+
+    return av_frame_clone(decode->frame);
+}
+
+bool ffmpeg_decode_audio_drain(struct ffmpeg_decode *decode,
+                               struct obs_source_audio *audio,
+                               ffmpeg_decode_audio_callback callback,
+                               void *param)
+{
+    int received = 0;
+    int ret;
+
+    if (!decode->decoder || !decode->frame)
+        return true;
+
+    ret = avcodec_send_packet(decode->decoder, NULL);
+    if (ret == 0)
+        ret = receive_audio_frames(decode, audio, callback, param,
+                                   &received);
+
+    /* Leave draining mode so that the decoder can be fed again. */
+    avcodec_flush_buffers(decode->decoder);
+
+    return ret == 0 || ret == AVERROR_EOF;
+}
+
+bool ffmpeg_decode_video_drain(struct ffmpeg_decode *decode,
+                               struct obs_source_frame *frame,
+                               ffmpeg_decode_video_callback callback,
+                               void *param)
+{
+    int received = 0;
+    int ret;
+
+    if (!decode->decoder || !decode->frame)
+        return true;
+
+    ret = avcodec_send_packet(decode->decoder, NULL);
+    if (ret == 0)
+        ret = receive_video_frames(decode, frame, callback, param,
+                                   &received);
+
+    /* Leave draining mode so that the decoder can be fed again. */
+    avcodec_flush_buffers(decode->decoder);
+
+    return ret == 0 || ret == AVERROR_EOF;
 }
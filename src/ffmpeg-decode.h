@@ -36,6 +36,20 @@ extern "C" {
 #pragma warning(pop)
 #endif
 
+/* Slice threading decodes the slices of one frame in parallel and adds no
+ * latency, but only helps when the encoder splits frames into several slices.
+ * Frame threading decodes consecutive frames in parallel and scales with any
+ * stream, at the cost of thread_count - 1 frames of extra latency (measured: 1
+ * frame with 2 threads and 3 with 4, so 33 and 100 ms at 30 fps). It can't be
+ * combined with AV_CODEC_FLAG_LOW_DELAY or AV_CODEC_FLAG2_CHUNKS, so those are
+ * only set for the other modes, and each packet must hold a whole frame. */
+enum ffmpeg_decode_threading
+{
+	FFMPEG_DECODE_THREADING_NONE = 0,
+	FFMPEG_DECODE_THREADING_SLICE = 1,
+	FFMPEG_DECODE_THREADING_FRAME = 2,
+};
+
 struct ffmpeg_decode
 {
 	AVCodecContext *decoder;
@@ -45,20 +59,67 @@ struct ffmpeg_decode
 
 	uint8_t *packet_buffer;
 	size_t packet_size;
+
+	enum ffmpeg_decode_threading threading;
+	int thread_count;
 };
 
 extern int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id);
+/* thread_count of 0 lets FFmpeg pick based on the number of cores. */
+extern int ffmpeg_decode_init_threaded(struct ffmpeg_decode *decode,
+								enum AVCodecID id,
+								enum ffmpeg_decode_threading threading,
+								int thread_count);
 extern void ffmpeg_decode_free(struct ffmpeg_decode *decode);
+/* Discards all buffered input and output but keeps the codec open, so that
+ * the context can be fed a new stream without being re-initialized. */
+extern void ffmpeg_decode_flush(struct ffmpeg_decode *decode);
 
+/* Called for every frame the decoder outputs, ts is the pts of the frame. The
+ * frame data belongs to the decoder and is only valid during the call. */
+typedef void (*ffmpeg_decode_audio_callback)(void *param,
+								struct obs_source_audio *audio,
+								long long ts);
+typedef void (*ffmpeg_decode_video_callback)(void *param,
+								struct obs_source_frame *frame,
+								long long ts);
+
+/* Sends a packet to the decoder and passes every frame it has ready to the
+ * callback, which may be none or several per packet.
+ *
+ * If buf is not NULL it must reference data, which must be followed by
+ * AV_INPUT_BUFFER_PADDING_SIZE zeroed bytes. The packet is then decoded in
+ * place and the decoder takes ownership of buf, otherwise data is copied. */
 extern bool ffmpeg_decode_audio(struct ffmpeg_decode *decode,
-								uint8_t *data, size_t size,
+								uint8_t *data, size_t size, AVBufferRef *buf,
+								long long ts,
 								struct obs_source_audio *audio,
-								bool *got_output);
+								ffmpeg_decode_audio_callback callback,
+								void *param);
 
 extern bool ffmpeg_decode_video(struct ffmpeg_decode *decode,
-								uint8_t *data, size_t size, long long *ts,
+								uint8_t *data, size_t size, AVBufferRef *buf,
+								long long ts,
+								struct obs_source_frame *frame,
+								ffmpeg_decode_video_callback callback,
+								void *param);
+
+/* Returns a new reference to the frame that was last passed to the callback,
+ * which keeps its data valid after the callback returns. Free it with
+ * av_frame_free. */
+extern AVFrame *ffmpeg_decode_ref_frame(struct ffmpeg_decode *decode);
+
+/* Outputs the frames still buffered inside the decoder, then resets it so
+ * that it is ready for new input. */
+extern bool ffmpeg_decode_audio_drain(struct ffmpeg_decode *decode,
+								struct obs_source_audio *audio,
+								ffmpeg_decode_audio_callback callback,
+								void *param);
+
+extern bool ffmpeg_decode_video_drain(struct ffmpeg_decode *decode,
 								struct obs_source_frame *frame,
-								bool *got_output);
+								ffmpeg_decode_video_callback callback,
+								void *param);
 
 static inline bool ffmpeg_decode_valid(struct ffmpeg_decode *decode)
 {
@@ -19,6 +19,8 @@
 #include <obs-module.h>
 #include <obs.hpp>
 
+#include "DecoderPool.hpp"
+
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("hyperstream-plugin", "en-US")
 
@@ -32,3 +34,8 @@ bool obs_module_load(void)
     RegisterIOSCameraSource();
     return true;
 }
+
+void obs_module_unload(void)
+{
+    DecoderPool::shared().clear();
+}
@@ -19,11 +19,22 @@
 #include <obs-module.h>
 #include <chrono>
 #include <Portal.hpp>
+#include <Capture.hpp>
 #include <usbmuxd.h>
 #include <obs-avc.h>
+#include <util/platform.h>
+#include <util/task.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
 
 #include "FFMpegVideoDecoder.h"
 #include "FFMpegAudioDecoder.h"
+#include "PipelineStats.hpp"
+#include "KeyframeRequester.hpp"
 #ifdef __APPLE__
     #include "VideoToolboxVideoDecoder.h"
 #endif
@@ -35,11 +46,51 @@
 #define SETTING_PROP_LATENCY "latency"
 #define SETTING_PROP_LATENCY_NORMAL 0
 #define SETTING_PROP_LATENCY_LOW 1
+#define SETTING_PROP_LATENCY_ADAPTIVE 2
+
+#define SETTING_PROP_DECODER_THREADING "decoder_threading"
+#define SETTING_PROP_DECODER_THREADS "decoder_threads"
+#define SETTING_PROP_DECODER_CPUS "decoder_cpus"
+#define SETTING_PROP_RECEIVE_PRIORITY "receive_priority"
+
+#define SETTING_PROP_OVERLOAD_POLICY "overload_policy"
+#define SETTING_PROP_MAX_QUEUED_FRAMES "max_queued_frames"
 
 #define SETTING_PROP_HARDWARE_DECODER "setting_use_hw_decoder"
 #define SETTING_PROP_FILTER_INTENSITY "filter-intensity"
 #define SETTING_PROP_FILTER_MIX "mix"
 
+#define SETTING_PROP_STATS "stats"
+
+#define SETTING_PROP_CAPTURE_PATH "capture_path"
+#define SETTING_PROP_REPLAY_PATH "replay_path"
+#define SETTING_PROP_REPLAY_SPEED "replay_speed"
+#define SETTING_PROP_REPLAY_SPEED_REAL_TIME 0
+#define SETTING_PROP_REPLAY_SPEED_MAX 1
+#define SETTING_PROP_REPLAY_LOOP "replay_loop"
+
+// How far a replay at full speed lets the video decoder fall behind.
+#define REPLAY_MAX_QUEUED_PACKETS 8
+
+// How often the pipeline latency is written to the log.
+#define PIPELINE_STATS_LOG_INTERVAL 60.0f
+
+// The header is big endian on the wire, as the device sends it. Unlike
+// sendData(), which the filter commands still use as the app expects them.
+static int sendKeyframeRequest(portal::Device& device) {
+    portal::PortalFrame frame;
+    frame.version = htonl(0);
+    frame.type = htonl(portal::PortalFrameTypeRequestKeyframe);
+    frame.tag = htonl(0);
+    frame.payloadSize = htonl(0);
+
+    if (!device.isConnected()) { return -1; }
+
+    std::vector<char> packet(sizeof(portal::PortalFrame));
+    memcpy(packet.data(), reinterpret_cast<char*>(&frame), sizeof(portal::PortalFrame));
+    return device.send(packet);
+}
+
 class IOSCameraInput: public portal::PortalDelegate
 {
 public:
@@ -48,11 +99,29 @@ public:
 
     bool active = false;
     obs_source_frame frame;
+
+    // Guards deviceUUID, and stops connectToDevice() running on the UI
+    // thread and the device task queue at once.
+    std::mutex connectMutex;
     std::string deviceUUID;
 
+    // Device list changes are handled here rather than on the reactor
+    // thread, as connecting flushes the pipeline and waits for the reactor.
+    os_task_queue_t *deviceTasks;
+    std::atomic<bool> deviceListChanged{false};
+
+    // Only changed by portalConnectionStateDidChange(), which the portal never calls twice at once.
+    portal::ConnectionState connectionState = portal::ConnectionState::Disconnected;
+
     std::shared_ptr<portal::Portal> sharedPortal;
     portal::Portal portal;
 
+    // Declared before the decoders, whose threads use them until they are destroyed.
+    PipelineStats pipelineStats;
+    ClockMapper clock;
+    JitterBuffer jitterBuffer;
+    KeyframeRequester keyframeRequester;
+
     VideoDecoder *videoDecoder;
 #ifdef __APPLE__
     VideoToolboxDecoder videoToolboxVideoDecoder;
@@ -60,12 +129,24 @@ public:
     FFMpegVideoDecoder ffmpegVideoDecoder;
     FFMpegAudioDecoder audioDecoder;
 
+    // Declared after the decoders, as the replay thread feeds them.
+    portal::CaptureWriter captureWriter;
+    portal::CaptureReplayer replayer;
+    std::atomic<bool> replaying{false};
+
     // settings
     float intensity;
     float mix;
 
+    // Seconds since the pipeline stats were last logged.
+    float statsElapsed = 0.0f;
+    PipelineSnapshot lastLoggedStats = {};
+
+    // What the stats panel showed last, to work out the rates since then.
+    PipelineSnapshot lastPanelStats = {};
+
     IOSCameraInput(obs_source_t *source_, obs_data_t *settings)
-    : source(source_), settings(settings), portal(this)
+    : source(source_), settings(settings), portal(this), replayer(this)
     {
         blog(LOG_INFO, "Creating instance of plugin!");
 
@@ -82,30 +163,237 @@ public:
         auto portalReference = std::shared_ptr<portal::Portal>(&portal, null_deleter);
         sharedPortal = portalReference;
 
+        // Called from the decoder threads, so it mustn't touch the portal's
+        // device directly.
+        keyframeRequester.setSender([this]() {
+            auto device = portal.getDevice();
+            return device && sendKeyframeRequest(*device) >= 0;
+        });
+
 #ifdef __APPLE__
         videoToolboxVideoDecoder.source = source;
+        videoToolboxVideoDecoder.clock = &clock;
+        videoToolboxVideoDecoder.jitterBuffer = &jitterBuffer;
+        videoToolboxVideoDecoder.stats = &pipelineStats;
+        videoToolboxVideoDecoder.keyframeRequester = &keyframeRequester;
         videoToolboxVideoDecoder.Init();
 #endif
 
         ffmpegVideoDecoder.source = source;
+        ffmpegVideoDecoder.clock = &clock;
+        ffmpegVideoDecoder.jitterBuffer = &jitterBuffer;
+        ffmpegVideoDecoder.stats = &pipelineStats;
+        ffmpegVideoDecoder.keyframeRequester = &keyframeRequester;
         ffmpegVideoDecoder.Init();
 
         audioDecoder.source = source;
+        audioDecoder.clock = &clock;
+
+        jitterBuffer.source = source;
+        jitterBuffer.stats = &pipelineStats;
         audioDecoder.Init();
 
         videoDecoder = &ffmpegVideoDecoder;
 
+        deviceTasks = os_task_queue_create();
+
         loadSettings(settings);
         active = true;
+
+        // Only now is the source ready to be told about devices.
+        portal.startListeningForDevices();
     }
 
     inline ~IOSCameraInput()
     {
-        auto device = portal._device;
-        if (device) {
-            device->disconnect();
+        // Device events mustn't reach the source while it is being destroyed.
+        portal.stopListeningForDevices();
+
+        // Waits for the device list change being handled, if there is one.
+        os_task_queue_destroy(deviceTasks);
+
+        replayer.stop();
+        stopCapture();
+
+        portal.releaseDevice();
+
+        auto stats = ffmpegVideoDecoder.GetOverloadStats();
+        blog(LOG_INFO, "Video decoder overloaded %llu times, skipped %llu frames, %llu packets dropped with a full queue",
+             (unsigned long long)stats.overloads, (unsigned long long)stats.skippedFrames, (unsigned long long)stats.queueFullDrops);
+    }
+
+    // Everything recorded since the stats were last logged.
+    PipelineSnapshot getPipelineStats() {
+        return pipelineStats.snapshot(false);
+    }
+
+    void tick(float seconds) {
+        // A replay that wasn't looping has reached the end of the capture.
+        if (replaying && !replayer.isRunning()) {
+            stopReplay();
+        }
+
+        statsElapsed += seconds;
+        if (statsElapsed < PIPELINE_STATS_LOG_INTERVAL) {
+            return;
+        }
+        statsElapsed = 0.0f;
+
+        auto snapshot = pipelineStats.snapshot(true);
+        auto last = lastLoggedStats;
+        lastLoggedStats = snapshot;
+
+        const uint64_t videoPackets = snapshot.videoPackets - last.videoPackets;
+        const uint64_t audioPackets = snapshot.audioPackets - last.audioPackets;
+        if (videoPackets == 0 && audioPackets == 0) {
+            return;
+        }
+
+        const double elapsed = (snapshot.time - last.time) / 1000000000.0;
+        blog(LOG_INFO, "Pipeline: %.1f fps, %.2f Mbps, %llu video packets, %llu audio packets in %.0f s",
+             (snapshot.frames - last.frames) / elapsed, (snapshot.bytes - last.bytes) * 8 / elapsed / 1000000.0,
+             (unsigned long long)videoPackets, (unsigned long long)audioPackets, elapsed);
+
+        for (int i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+            const auto &stage = snapshot.stages[i];
+            if (stage.count == 0) {
+                continue;
+            }
+
+            blog(LOG_INFO, "Pipeline %-8s mean %6.2f ms, p50 %6.2f ms, p90 %6.2f ms, p99 %6.2f ms, max %6.2f ms",
+                 PipelineStats::stageName((PipelineStage)i),
+                 stage.mean / 1000.0, stage.p50 / 1000.0, stage.p90 / 1000.0, stage.p99 / 1000.0, stage.max / 1000.0);
+        }
+
+        const auto &recovery = snapshot.recovery;
+        if (recovery.count > 0) {
+            blog(LOG_INFO, "Pipeline recovered from %llu lost connections, mean %.0f ms, max %.0f ms",
+                 (unsigned long long)recovery.count, recovery.mean / 1000.0, recovery.max / 1000.0);
+        }
+    }
+
+    // The text of the stats panel, with rates since it was last updated.
+    std::string statsText() {
+        auto snapshot = pipelineStats.snapshot(false);
+        auto last = lastPanelStats;
+        lastPanelStats = snapshot;
+
+        const double elapsed = last.time != 0 ? (snapshot.time - last.time) / 1000000000.0 : 0.0;
+        const double mbps = elapsed > 0 ? (snapshot.bytes - last.bytes) * 8 / elapsed / 1000000.0 : 0.0;
+        const double fps = elapsed > 0 ? (snapshot.frames - last.frames) / elapsed : 0.0;
+
+        const auto &decode = snapshot.stages[PIPELINE_STAGE_DECODE];
+        const auto &total = snapshot.stages[PIPELINE_STAGE_TOTAL];
+        const auto overload = videoDecoder->GetOverloadStats();
+        const auto jitter = jitterBuffer.getStats();
+
+        char text[1024];
+        int length = snprintf(text, sizeof(text),
+                 "Received: %.2f Mbps\n"
+                 "Decoded: %.1f fps, %.2f ms per frame (p90 %.2f ms)\n"
+                 "Latency: %.2f ms (p90 %.2f ms)\n"
+                 "Decoder queue: %d packets\n"
+                 "Dropped: %llu skipped to keyframe, %llu queue full, %llu decode errors, %llu jitter buffer full",
+                 mbps, fps, decode.mean / 1000.0, decode.p90 / 1000.0,
+                 total.mean / 1000.0, total.p90 / 1000.0,
+                 videoDecoder->GetQueueDepth(),
+                 (unsigned long long)overload.skippedFrames, (unsigned long long)overload.queueFullDrops,
+                 (unsigned long long)videoDecoder->GetDecodeErrors(), (unsigned long long)jitter.droppedFrames);
+
+        if (jitterBuffer.isEnabled() && length > 0 && (size_t)length < sizeof(text)) {
+            length += snprintf(text + length, sizeof(text) - length,
+                     "\nJitter buffer: %d frames, %.1f ms delay, %.1f ms jitter, %llu late",
+                     jitter.depth, jitter.delay / 1000000.0, jitter.jitter / 1000000.0,
+                     (unsigned long long)jitter.lateFrames);
+        }
+
+        // Only for the connection in use, a new one starts from zero.
+        auto device = portal.getDevice();
+        const auto channel = device ? device->getChannelStats() : portal::ChannelStats{};
+        if (channel.reads > 0 && length > 0 && (size_t)length < sizeof(text)) {
+            length += snprintf(text + length, sizeof(text) - length,
+                     "\nReads: %.1f KB each, %llu of %llu found nothing, %d KB socket buffer",
+                     channel.bytes / (double)channel.reads / 1024.0,
+                     (unsigned long long)channel.emptyReads, (unsigned long long)(channel.reads + channel.emptyReads),
+                     channel.receiveBufferSize / 1024);
+        }
+
+        if (keyframeRequester.getSent() > 0 && length > 0 && (size_t)length < sizeof(text)) {
+            length += snprintf(text + length, sizeof(text) - length,
+                     "\nKeyframes requested: %llu (%llu asked for again too soon)",
+                     (unsigned long long)keyframeRequester.getSent(), (unsigned long long)keyframeRequester.getSuppressed());
+        }
+
+        if (snapshot.recoveries > 0 && length > 0 && (size_t)length < sizeof(text)) {
+            snprintf(text + length, sizeof(text) - length,
+                     "\nReconnected: %llu times, video back after %.0f ms last time",
+                     (unsigned long long)snapshot.recoveries, snapshot.lastRecovery / 1000.0);
+        }
+
+        return std::string(text);
+    }
+
+    bool startCapture(const char *path) {
+        if (!path || !*path) {
+            return false;
+        }
+
+        if (!captureWriter.open(path)) {
+            blog(LOG_WARNING, "Could not create capture %s", path);
+            return false;
+        }
+
+        blog(LOG_INFO, "Recording capture to %s", path);
+        return true;
+    }
+
+    void stopCapture() {
+        if (!captureWriter.isOpen()) {
+            return;
+        }
+
+        captureWriter.close();
+        blog(LOG_INFO, "Stopped recording capture: %llu packets written, %llu dropped",
+             (unsigned long long)captureWriter.getRecords(), (unsigned long long)captureWriter.getDroppedRecords());
+    }
+
+    // Plays a capture through the pipeline in place of the device.
+    bool startReplay(const char *path, bool realTime, bool loop) {
+        if (!path || !*path) {
+            return false;
+        }
+
+        replayer.stop();
+        replaying = false;
+
+        portal.disconnectFromDevice();
+        flushPipeline();
+
+        replayer.setThrottle([this]() {
+            return videoDecoder->GetQueueDepth() >= REPLAY_MAX_QUEUED_PACKETS;
+        });
+
+        if (!replayer.start(path, realTime, loop)) {
+            blog(LOG_WARNING, "Could not replay %s", path);
+            reconnectToDevice();
+            return false;
         }
 
+        replaying = true;
+        blog(LOG_INFO, "Replaying capture %s %s", path, realTime ? "in real time" : "at full speed");
+        return true;
+    }
+
+    void stopReplay() {
+        if (!replaying.exchange(false)) {
+            return;
+        }
+
+        replayer.stop();
+        blog(LOG_INFO, "Stopped replay after %llu packets", (unsigned long long)replayer.getPackets());
+
+        flushPipeline();
+        reconnectToDevice();
     }
 
     void activate() {
@@ -119,49 +407,128 @@ public:
     }
 
     void loadSettings(obs_data_t *settings) {
+        updateLatency(settings);
+        updateDecoderSettings(settings);
+        updateThreadSettings(settings);
+
         auto device_uuid = obs_data_get_string(settings, SETTING_DEVICE_UUID);
 
         blog(LOG_INFO, "Loaded Settings: Connecting to device");
         connectToDevice(device_uuid, false);
     }
 
+    void updateLatency(obs_data_t *settings) {
+        const auto latency = obs_data_get_int(settings, SETTING_PROP_LATENCY);
+
+        // The jitter buffer does its own pacing, so OBS mustn't buffer on top of it.
+        obs_source_set_async_unbuffered(source, latency != SETTING_PROP_LATENCY_NORMAL);
+        jitterBuffer.setEnabled(latency == SETTING_PROP_LATENCY_ADAPTIVE);
+    }
+
+    void updateDecoderSettings(obs_data_t *settings) {
+        auto threading = (ffmpeg_decode_threading)obs_data_get_int(settings, SETTING_PROP_DECODER_THREADING);
+        auto threadCount = (int)obs_data_get_int(settings, SETTING_PROP_DECODER_THREADS);
+        ffmpegVideoDecoder.SetThreading(threading, threadCount);
+
+        auto mode = (OverloadMode)obs_data_get_int(settings, SETTING_PROP_OVERLOAD_POLICY);
+        auto maxQueuedFrames = (int)obs_data_get_int(settings, SETTING_PROP_MAX_QUEUED_FRAMES);
+
+        ffmpegVideoDecoder.SetOverloadPolicy(mode, maxQueuedFrames);
+#ifdef __APPLE__
+        videoToolboxVideoDecoder.SetOverloadPolicy(mode, maxQueuedFrames);
+#endif
+    }
+
+    void updateThreadSettings(obs_data_t *settings) {
+        auto priority = (portal::ThreadPriority)obs_data_get_int(settings, SETTING_PROP_RECEIVE_PRIORITY);
+        portal.setReceivePriority(priority);
+
+        // Pinning the decoders keeps them off the cores OBS renders and encodes on.
+        std::vector<int> cpus;
+        const char *cpuList = obs_data_get_string(settings, SETTING_PROP_DECODER_CPUS);
+        if (!portal::parseCpuList(cpuList, cpus)) {
+            blog(LOG_WARNING, "Ignoring decoder CPUs \"%s\", expected a list like 2,3 or 4-7", cpuList);
+            cpus.clear();
+        }
+
+        ffmpegVideoDecoder.setAffinity(cpus);
+        audioDecoder.setAffinity(cpus);
+#ifdef __APPLE__
+        videoToolboxVideoDecoder.setAffinity(cpus);
+#endif
+    }
+
     void reconnectToDevice()
     {
-        if (deviceUUID.size() < 1) {
+        std::string uuid = getDeviceUUID();
+        if (uuid.size() < 1) {
             return;
         }
 
-        connectToDevice(deviceUUID, true);
+        connectToDevice(uuid, true);
+    }
+
+    std::string getDeviceUUID() {
+        std::lock_guard<std::mutex> lock(connectMutex);
+        return deviceUUID;
+    }
+
+    void flushPipeline() {
+        // flush the decoders 
+        ffmpegVideoDecoder.Flush();
+        audioDecoder.Flush();
+#ifdef __APPLE__
+        videoToolboxVideoDecoder.Flush();
+#endif
+        clock.reset();
+        jitterBuffer.flush();
     }
 
     void connectToDevice(std::string uuid, bool force) {
+        std::lock_guard<std::mutex> lock(connectMutex);
+
+        // The device takes over from a replay.
+        if (replaying.exchange(false)) {
+            replayer.stop();
+        }
 
-        if (portal._device) {
+        auto device = portal.getDevice();
+        if (device) {
             // Make sure that we're not already connected to the device
-            if (force == false && portal._device->uuid().compare(uuid) == 0 && portal._device->isConnected()) {
+            if (force == false && device->uuid().compare(uuid) == 0 &&
+                (device->isConnected() || device->isConnecting())) {
                 blog(LOG_DEBUG, "Already connected to the device. Skipping.");
                 return;
-            } else {
-                // Disconnect from from the old device
-                portal._device->disconnect();
-                portal._device = nullptr;
+            } else if (force || device->uuid().compare(uuid) != 0) {
+                // Disconnect from from the old device. The same device is
+                // left to the portal, which is reconnecting to it.
+                portal.disconnectFromDevice();
             }
         }
 
         blog(LOG_INFO, "Connecting to device");
 
-        // flush the decoders 
-        ffmpegVideoDecoder.Flush();
-#ifdef __APPLE__
-        videoToolboxVideoDecoder.Flush();
-#endif
+        flushPipeline();
+
+        deviceUUID = std::string(uuid);
+
+        // With no device chosen, other sources are free to use this one's.
+        if (uuid.empty() || uuid == SETTING_DEVICE_UUID_NONE_VALUE) {
+            portal.releaseDevice();
+            return;
+        }
+
+        // Claimed even if it isn't plugged in yet, so that it is kept for this source.
+        if (!portal.claimDevice(uuid)) {
+            blog(LOG_WARNING, "Device %s is being used by another source", uuid.c_str());
+            return;
+        }
 
         // Find device
         auto devices = portal.getDevices();
-        deviceUUID = std::string(uuid);
 
         int index = 0;
-        std::for_each(devices.begin(), devices.end(), [this, uuid, &index](std::map<int, portal::Device::shared_ptr>::value_type &deviceMap) {
+        std::for_each(devices->begin(), devices->end(), [this, uuid, &index](const std::map<int, portal::Device::shared_ptr>::value_type &deviceMap) {
             // Add the device name to the list
             auto _uuid = deviceMap.second->uuid();
 
@@ -174,16 +541,25 @@ public:
         });
     }
 
-    void portalDeviceDidReceivePacket(std::vector<char> packet, int type, int tag)
+    void portalDeviceDidReceivePacket(portal::Packet packet, int type, int tag)
     {
         try
         {
+            captureWriter.write(packet, type, tag);
+
+            if (packet.timestamp() != 0) {
+                clock.update(packet.timestamp(), os_gettime_ns());
+            }
+
+            pipelineStats.countPacket(packet.size(), type == 102);
+
             switch (type) {
                 case 101: // Video Packet
-                    this->videoDecoder->Input(packet, type, tag);
+                    pipelineStats.record(PIPELINE_STAGE_FRAMING, packet.receiveTime(), packet.parseTime());
+                    this->videoDecoder->Input(std::move(packet), type, tag);
                     break;
                 case 102: // Audio Packet
-                    this->audioDecoder.Input(packet, type, tag);
+                    this->audioDecoder.Input(std::move(packet), type, tag);
                 default:
                     break;
             }
@@ -199,47 +575,96 @@ public:
         }
     }
 
-    void portalDidUpdateDeviceList(std::map<int, portal::Device::shared_ptr> deviceList)
+    // Called on the reactor thread, so the connecting is left to deviceTasks.
+    // Changes that come in while one is waiting are handled along with it.
+    void portalDidUpdateDeviceList(const std::map<int, portal::Device::shared_ptr> &)
+    {
+        if (!deviceListChanged.exchange(true)) {
+            os_task_queue_queue_task(deviceTasks, UpdateDeviceList, this);
+        }
+    }
+
+    static void UpdateDeviceList(void *data)
+    {
+        auto cameraInput = reinterpret_cast<IOSCameraInput *>(data);
+        cameraInput->deviceListChanged = false;
+        cameraInput->updateDeviceList(*cameraInput->portal.getDevices());
+    }
+
+    void updateDeviceList(const std::map<int, portal::Device::shared_ptr> &deviceList)
     {
         // Update OBS Settings
         blog(LOG_INFO, "Updated device list");
 
-        /// If there is one device in the list, then we should attempt to connect to it.
-        /// I would guess that this is the main use case - one device, and it's good to
-        /// attempt to automatically connect in this case, and 'just work'.
-        ///
-        /// If there are multiple devices, then we can't just connect to all devices.
-        /// We cannot currently detect if a device is connected to another instance of the
-        /// plugin, so it's not safe to attempt to connect to any devices automatically
-        /// as we could be connecting to a device that is currently connected elsewhere.
-        /// Due to this, if there are multiple devices, we won't do anything and will let
-        /// the user configure the instance of the plugin.
-        if (deviceList.size() == 1) {
+        // Don't interrupt a replay by connecting to a device that was just plugged in.
+        if (replaying) {
+            return;
+        }
 
+        /// A source that has a device reconnects to it whenever it is plugged back in.
+        const std::string currentUUID = getDeviceUUID();
+        if (currentUUID.size() > 0) {
             for (const auto& [index, device] : deviceList) {
-                auto uuid = device.get()->uuid();
+                if (device->uuid().compare(currentUUID) == 0 && !device->isConnected() && !device->isConnecting()) {
+                    connectToDevice(currentUUID, false);
+                }
+            }
+            return;
+        }
 
-                auto isFirstTimeConnectingToDevice = deviceUUID.size() == 0;
-                auto isDeviceConnected = device.get()->isConnected();
-                auto isThisDeviceTheSameAsThePreviouslyConnectedDevice = deviceUUID.compare(uuid) == 0;
+        /// A new source takes the first device that no other source is using. With
+        /// one phone this 'just works', and with several, adding a source for each
+        /// one gives each source a different phone.
+        for (const auto& [index, device] : deviceList) {
+            auto uuid = device->uuid();
+            if (portal.isDeviceClaimedElsewhere(uuid)) {
+                continue;
+            }
 
-                if (isFirstTimeConnectingToDevice || (isThisDeviceTheSameAsThePreviouslyConnectedDevice && !isDeviceConnected)) {
+            // Set the setting so that the UI in OBS Studio is updated
+            obs_data_set_string(this->settings, SETTING_DEVICE_UUID, uuid.c_str());
 
-                    // Set the setting so that the UI in OBS Studio is updated
-                    obs_data_set_string(this->settings, SETTING_DEVICE_UUID, uuid.c_str());
+            // Connect to the device
+            connectToDevice(uuid, false);
+            break;
+        }
+    }
 
-                    // Connect to the device
-                    connectToDevice(uuid, false);
+    // Called on the reactor thread, so it is given the device's UUID rather
+    // than reading deviceUUID, and only flushes, which doesn't wait for the decoders.
+    void portalConnectionStateDidChange(portal::ConnectionState state, const std::string &uuid)
+    {
+        const auto previous = connectionState;
+        connectionState = state;
+
+        switch (state) {
+            case portal::ConnectionState::Connecting:
+                break;
+            case portal::ConnectionState::Connected:
+                blog(LOG_INFO, "Connected to device %s", uuid.c_str());
+                // The stream picks up wherever the encoder is, so don't wait
+                // for its next keyframe to show video again.
+                if (previous == portal::ConnectionState::Reconnecting) {
+                    keyframeRequester.request("reconnected");
                 }
-            }
-
-        } else {
-            // User will have to configure the plugin manually when more than one device is plugged in
-            // due to the fact that multiple instances of the plugin can't subscribe to device events...
+                break;
+            case portal::ConnectionState::Reconnecting:
+                // What is queued belongs to the stream that was lost, and the
+                // decoder has to start again from a keyframe anyway.
+                blog(LOG_WARNING, "Lost the connection to device %s, reconnecting", uuid.c_str());
+                pipelineStats.connectionLost();
+                flushPipeline();
+                break;
+            case portal::ConnectionState::Disconnected:
+                pipelineStats.cancelRecovery();
+                // Not when the source let go of the device itself.
+                if (!uuid.empty() && (previous == portal::ConnectionState::Connecting || previous == portal::ConnectionState::Reconnecting)) {
+                    blog(LOG_WARNING, "Could not connect to device %s, is the app open and the phone unlocked?", uuid.c_str());
+                }
+                break;
         }
     }
 };
-static IOSCameraInput *AppContext;
 
 #pragma mark - Settings Config
 
@@ -248,8 +673,12 @@ static bool refresh_devices(obs_properties_t *props, obs_property_t *p, void *da
     UNUSED_PARAMETER(p);
 
     auto cameraInput =  reinterpret_cast<IOSCameraInput*>(data);
+    if (!cameraInput) {
+        return false;
+    }
 
-    cameraInput->portal.reloadDeviceList();
+    // The portal keeps the list current from device events, so this doesn't
+    // have to wait for usbmuxd while the properties are opened.
     auto devices = cameraInput->portal.getDevices();
 
     obs_property_t *dev_list = obs_properties_get(props, SETTING_DEVICE_UUID);
@@ -258,19 +687,16 @@ static bool refresh_devices(obs_properties_t *props, obs_property_t *p, void *da
     obs_property_list_add_string(dev_list, "None", SETTING_DEVICE_UUID_NONE_VALUE);
 
     int index = 1;
-    std::for_each(devices.begin(), devices.end(), [dev_list, &index](std::map<int, portal::Device::shared_ptr>::value_type &deviceMap) {
+    std::for_each(devices->begin(), devices->end(), [cameraInput, dev_list, &index](const std::map<int, portal::Device::shared_ptr>::value_type &deviceMap) {
         // Add the device uuid to the list.
         // It would be neat to grab the device name somehow, but that will likely require
         // libmobiledevice instead of usbmuxd. Something to look into.
         auto uuid = deviceMap.second->uuid().c_str();
         obs_property_list_add_string(dev_list, uuid, uuid);
 
-        // Disable the row if the device is selected as we can only
-        // connect to one device to one source.
-        // Disabled for now as I'm not sure how to sync status across
-        // multiple instances of the plugin.
-        //                      auto isConnected = deviceMap.second->isConnected();
-        //                      obs_property_list_item_disable(dev_list, index, isConnected);
+        // Disable the row if another source is using the device, as a device
+        // can only be connected to one source.
+        obs_property_list_item_disable(dev_list, index, cameraInput->portal.isDeviceClaimedElsewhere(uuid));
 
         index++;
     });
@@ -299,7 +725,8 @@ static int sendData(int type, char* payload, int payloadSize, portal::Device& de
 const int PREV_FILTER_PACKET_TYPE = 104;
 static bool prev_filter(obs_properties_t*, obs_property_t*, void *data) {
     blog(LOG_INFO, "prev filter");
-    auto device = AppContext->portal._device;
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+    auto device = cameraInput->portal.getDevice();
     if (device) {
         sendData(PREV_FILTER_PACKET_TYPE, NULL, 0, *device);
     }
@@ -309,7 +736,8 @@ static bool prev_filter(obs_properties_t*, obs_property_t*, void *data) {
 const int NEXT_FILTER_PACKET_TYPE = 105;
 static bool next_filter(obs_properties_t*, obs_property_t*, void *data) {
     blog(LOG_INFO, "next filter");
-    auto device = AppContext->portal._device;
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+    auto device = cameraInput->portal.getDevice();
     if (device) {
         sendData(NEXT_FILTER_PACKET_TYPE, NULL, 0, *device);
     }
@@ -320,42 +748,99 @@ const int WILDCARD_PACKET_TYPE = 107;
 static bool wildcard(obs_properties_t*, obs_property_t*, void *data) {
     blog(LOG_INFO, "wildcard");
     auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
-    auto device = cameraInput->portal._device;
+    auto device = cameraInput->portal.getDevice();
     if (!device) { return false; }
     sendData(WILDCARD_PACKET_TYPE, NULL, 0, *device);
     return true;
 }
 
-static bool update_device(obs_properties_t*, obs_property_t*, obs_data *settings) {
+// The modified callbacks are given the source they belong to, as each
+// source has its own device.
+static bool update_device(void *data, obs_properties_t*, obs_property_t*, obs_data *settings) {
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+    if (!cameraInput) { return false; }
+
     auto uuid = obs_data_get_string(settings, SETTING_DEVICE_UUID);
     blog(LOG_INFO, "device value: %s", uuid);
-    AppContext->connectToDevice(uuid, false);
-    // obs_source_output_video(AppContext->source, NULL);
+    cameraInput->connectToDevice(uuid, false);
+    // obs_source_output_video(cameraInput->source, NULL);
     return true;
-    // return AppContext->portal._device != NULL;
+    // return cameraInput->portal.getDevice() != NULL;
 }
 
-static bool update_latency(obs_properties_t*, obs_property_t*, obs_data *settings) {
-    const bool is_unbuffered =
-        (obs_data_get_int(settings, SETTING_PROP_LATENCY) == SETTING_PROP_LATENCY_LOW);
-    obs_source_set_async_unbuffered(AppContext->source, is_unbuffered);
-    blog(LOG_INFO, "latency value: %d", is_unbuffered);
+static bool update_latency(void *data, obs_properties_t*, obs_property_t*, obs_data *settings) {
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+    if (!cameraInput) { return false; }
+
+    cameraInput->updateLatency(settings);
+    blog(LOG_INFO, "latency value: %lld", obs_data_get_int(settings, SETTING_PROP_LATENCY));
     return true;
 }
 
 #ifdef __APPLE__
-static bool update_hardware_decoding(obs_properties_t*, obs_property_t*, obs_data *settings) {
+static bool update_hardware_decoding(void *data, obs_properties_t*, obs_property_t*, obs_data *settings) {
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+    if (!cameraInput) { return false; }
+
     bool useHardwareDecoder = obs_data_get_bool(settings, SETTING_PROP_HARDWARE_DECODER);
     if (useHardwareDecoder) {
-        AppContext->videoDecoder = &AppContext->videoToolboxVideoDecoder;
+        cameraInput->videoDecoder = &cameraInput->videoToolboxVideoDecoder;
     } else {
-        AppContext->videoDecoder = &AppContext->ffmpegVideoDecoder;
+        cameraInput->videoDecoder = &cameraInput->ffmpegVideoDecoder;
     }
     blog(LOG_INFO, "hardware decoding value: %d", useHardwareDecoder);
     return true;
 }
 #endif
 
+static bool refresh_stats(obs_properties_t*, obs_property_t*, void *data)
+{
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+
+    // The panel is a read only text property, so its text lives in the settings.
+    obs_data_t *settings = obs_source_get_settings(cameraInput->source);
+    obs_data_set_string(settings, SETTING_PROP_STATS, cameraInput->statsText().c_str());
+    obs_data_release(settings);
+
+    return true;
+}
+
+static bool toggle_capture(obs_properties_t*, obs_property_t *p, void *data)
+{
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+
+    if (cameraInput->captureWriter.isOpen()) {
+        cameraInput->stopCapture();
+    } else {
+        obs_data_t *settings = obs_source_get_settings(cameraInput->source);
+        cameraInput->startCapture(obs_data_get_string(settings, SETTING_PROP_CAPTURE_PATH));
+        obs_data_release(settings);
+    }
+
+    obs_property_set_description(p, obs_module_text(cameraInput->captureWriter.isOpen() ?
+        "Hyperstream.Settings.StopCapture" : "Hyperstream.Settings.StartCapture"));
+    return true;
+}
+
+static bool toggle_replay(obs_properties_t*, obs_property_t *p, void *data)
+{
+    auto cameraInput = reinterpret_cast<IOSCameraInput* >(data);
+
+    if (cameraInput->replaying) {
+        cameraInput->stopReplay();
+    } else {
+        obs_data_t *settings = obs_source_get_settings(cameraInput->source);
+        cameraInput->startReplay(obs_data_get_string(settings, SETTING_PROP_REPLAY_PATH),
+                                 obs_data_get_int(settings, SETTING_PROP_REPLAY_SPEED) == SETTING_PROP_REPLAY_SPEED_REAL_TIME,
+                                 obs_data_get_bool(settings, SETTING_PROP_REPLAY_LOOP));
+        obs_data_release(settings);
+    }
+
+    obs_property_set_description(p, obs_module_text(cameraInput->replaying ?
+        "Hyperstream.Settings.StopReplay" : "Hyperstream.Settings.StartReplay"));
+    return true;
+}
+
 static bool reconnect_to_device(obs_properties_t*, obs_property_t*, void *data)
 {
     auto cameraInput =  reinterpret_cast<IOSCameraInput* >(data);
@@ -376,7 +861,6 @@ static void *CreateIOSCameraInput(obs_data_t *settings, obs_source_t *source)
     try
     {
         cameraInput = new IOSCameraInput(source, settings);
-        AppContext = cameraInput;
     }
     catch (const char *error)
     {
@@ -390,15 +874,14 @@ static void DestroyIOSCameraInput(void *data)
     delete reinterpret_cast<IOSCameraInput *>(data);
 }
 
-static void DeactivateIOSCameraInput(void *data)
+static void TickIOSCameraInput(void *data, float seconds)
 {
-    if (AppContext) {
-        auto device = AppContext->portal._device;
-        if (device) {
-            // device->disconnect();
-        }
-    }
+    auto cameraInput = reinterpret_cast<IOSCameraInput*>(data);
+    cameraInput->tick(seconds);
+}
 
+static void DeactivateIOSCameraInput(void *data)
+{
     auto cameraInput =  reinterpret_cast<IOSCameraInput*>(data);
     cameraInput->deactivate();
 }
@@ -421,7 +904,7 @@ static obs_properties_t *GetIOSCameraProperties(void *data)
                                                        "iOS Device",
                                                        OBS_COMBO_TYPE_LIST,
                                                        OBS_COMBO_FORMAT_STRING);
-    obs_property_set_modified_callback(dev_list, update_device);
+    obs_property_set_modified_callback2(dev_list, update_device, data);
 
     obs_property_list_add_string(dev_list, "", "");
 
@@ -442,12 +925,83 @@ static obs_properties_t *GetIOSCameraProperties(void *data)
     obs_property_list_add_int(latency_modes,
         obs_module_text("Hyperstream.Settings.Latency.Low"),
         SETTING_PROP_LATENCY_LOW);
-    obs_property_set_modified_callback(latency_modes, update_latency);
+    obs_property_list_add_int(latency_modes,
+        obs_module_text("Hyperstream.Settings.Latency.Adaptive"),
+        SETTING_PROP_LATENCY_ADAPTIVE);
+    obs_property_set_modified_callback2(latency_modes, update_latency, data);
+
+    obs_property_t *stats = obs_properties_add_text(ppts, SETTING_PROP_STATS, obs_module_text("Hyperstream.Settings.Stats"), OBS_TEXT_MULTILINE);
+    obs_property_set_enabled(stats, false);
+    obs_properties_add_button(ppts, "setting_refresh_stats", obs_module_text("Hyperstream.Settings.RefreshStats"), refresh_stats);
+
+    if (data != NULL) {
+        refresh_stats(ppts, stats, data);
+    }
+
+    obs_property_t* threading_modes = obs_properties_add_list(ppts, SETTING_PROP_DECODER_THREADING, obs_module_text("Hyperstream.Settings.DecoderThreading"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(threading_modes,
+        obs_module_text("Hyperstream.Settings.DecoderThreading.None"),
+        FFMPEG_DECODE_THREADING_NONE);
+    obs_property_list_add_int(threading_modes,
+        obs_module_text("Hyperstream.Settings.DecoderThreading.Slice"),
+        FFMPEG_DECODE_THREADING_SLICE);
+    obs_property_list_add_int(threading_modes,
+        obs_module_text("Hyperstream.Settings.DecoderThreading.Frame"),
+        FFMPEG_DECODE_THREADING_FRAME);
+
+    // 0 lets FFmpeg choose based on the number of cores.
+    obs_properties_add_int(ppts, SETTING_PROP_DECODER_THREADS, obs_module_text("Hyperstream.Settings.DecoderThreads"), 0, 16, 1);
+    obs_properties_add_text(ppts, SETTING_PROP_DECODER_CPUS, obs_module_text("Hyperstream.Settings.DecoderCpus"), OBS_TEXT_DEFAULT);
+
+    obs_property_t* receive_priorities = obs_properties_add_list(ppts, SETTING_PROP_RECEIVE_PRIORITY, obs_module_text("Hyperstream.Settings.ReceivePriority"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(receive_priorities,
+        obs_module_text("Hyperstream.Settings.ReceivePriority.Normal"),
+        (long long)portal::ThreadPriority::Normal);
+    obs_property_list_add_int(receive_priorities,
+        obs_module_text("Hyperstream.Settings.ReceivePriority.High"),
+        (long long)portal::ThreadPriority::High);
+    obs_property_list_add_int(receive_priorities,
+        obs_module_text("Hyperstream.Settings.ReceivePriority.Realtime"),
+        (long long)portal::ThreadPriority::Realtime);
+
+    obs_property_t* overload_policies = obs_properties_add_list(ppts, SETTING_PROP_OVERLOAD_POLICY, obs_module_text("Hyperstream.Settings.OverloadPolicy"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(overload_policies,
+        obs_module_text("Hyperstream.Settings.OverloadPolicy.SkipToKeyframe"),
+        OVERLOAD_MODE_SKIP_TO_KEYFRAME);
+    obs_property_list_add_int(overload_policies,
+        obs_module_text("Hyperstream.Settings.OverloadPolicy.NeverDrop"),
+        OVERLOAD_MODE_NEVER_DROP);
+
+    obs_properties_add_int(ppts, SETTING_PROP_MAX_QUEUED_FRAMES, obs_module_text("Hyperstream.Settings.MaxQueuedFrames"), 1, 500, 1);
+
+    auto cameraInput = reinterpret_cast<IOSCameraInput*>(data);
+    const bool capturing = cameraInput && cameraInput->captureWriter.isOpen();
+    const bool replaying = cameraInput && cameraInput->replaying;
+
+    obs_properties_add_path(ppts, SETTING_PROP_CAPTURE_PATH, obs_module_text("Hyperstream.Settings.CapturePath"),
+                            OBS_PATH_FILE_SAVE, "Portal captures (*.portal)", NULL);
+    obs_properties_add_button(ppts, "setting_capture",
+                              obs_module_text(capturing ? "Hyperstream.Settings.StopCapture" : "Hyperstream.Settings.StartCapture"),
+                              toggle_capture);
+
+    obs_properties_add_path(ppts, SETTING_PROP_REPLAY_PATH, obs_module_text("Hyperstream.Settings.ReplayPath"),
+                            OBS_PATH_FILE, "Portal captures (*.portal)", NULL);
+    obs_property_t* replay_speeds = obs_properties_add_list(ppts, SETTING_PROP_REPLAY_SPEED, obs_module_text("Hyperstream.Settings.ReplaySpeed"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(replay_speeds,
+        obs_module_text("Hyperstream.Settings.ReplaySpeed.RealTime"),
+        SETTING_PROP_REPLAY_SPEED_REAL_TIME);
+    obs_property_list_add_int(replay_speeds,
+        obs_module_text("Hyperstream.Settings.ReplaySpeed.Max"),
+        SETTING_PROP_REPLAY_SPEED_MAX);
+    obs_properties_add_bool(ppts, SETTING_PROP_REPLAY_LOOP, obs_module_text("Hyperstream.Settings.ReplayLoop"));
+    obs_properties_add_button(ppts, "setting_replay",
+                              obs_module_text(replaying ? "Hyperstream.Settings.StopReplay" : "Hyperstream.Settings.StartReplay"),
+                              toggle_replay);
 
 #ifdef __APPLE__
     obs_property_t* hardware_decoding = obs_properties_add_bool(ppts, SETTING_PROP_HARDWARE_DECODER,
         obs_module_text("Hyperstream.Settings.UseHardwareDecoder"));
-    obs_property_set_modified_callback(hardware_decoding, update_hardware_decoding);
+    obs_property_set_modified_callback2(hardware_decoding, update_hardware_decoding, data);
 #endif
 
     return ppts;
@@ -458,6 +1012,14 @@ static void GetIOSCameraDefaults(obs_data_t *settings)
 {
     obs_data_set_default_string(settings, SETTING_DEVICE_UUID, "");
     obs_data_set_default_int(settings, SETTING_PROP_LATENCY, SETTING_PROP_LATENCY_LOW);
+    obs_data_set_default_int(settings, SETTING_PROP_DECODER_THREADING, FFMPEG_DECODE_THREADING_SLICE);
+    obs_data_set_default_int(settings, SETTING_PROP_DECODER_THREADS, 0);
+    obs_data_set_default_string(settings, SETTING_PROP_DECODER_CPUS, "");
+    obs_data_set_default_int(settings, SETTING_PROP_RECEIVE_PRIORITY, (long long)portal::ThreadPriority::Normal);
+    obs_data_set_default_int(settings, SETTING_PROP_OVERLOAD_POLICY, OVERLOAD_MODE_SKIP_TO_KEYFRAME);
+    obs_data_set_default_int(settings, SETTING_PROP_MAX_QUEUED_FRAMES, 25);
+    obs_data_set_default_int(settings, SETTING_PROP_REPLAY_SPEED, SETTING_PROP_REPLAY_SPEED_REAL_TIME);
+    obs_data_set_default_bool(settings, SETTING_PROP_REPLAY_LOOP, false);
 #ifdef __APPLE__
     obs_data_set_default_bool(settings, SETTING_PROP_HARDWARE_DECODER, false);
 #endif
@@ -466,16 +1028,23 @@ static void GetIOSCameraDefaults(obs_data_t *settings)
 static void SaveIOSCameraInput(void *data, obs_data_t *settings)
 {
     UNUSED_PARAMETER(data);
-    UNUSED_PARAMETER(settings);
+
+    // The stats are only meaningful while the properties are open.
+    obs_data_erase(settings, SETTING_PROP_STATS);
 }
 
 static void UpdateIOSCameraInput(void *data, obs_data_t *settings) {
-    if (!AppContext) { return; }
+    auto cameraInput = reinterpret_cast<IOSCameraInput*>(data);
+    if (!cameraInput) { return; }
+
+    cameraInput->updateDecoderSettings(settings);
+    cameraInput->updateThreadSettings(settings);
+
     float intensity = (float)obs_data_get_double(settings, SETTING_PROP_FILTER_INTENSITY);
-    if (AppContext->intensity != intensity) {
-        AppContext->intensity = intensity;
+    if (cameraInput->intensity != intensity) {
+        cameraInput->intensity = intensity;
 
-        auto device = AppContext->portal._device;
+        auto device = cameraInput->portal.getDevice();
         if (device) {
             char* payload = reinterpret_cast<char*>(&intensity);
             sendData(106, payload, sizeof(float), *device);
@@ -483,9 +1052,9 @@ static void UpdateIOSCameraInput(void *data, obs_data_t *settings) {
     }
 
     float mix = (float)obs_data_get_double(settings, SETTING_PROP_FILTER_MIX);
-    if (AppContext->mix != mix) {
-        AppContext->mix = mix;
-        auto device = AppContext->portal._device;
+    if (cameraInput->mix != mix) {
+        cameraInput->mix = mix;
+        auto device = cameraInput->portal.getDevice();
         if (device) {
             char* payload = reinterpret_cast<char*>(&mix);
             sendData(109, payload, sizeof(float), *device);
@@ -506,6 +1075,7 @@ void RegisterIOSCameraSource()
 
     info.deactivate      = DeactivateIOSCameraInput;
     info.activate        = ActivateIOSCameraInput;
+    info.video_tick      = TickIOSCameraInput;
 
     info.get_defaults    = GetIOSCameraDefaults;
     info.get_properties  = GetIOSCameraProperties;
@@ -0,0 +1,617 @@
+/*
+ hyperstream-bench
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+// Runs captures recorded by the plugin (see portal's Capture.hpp) through the
+// plugin's FFmpeg decoders as fast as they will go, and reports how quickly
+// frames come out of them:
+//
+//     hyperstream-bench --threading slice,frame --threads 0,1,2,4 capture.portal
+//
+// The decoders are the plugin's own code, but OBS is replaced with a sink
+// that counts the frames it is given and throws them away, so only the
+// decode path is measured. --queue compares the decoders' WorkQueue with a
+// locked queue instead.
+
+#include <obs-module.h>
+#include <obs-avc.h>
+#include <util/platform.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "allocation-counter.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+static bool verbose = false;
+
+// What the decoders gave OBS during the current run.
+static std::atomic<uint64_t> videoFrames{0};
+static std::atomic<uint64_t> audioFrames{0};
+
+// The only parts of libobs the decoders use.
+
+void blog(int log_level, const char *format, ...)
+{
+    if (!verbose && log_level > LOG_WARNING) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+void *bmalloc(size_t size)
+{
+    return malloc(size != 0 ? size : 1);
+}
+
+void *brealloc(void *ptr, size_t size)
+{
+    return realloc(ptr, size != 0 ? size : 1);
+}
+
+void bfree(void *ptr)
+{
+    free(ptr);
+}
+
+uint64_t os_gettime_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool obs_avc_keyframe(const uint8_t *data, size_t size)
+{
+    // Look for an IDR slice behind any of the start codes.
+    for (size_t i = 0; i + 3 < size; i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            const int naluType = data[i + 3] & 0x1F;
+            if (naluType == 5) {
+                return true;
+            }
+            if (naluType == 1) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+bool video_format_get_parameters(enum video_colorspace color_space, enum video_range_type range,
+                                 float matrix[16], float min_range[3], float max_range[3])
+{
+    UNUSED_PARAMETER(color_space);
+    UNUSED_PARAMETER(range);
+
+    for (int i = 0; i < 16; i++) {
+        matrix[i] = i % 5 == 0 ? 1.0f : 0.0f;
+    }
+    for (int i = 0; i < 3; i++) {
+        min_range[i] = 0.0f;
+        max_range[i] = 1.0f;
+    }
+    return true;
+}
+
+void obs_source_output_video(obs_source_t *source, const struct obs_source_frame *frame)
+{
+    UNUSED_PARAMETER(source);
+    if (frame != NULL) {
+        videoFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void obs_source_output_audio(obs_source_t *source, const struct obs_source_audio *audio)
+{
+    UNUSED_PARAMETER(source);
+    if (audio != NULL) {
+        audioFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+// The most memory the process has had resident since the last reset, in bytes.
+static uint64_t peakResidentBytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#elif defined(__linux__)
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file != NULL) {
+        char line[256];
+        unsigned long long kilobytes = 0;
+        while (fgets(line, sizeof(line), file)) {
+            if (sscanf(line, "VmHWM: %llu kB", &kilobytes) == 1) {
+                break;
+            }
+        }
+        fclose(file);
+        return kilobytes * 1024;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Starts measuring the peak again, where the platform allows it. Otherwise
+// each run reports the peak of every run so far.
+static void resetPeakResidentBytes()
+{
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file != NULL) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+// The plugin's headers redefine blog(), so they come after the stubs.
+#include <Capture.hpp>
+#include <Protocol.hpp>
+#include "FFMpegVideoDecoder.h"
+#include "FFMpegAudioDecoder.h"
+#include "PipelineStats.hpp"
+#include "Queue.hpp"
+
+// Never dereferenced, the decoders only check that they have a source.
+static obs_source_t *const FakeSource = reinterpret_cast<obs_source_t *>(1);
+
+// How far ahead of the decoders the packets are fed.
+static const int MaxQueuedPackets = 16;
+
+// A looping replay leaves about a frame between passes.
+static const uint64_t PassGap = 16666667;
+
+struct Options {
+    std::vector<std::string> captures;
+    std::vector<ffmpeg_decode_threading> threadings{FFMPEG_DECODE_THREADING_SLICE};
+    std::vector<int> threadCounts{0};
+    int repeat = 1;
+    bool audio = true;
+    bool csv = false;
+    uint64_t queueItems = 0;
+};
+
+struct Run {
+    ffmpeg_decode_threading threading;
+    int threadCount;
+
+    double seconds;
+    uint64_t packets;
+    uint64_t videoFrames;
+    uint64_t audioFrames;
+    uint64_t decodeErrors;
+    uint64_t allocations;
+    uint64_t peakResident;
+    LatencySummary decode;
+};
+
+static const char *threadingName(ffmpeg_decode_threading threading)
+{
+    switch (threading) {
+        case FFMPEG_DECODE_THREADING_NONE: return "none";
+        case FFMPEG_DECODE_THREADING_SLICE: return "slice";
+        case FFMPEG_DECODE_THREADING_FRAME: return "frame";
+    }
+    return "?";
+}
+
+static bool loadCapture(const std::string &path, std::vector<portal::CaptureRecord> &records)
+{
+    portal::CaptureReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "Could not open capture %s\n", path.c_str());
+        return false;
+    }
+
+    portal::CaptureRecord record;
+    while (reader.next(record)) {
+        records.push_back(std::move(record));
+    }
+
+    if (records.empty()) {
+        fprintf(stderr, "%s has no packets\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void waitForQueue(VideoDecoder &decoder, int depth)
+{
+    while (decoder.GetQueueDepth() > depth) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+static Run runDecoders(const std::vector<portal::CaptureRecord> &records, const Options &options,
+                       ffmpeg_decode_threading threading, int threadCount)
+{
+    PipelineStats stats;
+    ClockMapper clock;
+
+    auto videoDecoder = std::make_unique<FFMpegVideoDecoder>();
+    videoDecoder->source = FakeSource;
+    videoDecoder->clock = &clock;
+    videoDecoder->stats = &stats;
+    videoDecoder->SetThreading(threading, threadCount);
+    // Every packet is decoded, the feeding below keeps the queue short.
+    videoDecoder->SetOverloadPolicy(OVERLOAD_MODE_NEVER_DROP, INT_MAX);
+    videoDecoder->Init();
+
+    auto audioDecoder = std::make_unique<FFMpegAudioDecoder>();
+    audioDecoder->source = FakeSource;
+    audioDecoder->clock = &clock;
+    audioDecoder->Init();
+
+    // Repeated passes carry on from the last timestamp, as a looping replay would.
+    uint64_t firstTimestamp = 0;
+    uint64_t lastTimestamp = 0;
+    for (const auto &record : records) {
+        const uint64_t timestamp = record.packet.timestamp();
+        if (timestamp != 0) {
+            firstTimestamp = firstTimestamp != 0 ? std::min(firstTimestamp, timestamp) : timestamp;
+            lastTimestamp = std::max(lastTimestamp, timestamp);
+        }
+    }
+    const uint64_t passLength = lastTimestamp - firstTimestamp + PassGap;
+
+    videoFrames = 0;
+    audioFrames = 0;
+    resetPeakResidentBytes();
+
+    Run run = {};
+    run.threading = threading;
+    run.threadCount = threadCount;
+
+    const uint64_t startAllocations = allocations.load();
+    const uint64_t startTime = os_gettime_ns();
+
+    for (int pass = 0; pass < options.repeat; pass++) {
+        for (const auto &record : records) {
+            const bool isVideo = record.type == portal::PortalFrameTypeVideo;
+            if (!isVideo && (record.type != portal::PortalFrameTypeAudio || !options.audio)) {
+                continue;
+            }
+
+            // The receive path allocates a packet for every frame, so this
+            // copy is part of what is measured.
+            portal::Packet packet(record.packet.data(), record.packet.size());
+            if (record.packet.timestamp() != 0) {
+                packet.setTimestamp(record.packet.timestamp() + pass * passLength);
+                clock.update(packet.timestamp(), os_gettime_ns());
+            }
+
+            const uint64_t now = portal::monotonicTime();
+            packet.setReceiveTime(now);
+            packet.setParseTime(now);
+
+            VideoDecoder &decoder = isVideo ? (VideoDecoder &)*videoDecoder : (VideoDecoder &)*audioDecoder;
+            waitForQueue(decoder, MaxQueuedPackets);
+            decoder.Input(std::move(packet), record.type, record.tag);
+            run.packets++;
+        }
+    }
+
+    // Draining waits for the packet being decoded, once the queue is empty.
+    waitForQueue(*videoDecoder, 0);
+    waitForQueue(*audioDecoder, 0);
+    videoDecoder->Drain();
+    audioDecoder->Drain();
+
+    run.seconds = (os_gettime_ns() - startTime) / 1000000000.0;
+    run.allocations = allocations.load() - startAllocations;
+    run.peakResident = peakResidentBytes();
+    run.videoFrames = videoFrames.load();
+    run.audioFrames = audioFrames.load();
+    run.decodeErrors = videoDecoder->GetDecodeErrors();
+    run.decode = stats.snapshot(false).stages[PIPELINE_STAGE_DECODE];
+
+    return run;
+}
+
+static void printRun(const std::string &capture, const Run &run, bool csv)
+{
+    const double fps = run.seconds > 0 ? run.videoFrames / run.seconds : 0.0;
+    const double allocationsPerFrame = run.videoFrames > 0 ? (double)run.allocations / run.videoFrames : 0.0;
+
+    if (csv) {
+        printf("%s,%s,%d,%llu,%llu,%llu,%.3f,%.1f,%.3f,%.3f,%.3f,%.1f,%llu,%llu\n",
+               capture.c_str(), threadingName(run.threading), run.threadCount,
+               (unsigned long long)run.packets, (unsigned long long)run.videoFrames, (unsigned long long)run.audioFrames,
+               run.seconds, fps, run.decode.mean / 1000.0, run.decode.p50 / 1000.0, run.decode.p99 / 1000.0,
+               allocationsPerFrame, (unsigned long long)(run.peakResident / 1024), (unsigned long long)run.decodeErrors);
+        return;
+    }
+
+    printf("%-6s %7d %8llu %8.1f %8.2f %8.2f %8.2f %10.1f %9.1f %7llu\n",
+           threadingName(run.threading), run.threadCount, (unsigned long long)run.videoFrames, fps,
+           run.decode.mean / 1000.0, run.decode.p50 / 1000.0, run.decode.p99 / 1000.0,
+           allocationsPerFrame, run.peakResident / (1024.0 * 1024.0), (unsigned long long)run.decodeErrors);
+}
+
+static int benchmarkDecoders(const Options &options)
+{
+    if (options.csv) {
+        printf("capture,threading,threads,packets,video_frames,audio_frames,seconds,fps,"
+               "decode_mean_ms,decode_p50_ms,decode_p99_ms,allocations_per_frame,peak_rss_kb,decode_errors\n");
+    }
+
+    for (const auto &capture : options.captures) {
+        std::vector<portal::CaptureRecord> records;
+        if (!loadCapture(capture, records)) {
+            return 1;
+        }
+
+        if (!options.csv) {
+            printf("%s: %zu packets, %d pass%s\n", capture.c_str(), records.size(), options.repeat, options.repeat == 1 ? "" : "es");
+            printf("%-6s %7s %8s %8s %8s %8s %8s %10s %9s %7s\n",
+                   "thread", "threads", "frames", "fps", "mean ms", "p50 ms", "p99 ms", "allocs/fr", "peak MB", "errors");
+        }
+
+        for (auto threading : options.threadings) {
+            for (int threadCount : options.threadCounts) {
+                printRun(capture, runDecoders(records, options, threading, threadCount), options.csv);
+                fflush(stdout);
+            }
+        }
+
+        if (!options.csv) {
+            printf("\n");
+        }
+    }
+
+    return 0;
+}
+
+// A bounded queue behind a mutex and condition variable, which is what the
+// decoders used before WorkQueue, to compare it against.
+template <typename T> class LockedQueue
+{
+public:
+    explicit LockedQueue(size_t capacity = 512) : mCapacity(capacity) {}
+
+    bool add(T item) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mItems.size() >= mCapacity) {
+                return false;
+            }
+            mItems.push_back(item);
+        }
+        mConditionVariable.notify_one();
+        return true;
+    }
+
+    T remove() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mConditionVariable.wait(lock, [this]{ return !mItems.empty(); });
+        T item = mItems.front();
+        mItems.pop_front();
+        return item;
+    }
+
+private:
+    size_t mCapacity;
+    std::mutex mMutex;
+    std::condition_variable mConditionVariable;
+    std::deque<T> mItems;
+};
+
+// Passes items from one thread to another through Queue, the way packets go
+// from the reactor to a decoder, and records how long each one waited.
+template <typename Queue> static void benchmarkQueue(const char *name, uint64_t items, bool csv)
+{
+    Queue queue;
+    LatencyHistogram latency;
+
+    const uint64_t startTime = os_gettime_ns();
+
+    std::thread consumer([&]() {
+        for (uint64_t i = 0; i < items; i++) {
+            PacketItem *item = queue.remove();
+            latency.record(PipelineStats::now() - item->getQueueTime());
+            delete item;
+        }
+    });
+
+    for (uint64_t i = 0; i < items; i++) {
+        PacketItem *item = new PacketItem(portal::Packet(), portal::PortalFrameTypeVideo, 0);
+        item->setQueueTime(PipelineStats::now());
+        while (!queue.add(item)) {
+            std::this_thread::yield();
+            item->setQueueTime(PipelineStats::now());
+        }
+    }
+
+    consumer.join();
+
+    const double seconds = (os_gettime_ns() - startTime) / 1000000000.0;
+    const auto summary = latency.summarize(false);
+
+    if (csv) {
+        printf("%s,%llu,%.3f,%.0f,%llu,%llu,%llu\n", name, (unsigned long long)items, seconds, items / seconds,
+               (unsigned long long)summary.p50, (unsigned long long)summary.p99, (unsigned long long)summary.max);
+    } else {
+        printf("%-12s %12.0f %10llu %10llu %10llu\n", name, items / seconds,
+               (unsigned long long)summary.p50, (unsigned long long)summary.p99, (unsigned long long)summary.max);
+    }
+}
+
+static int benchmarkQueues(const Options &options)
+{
+    if (options.csv) {
+        printf("queue,items,seconds,items_per_second,p50_us,p99_us,max_us\n");
+    } else {
+        printf("%-12s %12s %10s %10s %10s\n", "queue", "items/s", "p50 us", "p99 us", "max us");
+    }
+
+    benchmarkQueue<WorkQueue<PacketItem *>>("WorkQueue", options.queueItems, options.csv);
+    benchmarkQueue<LockedQueue<PacketItem *>>("LockedQueue", options.queueItems, options.csv);
+    return 0;
+}
+
+template <typename T> static bool parseList(const char *value, std::vector<T> &list, bool (*parse)(const std::string &, T &))
+{
+    list.clear();
+
+    std::string text(value);
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+
+        T item;
+        if (!parse(text.substr(start, end - start), item)) {
+            return false;
+        }
+        list.push_back(item);
+        start = end + 1;
+    }
+    return !list.empty();
+}
+
+static bool parseThreading(const std::string &value, ffmpeg_decode_threading &threading)
+{
+    if (value == "none") {
+        threading = FFMPEG_DECODE_THREADING_NONE;
+    } else if (value == "slice") {
+        threading = FFMPEG_DECODE_THREADING_SLICE;
+    } else if (value == "frame") {
+        threading = FFMPEG_DECODE_THREADING_FRAME;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseThreadCount(const std::string &value, int &threadCount)
+{
+    char *end = NULL;
+    long count = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || count < 0 || count > 64) {
+        return false;
+    }
+    threadCount = (int)count;
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <capture>...\n"
+            "       %s --queue <items> [--csv]\n"
+            "\n"
+            "  --threading <list>  Decoder threading modes to run: none, slice, frame (default slice)\n"
+            "  --threads <list>    Decoder thread counts to run, 0 lets FFmpeg choose (default 0)\n"
+            "  --repeat <n>        Passes over each capture (default 1)\n"
+            "  --no-audio          Only decode video\n"
+            "  --queue <items>     Compare the decoder queue with a locked queue instead\n"
+            "  --csv               Print the results as CSV\n"
+            "  --verbose           Show the decoders' log messages\n",
+            name, name);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (arg == "--threading" && value) {
+            if (!parseList(value, options.threadings, parseThreading)) {
+                fprintf(stderr, "Invalid threading modes %s\n", value);
+                return 1;
+            }
+            i++;
+        } else if (arg == "--threads" && value) {
+            if (!parseList(value, options.threadCounts, parseThreadCount)) {
+                fprintf(stderr, "Invalid thread counts %s\n", value);
+                return 1;
+            }
+            i++;
+        } else if (arg == "--repeat" && value) {
+            options.repeat = std::max(1, atoi(value));
+            i++;
+        } else if (arg == "--queue" && value) {
+            options.queueItems = strtoull(value, NULL, 10);
+            i++;
+        } else if (arg == "--no-audio") {
+            options.audio = false;
+        } else if (arg == "--csv") {
+            options.csv = true;
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            options.captures.push_back(arg);
+        }
+    }
+
+    if (options.queueItems > 0) {
+        return benchmarkQueues(options);
+    }
+
+    if (options.captures.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return benchmarkDecoders(options);
+}
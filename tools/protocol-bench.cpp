@@ -0,0 +1,522 @@
+/*
+ protocol-bench
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+// Feeds Portal frame streams through SimpleDataPacketProtocol, split into
+// reads of different sizes, and reports how fast packets come out of it:
+//
+//     protocol-bench --profile 1080p,4k --chunks 1448,16384,random
+//
+// The streams are generated to look like what the device sends, or taken
+// from captures recorded by the plugin. Both ways of giving the protocol
+// data are measured: processData(), which copies from a buffer the caller
+// read into, and prepareRead()/commitRead(), which the channel uses to read
+// straight into the protocol's buffers. The bytes are copied from memory in
+// both cases, so only the parsing is measured, not the socket.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "allocation-counter.hpp"
+
+#include <Capture.hpp>
+#include <Protocol.hpp>
+
+// The size of each generated stream. Runs go round it as often as they need to.
+static const size_t StreamSize = 32 * 1024 * 1024;
+
+// Chunk sizes of 0 stand for the whole stream in one read, and -1 for
+// random sizes.
+static const long WholeStream = 0;
+static const long RandomChunks = -1;
+
+enum Entry {
+    ENTRY_PROCESS_DATA,
+    ENTRY_PREPARE_READ,
+};
+
+struct Stream {
+    std::string name;
+    std::vector<char> data;
+    uint64_t packets;
+};
+
+struct Options {
+    std::vector<std::string> profiles{"audio", "1080p", "4k", "tiny"};
+    std::vector<std::string> captures;
+    std::vector<long> chunks{WholeStream, 1, 16, 1448, 16384, 65536, RandomChunks};
+    std::vector<Entry> entries{ENTRY_PROCESS_DATA, ENTRY_PREPARE_READ};
+    double seconds = 0.5;
+    bool csv = false;
+};
+
+struct Run {
+    double seconds;
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t allocations;
+};
+
+// Takes the packets and throws them away.
+class CountingDelegate: public portal::SimpleDataPacketProtocolDelegate
+{
+public:
+    void simpleDataPacketProtocolDelegateDidProcessPacket(portal::Packet packet, int type, int tag) override
+    {
+        (void)type;
+        (void)tag;
+        packets++;
+        bytes += packet.size();
+    }
+
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+};
+
+static uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void appendUInt32(std::vector<char> &data, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        data.push_back((char)(value >> shift));
+    }
+}
+
+static void appendUInt64(std::vector<char> &data, uint64_t value)
+{
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        data.push_back((char)(value >> shift));
+    }
+}
+
+/**
+ Appends a frame with a payload of *size* bytes. Video payloads are a NAL
+ unit behind a start code, the way the device sends them. A timestamp of 0
+ sends the frame without one, as older versions of the app did.
+ */
+static void appendFrame(std::vector<char> &data, uint32_t type, uint32_t size, int naluType, uint64_t timestamp)
+{
+    const bool timestamped = timestamp != 0;
+    if (timestamped) {
+        type = type == portal::PortalFrameTypeVideo ? portal::PortalFrameTypeTimestampedVideo : portal::PortalFrameTypeTimestampedAudio;
+    }
+
+    appendUInt32(data, 0);
+    appendUInt32(data, type);
+    appendUInt32(data, 0);
+    appendUInt32(data, size + (timestamped ? sizeof(uint64_t) : 0));
+    if (timestamped) {
+        appendUInt64(data, timestamp);
+    }
+
+    const size_t start = data.size();
+    data.resize(start + size, (char)0xA5);
+    if (naluType != 0 && size >= 5) {
+        data[start] = 0;
+        data[start + 1] = 0;
+        data[start + 2] = 0;
+        data[start + 3] = 1;
+        data[start + 4] = (char)(0x60 | naluType);
+    }
+}
+
+/**
+ A stream of 60 fps video with an IDR every 2 seconds, and 48 kHz AAC audio
+ interleaved with it, sized like the device's encoder at *idrSize* and
+ *frameSize* bytes.
+ */
+static void generateVideo(Stream &stream, uint32_t idrSize, uint32_t frameSize)
+{
+    std::mt19937 random(1);
+    std::uniform_int_distribution<uint32_t> frameSizes(frameSize / 2, frameSize * 3 / 2);
+    std::uniform_int_distribution<uint32_t> audioSizes(300, 420);
+
+    const uint64_t frameDuration = 16666667;
+    const uint64_t audioDuration = 21333333;
+    uint64_t videoTime = frameDuration;
+    uint64_t audioTime = audioDuration;
+
+    for (int frame = 0; stream.data.size() < StreamSize; frame++) {
+        if (frame % 120 == 0) {
+            appendFrame(stream.data, portal::PortalFrameTypeVideo, 24, 7, videoTime);
+            appendFrame(stream.data, portal::PortalFrameTypeVideo, 8, 8, videoTime);
+            appendFrame(stream.data, portal::PortalFrameTypeVideo, idrSize, 5, videoTime);
+            stream.packets += 3;
+        } else {
+            appendFrame(stream.data, portal::PortalFrameTypeVideo, frameSizes(random), 1, videoTime);
+            stream.packets++;
+        }
+        videoTime += frameDuration;
+
+        while (audioTime < videoTime) {
+            appendFrame(stream.data, portal::PortalFrameTypeAudio, audioSizes(random), 0, audioTime);
+            audioTime += audioDuration;
+            stream.packets++;
+        }
+    }
+}
+
+static bool generateStream(const std::string &profile, Stream &stream)
+{
+    stream.name = profile;
+    stream.data.reserve(StreamSize + 2 * 1024 * 1024);
+    stream.packets = 0;
+
+    if (profile == "audio") {
+        // Audio on its own, as when the phone's screen is off.
+        uint64_t time = 1;
+        while (stream.data.size() < StreamSize) {
+            appendFrame(stream.data, portal::PortalFrameTypeAudio, 372, 0, time);
+            time += 21333333;
+            stream.packets++;
+        }
+    } else if (profile == "1080p") {
+        generateVideo(stream, 250 * 1024, 25 * 1024);
+    } else if (profile == "4k") {
+        generateVideo(stream, 1536 * 1024, 160 * 1024);
+    } else if (profile == "legacy") {
+        // 1080p from a version of the app that didn't send timestamps.
+        std::mt19937 random(1);
+        std::uniform_int_distribution<uint32_t> frameSizes(12 * 1024, 38 * 1024);
+        for (int frame = 0; stream.data.size() < StreamSize; frame++) {
+            const bool keyframe = frame % 120 == 0;
+            appendFrame(stream.data, portal::PortalFrameTypeVideo, keyframe ? 250 * 1024 : frameSizes(random), keyframe ? 5 : 1, 0);
+            stream.packets++;
+        }
+    } else if (profile == "tiny") {
+        // The most headers per byte the protocol will see.
+        while (stream.data.size() < StreamSize) {
+            appendFrame(stream.data, portal::PortalFrameTypeVideo, 16, 1, 0);
+            stream.packets++;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Turns a capture back into the bytes the device sent.
+static bool loadCapture(const std::string &path, Stream &stream)
+{
+    portal::CaptureReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "Could not open capture %s\n", path.c_str());
+        return false;
+    }
+
+    stream.name = path;
+    stream.packets = 0;
+
+    portal::CaptureRecord record;
+    while (reader.next(record)) {
+        const uint32_t size = (uint32_t)record.packet.size();
+        appendFrame(stream.data, record.type, size, 0, record.packet.timestamp());
+        memcpy(stream.data.data() + stream.data.size() - size, record.packet.data(), size);
+        stream.packets++;
+    }
+
+    if (stream.packets == 0) {
+        fprintf(stderr, "%s has no packets\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Read sizes between 1 byte and 256 KB, spread evenly over the orders of
+// magnitude, chosen up front so that the random numbers aren't measured.
+static std::vector<size_t> randomChunkSizes()
+{
+    std::mt19937 random(2);
+    std::uniform_real_distribution<double> exponent(0.0, 18.0);
+
+    std::vector<size_t> sizes(4096);
+    for (auto &size : sizes) {
+        size = (size_t)std::pow(2.0, exponent(random));
+    }
+    return sizes;
+}
+
+static Run runProtocol(const Stream &stream, long chunk, Entry entry, double seconds)
+{
+    static const std::vector<size_t> randomSizes = randomChunkSizes();
+
+    auto delegate = std::make_shared<CountingDelegate>();
+    auto protocol = std::make_shared<portal::SimpleDataPacketProtocol>();
+    protocol->setDelegate(delegate);
+
+    const char *data = stream.data.data();
+    const size_t size = stream.data.size();
+    const uint64_t deadline = (uint64_t)(seconds * 1000000000.0);
+
+    Run run = {};
+    size_t randomIndex = 0;
+
+    const uint64_t startAllocations = allocations.load();
+    const uint64_t startTime = now();
+
+    // Whole passes only, so that every pass ends on a frame boundary.
+    do {
+        size_t offset = 0;
+        while (offset < size) {
+            size_t length = size - offset;
+            if (chunk == RandomChunks) {
+                length = std::min(length, randomSizes[randomIndex++ % randomSizes.size()]);
+            } else if (chunk != WholeStream) {
+                length = std::min(length, (size_t)chunk);
+            }
+
+            if (entry == ENTRY_PROCESS_DATA) {
+                protocol->processData(const_cast<char *>(data + offset), (int)length);
+                offset += length;
+            } else {
+                // As the channel does, a read is never more than the protocol asked for.
+                size_t writable = 0;
+                char *destination = protocol->prepareRead(&writable);
+                length = std::min(length, writable);
+                memcpy(destination, data + offset, length);
+                protocol->commitRead(length);
+                offset += length;
+            }
+        }
+        run.bytes += size;
+    } while (now() - startTime < deadline);
+
+    run.seconds = (now() - startTime) / 1000000000.0;
+    run.allocations = allocations.load() - startAllocations;
+    run.packets = delegate->packets;
+
+    return run;
+}
+
+static std::string chunkName(long chunk)
+{
+    if (chunk == WholeStream) {
+        return "whole";
+    }
+    if (chunk == RandomChunks) {
+        return "random";
+    }
+    return std::to_string(chunk);
+}
+
+static const char *entryName(Entry entry)
+{
+    return entry == ENTRY_PROCESS_DATA ? "processData" : "prepareRead";
+}
+
+static void printRun(const Stream &stream, long chunk, Entry entry, const Run &run, bool csv)
+{
+    const double megabytesPerSecond = run.seconds > 0 ? run.bytes / (1024.0 * 1024.0) / run.seconds : 0.0;
+    const double packetsPerSecond = run.seconds > 0 ? run.packets / run.seconds : 0.0;
+    const double allocationsPerPacket = run.packets > 0 ? (double)run.allocations / run.packets : 0.0;
+
+    if (csv) {
+        printf("%s,%s,%s,%llu,%llu,%.3f,%.1f,%.0f,%.3f\n",
+               stream.name.c_str(), chunkName(chunk).c_str(), entryName(entry),
+               (unsigned long long)run.bytes, (unsigned long long)run.packets, run.seconds,
+               megabytesPerSecond, packetsPerSecond, allocationsPerPacket);
+        return;
+    }
+
+    printf("%-8s %-12s %10.1f %12.0f %10.3f\n", chunkName(chunk).c_str(), entryName(entry),
+           megabytesPerSecond, packetsPerSecond, allocationsPerPacket);
+}
+
+static int benchmarkStream(const Stream &stream, const Options &options)
+{
+    if (!options.csv) {
+        printf("%s: %.1f MB, %llu packets\n", stream.name.c_str(), stream.data.size() / (1024.0 * 1024.0),
+               (unsigned long long)stream.packets);
+        printf("%-8s %-12s %10s %12s %10s\n", "chunks", "entry", "MB/s", "packets/s", "allocs/pkt");
+    }
+
+    for (long chunk : options.chunks) {
+        for (Entry entry : options.entries) {
+            const Run run = runProtocol(stream, chunk, entry, options.seconds);
+
+            // Every pass should give back every packet that went in.
+            const uint64_t passes = run.bytes / stream.data.size();
+            if (run.packets != passes * stream.packets) {
+                fprintf(stderr, "%s, %s reads, %s: expected %llu packets, got %llu\n",
+                        stream.name.c_str(), chunkName(chunk).c_str(), entryName(entry),
+                        (unsigned long long)(passes * stream.packets), (unsigned long long)run.packets);
+                return 1;
+            }
+
+            printRun(stream, chunk, entry, run, options.csv);
+            fflush(stdout);
+        }
+    }
+
+    if (!options.csv) {
+        printf("\n");
+    }
+    return 0;
+}
+
+template <typename T> static bool parseList(const char *value, std::vector<T> &list, bool (*parse)(const std::string &, T &))
+{
+    list.clear();
+
+    std::string text(value);
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+
+        T item;
+        if (!parse(text.substr(start, end - start), item)) {
+            return false;
+        }
+        list.push_back(item);
+        start = end + 1;
+    }
+    return !list.empty();
+}
+
+static bool parseProfile(const std::string &value, std::string &profile)
+{
+    if (value != "audio" && value != "1080p" && value != "4k" && value != "legacy" && value != "tiny") {
+        return false;
+    }
+    profile = value;
+    return true;
+}
+
+static bool parseChunk(const std::string &value, long &chunk)
+{
+    if (value == "whole") {
+        chunk = WholeStream;
+        return true;
+    }
+    if (value == "random") {
+        chunk = RandomChunks;
+        return true;
+    }
+
+    char *end = NULL;
+    chunk = strtol(value.c_str(), &end, 10);
+    return !value.empty() && *end == '\0' && chunk > 0;
+}
+
+static bool parseEntry(const std::string &value, Entry &entry)
+{
+    if (value == "processData") {
+        entry = ENTRY_PROCESS_DATA;
+    } else if (value == "prepareRead") {
+        entry = ENTRY_PREPARE_READ;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [capture]...\n"
+            "\n"
+            "  --profile <list>  Streams to generate: audio, 1080p, 4k, legacy, tiny\n"
+            "                    (default all but legacy, none if captures are given)\n"
+            "  --chunks <list>   Read sizes in bytes, or whole or random (default whole,1,16,1448,16384,65536,random)\n"
+            "  --entry <list>    Entry points to use: processData, prepareRead (default both)\n"
+            "  --seconds <n>     Least time to spend on each run (default 0.5)\n"
+            "  --csv             Print the results as CSV\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    bool profilesGiven = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (arg == "--profile" && value) {
+            if (!parseList(value, options.profiles, parseProfile)) {
+                fprintf(stderr, "Invalid profiles %s\n", value);
+                return 1;
+            }
+            profilesGiven = true;
+            i++;
+        } else if (arg == "--chunks" && value) {
+            if (!parseList(value, options.chunks, parseChunk)) {
+                fprintf(stderr, "Invalid chunk sizes %s\n", value);
+                return 1;
+            }
+            i++;
+        } else if (arg == "--entry" && value) {
+            if (!parseList(value, options.entries, parseEntry)) {
+                fprintf(stderr, "Invalid entry points %s\n", value);
+                return 1;
+            }
+            i++;
+        } else if (arg == "--seconds" && value) {
+            options.seconds = std::max(0.0, atof(value));
+            i++;
+        } else if (arg == "--csv") {
+            options.csv = true;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            options.captures.push_back(arg);
+        }
+    }
+
+    if (!options.captures.empty() && !profilesGiven) {
+        options.profiles.clear();
+    }
+
+    if (options.csv) {
+        printf("stream,chunks,entry,bytes,packets,seconds,mb_per_second,packets_per_second,allocations_per_packet\n");
+    }
+
+    for (const auto &profile : options.profiles) {
+        Stream stream;
+        generateStream(profile, stream);
+        if (benchmarkStream(stream, options) != 0) {
+            return 1;
+        }
+    }
+
+    for (const auto &capture : options.captures) {
+        Stream stream;
+        if (!loadCapture(capture, stream) || benchmarkStream(stream, options) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
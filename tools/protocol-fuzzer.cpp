@@ -0,0 +1,349 @@
+/*
+ protocol-fuzzer
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+// A libFuzzer target for SimpleDataPacketProtocol, so that changes to the
+// parser can be checked against every way the stream can be split into reads:
+//
+//     protocol-fuzzer -max_len=65536 corpus/
+//
+// The first byte of each input picks what the rest is used for:
+//
+//  - Raw: the bytes are fed to the protocol as if they came from the device,
+//    and it must survive anything while only dispatching packets that fit
+//    the protocol's limits.
+//  - Structured: the bytes describe a valid stream of frames, which is fed
+//    to the protocol and must come out exactly as it went in, with each
+//    packet dispatched by the read that completes it.
+//
+// Both split the stream into reads with sizes taken from the input, and use
+// processData() or prepareRead()/commitRead() as the input chooses.
+//
+// Built without libFuzzer, it runs the files it is given instead, e.g. to
+// check a corpus against a change to the parser.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <Protocol.hpp>
+
+// Keeps each input quick to run.
+static const size_t MaxStreamSize = 1024 * 1024;
+static const size_t MaxReadSizes = 16;
+
+struct ExpectedPacket {
+    // Where the frame ends in the stream, so the packet must have been
+    // dispatched once this many bytes were read.
+    size_t end;
+    int type;
+    int tag;
+    uint64_t timestamp;
+    size_t payloadOffset;
+    size_t payloadSize;
+};
+
+struct DispatchedPacket {
+    portal::Packet packet;
+    int type;
+    int tag;
+};
+
+class RecordingDelegate: public portal::SimpleDataPacketProtocolDelegate
+{
+public:
+    void simpleDataPacketProtocolDelegateDidProcessPacket(portal::Packet packet, int type, int tag) override
+    {
+        packets.push_back({std::move(packet), type, tag});
+    }
+
+    std::vector<DispatchedPacket> packets;
+};
+
+static void check(bool condition, const char *message)
+{
+    if (!condition) {
+        fprintf(stderr, "protocol-fuzzer: %s\n", message);
+        abort();
+    }
+}
+
+// Takes values from the front of the input, giving zeroes once it runs out.
+class InputReader
+{
+public:
+    InputReader(const uint8_t *data_, size_t size_) : data(data_), size(size_) {}
+
+    uint8_t byte()
+    {
+        return offset < size ? data[offset++] : 0;
+    }
+
+    uint16_t uint16()
+    {
+        const uint16_t high = byte();
+        return (uint16_t)(high << 8 | byte());
+    }
+
+    const uint8_t *rest(size_t *length)
+    {
+        *length = size - std::min(offset, size);
+        return data + std::min(offset, size);
+    }
+
+    bool empty()
+    {
+        return offset >= size;
+    }
+
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t offset = 0;
+};
+
+// The sizes of the reads the stream is split into, used in turn.
+class ReadSizes
+{
+public:
+    explicit ReadSizes(InputReader &input)
+    {
+        const size_t count = input.byte() % (MaxReadSizes + 1);
+        for (size_t i = 0; i < count; i++) {
+            // Mostly small reads, which split headers, with the odd large one.
+            const uint16_t value = input.uint16();
+            sizes.push_back(value & 0x8000 ? (size_t)(value & 0x7FFF) * 32 + 1 : (size_t)(value & 0xFF) + 1);
+        }
+    }
+
+    // No sizes means the whole stream in one read.
+    size_t next(size_t remaining)
+    {
+        if (sizes.empty()) {
+            return remaining;
+        }
+        return std::min(remaining, sizes[index++ % sizes.size()]);
+    }
+
+private:
+    std::vector<size_t> sizes;
+    size_t index = 0;
+};
+
+/**
+ Feeds *stream* to *protocol* in reads of *readSizes*, calling *afterRead*
+ with the number of bytes read so far and the packets the read dispatched.
+ */
+template <typename AfterRead>
+static void feed(portal::SimpleDataPacketProtocol &protocol, const std::vector<char> &stream, ReadSizes &readSizes,
+                 bool useProcessData, AfterRead afterRead)
+{
+    size_t offset = 0;
+    while (offset < stream.size()) {
+        size_t length = readSizes.next(stream.size() - offset);
+        int dispatched;
+
+        if (useProcessData) {
+            dispatched = protocol.processData(const_cast<char *>(stream.data() + offset), (int)length);
+        } else {
+            // As the channel does, a read is never more than the protocol asked for.
+            size_t writable = 0;
+            char *destination = protocol.prepareRead(&writable);
+            check(destination != nullptr && writable > 0, "prepareRead() returned nowhere to read to");
+            length = std::min(length, writable);
+            memcpy(destination, stream.data() + offset, length);
+            dispatched = protocol.commitRead(length);
+        }
+
+        offset += length;
+        afterRead(offset, dispatched);
+    }
+}
+
+static void runRaw(InputReader &input, bool useProcessData)
+{
+    ReadSizes readSizes(input);
+
+    size_t length = 0;
+    const uint8_t *rest = input.rest(&length);
+    const std::vector<char> stream(rest, rest + std::min(length, MaxStreamSize));
+
+    auto delegate = std::make_shared<RecordingDelegate>();
+    portal::SimpleDataPacketProtocol protocol;
+    protocol.setDelegate(delegate);
+
+    size_t payloadBytes = 0;
+    feed(protocol, stream, readSizes, useProcessData, [&](size_t offset, int dispatched) {
+        check((size_t)dispatched == delegate->packets.size(), "the number of packets returned doesn't match those dispatched");
+
+        for (const auto &packet : delegate->packets) {
+            check(!packet.packet.empty(), "dispatched an empty packet");
+            check(packet.packet.size() <= portal::SimpleDataPacketProtocol::MaxPayloadSize, "dispatched a packet over the size limit");
+            payloadBytes += packet.packet.size();
+        }
+        delegate->packets.clear();
+
+        check(payloadBytes <= offset, "dispatched more payload than was read");
+    });
+}
+
+static void appendUInt32(std::vector<char> &stream, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        stream.push_back((char)(value >> shift));
+    }
+}
+
+static void appendUInt64(std::vector<char> &stream, uint64_t value)
+{
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        stream.push_back((char)(value >> shift));
+    }
+}
+
+/**
+ Each frame is described by 4 bytes: the type, the tag and the payload size.
+ The types are the four the device sends, or a type the protocol doesn't
+ know, which it must pass through all the same. Payloads can be empty.
+ */
+static void runStructured(InputReader &input, bool useProcessData)
+{
+    ReadSizes readSizes(input);
+
+    std::vector<char> stream;
+    std::vector<ExpectedPacket> expected;
+
+    for (uint32_t index = 0; !input.empty(); index++) {
+        const uint8_t kind = input.byte();
+        const uint8_t tag = input.byte();
+        const uint16_t size = input.uint16();
+        const size_t payloadSize = kind & 0x08 ? (size_t)size * 16 : size;
+
+        static const uint32_t types[] = {
+            portal::PortalFrameTypeVideo, portal::PortalFrameTypeAudio,
+            portal::PortalFrameTypeTimestampedVideo, portal::PortalFrameTypeTimestampedAudio,
+        };
+        const uint32_t type = kind & 0x04 ? 200 + (kind >> 4) : types[kind & 0x03];
+        const bool timestamped = type == portal::PortalFrameTypeTimestampedVideo || type == portal::PortalFrameTypeTimestampedAudio;
+
+        if (stream.size() + sizeof(portal::PortalFrame) + sizeof(uint64_t) + payloadSize > MaxStreamSize) {
+            break;
+        }
+
+        appendUInt32(stream, kind >> 4);
+        appendUInt32(stream, type);
+        appendUInt32(stream, tag);
+        appendUInt32(stream, (uint32_t)(payloadSize + (timestamped ? sizeof(uint64_t) : 0)));
+
+        // Timestamps are 0 now and then, which the protocol must not treat
+        // as missing when the frame has one.
+        const uint64_t timestamp = timestamped && index % 7 != 0 ? 0x0102030405060708ULL * (index + 1) : 0;
+        if (timestamped) {
+            appendUInt64(stream, timestamp);
+        }
+
+        const size_t payloadOffset = stream.size();
+        for (size_t i = 0; i < payloadSize; i++) {
+            stream.push_back((char)(index * 31 + i * 7));
+        }
+
+        if (payloadSize > 0) {
+            int plainType = (int)type;
+            if (type == portal::PortalFrameTypeTimestampedVideo) {
+                plainType = portal::PortalFrameTypeVideo;
+            } else if (type == portal::PortalFrameTypeTimestampedAudio) {
+                plainType = portal::PortalFrameTypeAudio;
+            }
+            expected.push_back({stream.size(), plainType, tag, timestamp, payloadOffset, payloadSize});
+        }
+    }
+
+    auto delegate = std::make_shared<RecordingDelegate>();
+    portal::SimpleDataPacketProtocol protocol;
+    protocol.setDelegate(delegate);
+
+    size_t next = 0;
+    feed(protocol, stream, readSizes, useProcessData, [&](size_t offset, int dispatched) {
+        check((size_t)dispatched == delegate->packets.size(), "the number of packets returned doesn't match those dispatched");
+
+        for (const auto &packet : delegate->packets) {
+            check(next < expected.size(), "dispatched a packet that wasn't sent");
+            const ExpectedPacket &frame = expected[next++];
+
+            check(frame.end <= offset, "dispatched a packet before all of it was read");
+            check(packet.type == frame.type, "dispatched a packet with the wrong type");
+            check(packet.tag == frame.tag, "dispatched a packet with the wrong tag");
+            check(packet.packet.timestamp() == frame.timestamp, "dispatched a packet with the wrong timestamp");
+            check(packet.packet.size() == frame.payloadSize, "dispatched a packet with the wrong size");
+            check(memcmp(packet.packet.data(), stream.data() + frame.payloadOffset, frame.payloadSize) == 0,
+                  "dispatched a packet with the wrong payload");
+        }
+        delegate->packets.clear();
+
+        // Nothing that has been read completely may be held back.
+        check(next == expected.size() || expected[next].end > offset, "held back a packet that had been read");
+    });
+
+    check(next == expected.size(), "packets went missing");
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    InputReader input(data, size);
+
+    const uint8_t mode = input.byte();
+    const bool useProcessData = mode & 0x02;
+
+    if (mode & 0x01) {
+        runStructured(input, useProcessData);
+    } else {
+        runRaw(input, useProcessData);
+    }
+    return 0;
+}
+
+#ifdef PROTOCOL_FUZZER_STANDALONE
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open %s\n", argv[i]);
+            return 1;
+        }
+
+        std::vector<uint8_t> data;
+        uint8_t buffer[65536];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            data.insert(data.end(), buffer, buffer + length);
+        }
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+
+    printf("Ran %d input%s\n", argc - 1, argc == 2 ? "" : "s");
+    return 0;
+}
+
+#endif
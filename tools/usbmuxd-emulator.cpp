@@ -0,0 +1,601 @@
+/*
+ usbmuxd-emulator
+ Copyright (C) 2018    Will Townsend <will@townsend.io>
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program. If not, see <https://www.gnu.org/licenses/>
+ */
+
+// A stand-in for usbmuxd with a single fake device attached, so that the
+// plugin (or anything else using libusbmuxd) can be run without a phone.
+//
+// It speaks the plist protocol libusbmuxd uses (Listen, ListDevices, Connect
+// and the Attached/Detached events) on the unix socket given by
+// USBMUXD_SOCKET_ADDRESS, which libusbmuxd reads too. Requests can be XML or
+// binary plists, and are answered in the same format, unless --xml-only makes
+// it act like a daemon that drops clients sending binary ones:
+//
+//     USBMUXD_SOCKET_ADDRESS=UNIX:/tmp/usbmuxd.sock usbmuxd-emulator --fps 60 capture.portal
+//
+// A connection to the device's port gets the Portal frames from the
+// recording, which is just the byte stream the phone sends: a sequence of
+// 16 byte big endian headers, each followed by its payload. A capture
+// recorded by the plugin (see portal's Capture.hpp) works as well, as its
+// records are the same frames with a receive time in front. Video frames are
+// paced at the given rate, everything else is sent as soon as it is reached.
+// SIGUSR1 unplugs the device, or plugs it back in. SIGUSR2 breaks the
+// connections to it but leaves it plugged in, as restarting the app does.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <plist/plist.h>
+#include <usbmuxd-proto.h>
+
+static const uint32_t DeviceID = 1;
+static const uint32_t ProductID = 0x12a8;
+
+struct Frame {
+    size_t offset;
+    size_t size;
+    // A coded video picture, which is what the frame rate applies to.
+    bool isPicture;
+};
+
+struct Options {
+    const char *socketPath = NULL;
+    const char *recordingPath = NULL;
+    const char *serial = "0000000000000000000000000000000000000000";
+    double fps = 60.0;
+    int port = 2349;
+    bool loop = false;
+    bool xmlOnly = false;
+    // Connections to refuse before accepting any, as if the app had only
+    // just been opened.
+    int refuse = 0;
+};
+
+static Options options;
+static std::vector<char> recording;
+static std::vector<Frame> frames;
+
+static std::atomic<bool> running{true};
+static std::atomic<bool> toggleRequested{false};
+static std::atomic<bool> dropRequested{false};
+
+struct Listener {
+    int fd;
+    // Whether it sent Listen as a binary plist, so wants events in binary.
+    bool binary;
+};
+
+// The sockets that sent Listen, and the ones streaming from the device.
+static std::mutex mutex;
+static std::vector<Listener> listeners;
+static std::vector<int> streams;
+static bool attached = true;
+
+static uint32_t readUInt32BigEndian(const char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+static bool loadRecording(const char *path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    recording.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    // A capture has a 16 byte file header, and 8 bytes of receive time
+    // before each frame that aren't sent.
+    const bool isCapture = recording.size() >= 16 && memcmp(recording.data(), "HSPORTAL", 8) == 0;
+    const size_t recordHeaderSize = isCapture ? 8 : 0;
+
+    size_t offset = isCapture ? 16 : 0;
+    while (offset + recordHeaderSize + 16 <= recording.size()) {
+        offset += recordHeaderSize;
+
+        const uint32_t type = readUInt32BigEndian(recording.data() + offset + 4);
+        const uint32_t payloadSize = readUInt32BigEndian(recording.data() + offset + 12);
+
+        if (offset + 16 + payloadSize > recording.size()) {
+            offset -= recordHeaderSize;
+            break;
+        }
+
+        // Each video payload is one NAL unit behind a 4 byte start code, with
+        // the capture time in front of it in timestamped frames.
+        size_t nalOffset = offset + 16 + 4;
+        if (type == 110) {
+            nalOffset += 8;
+        }
+
+        bool isPicture = false;
+        if ((type == 101 || type == 110) && nalOffset < offset + 16 + payloadSize) {
+            const int naluType = recording[nalOffset] & 0x1F;
+            isPicture = naluType == 1 || naluType == 5;
+        }
+
+        frames.push_back(Frame{offset, 16 + (size_t)payloadSize, isPicture});
+        offset += 16 + payloadSize;
+    }
+
+    if (offset != recording.size()) {
+        fprintf(stderr, "Ignoring %zu bytes of truncated frame at the end of %s\n", recording.size() - offset, path);
+    }
+
+    fprintf(stderr, "Loaded %zu frames from %s\n", frames.size(), path);
+    return !frames.empty();
+}
+
+static bool sendAll(int fd, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t received = recv(fd, data, length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        length -= (size_t)received;
+    }
+    return true;
+}
+
+static bool sendPlist(int fd, uint32_t tag, plist_t plist, bool binary)
+{
+    char *data = NULL;
+    uint32_t length = 0;
+    if (binary) {
+        plist_to_bin(plist, &data, &length);
+    } else {
+        plist_to_xml(plist, &data, &length);
+    }
+
+    struct usbmuxd_header header;
+    header.length = sizeof(header) + length;
+    header.version = 1;
+    header.message = MESSAGE_PLIST;
+    header.tag = tag;
+
+    std::vector<char> message(sizeof(header) + length);
+    memcpy(message.data(), &header, sizeof(header));
+    memcpy(message.data() + sizeof(header), data, length);
+    free(data);
+
+    return sendAll(fd, message.data(), message.size());
+}
+
+static bool sendResult(int fd, uint32_t tag, uint32_t result, bool binary)
+{
+    plist_t plist = plist_new_dict();
+    plist_dict_set_item(plist, "MessageType", plist_new_string("Result"));
+    plist_dict_set_item(plist, "Number", plist_new_uint(result));
+    bool success = sendPlist(fd, tag, plist, binary);
+    plist_free(plist);
+    return success;
+}
+
+static plist_t createDeviceProperties()
+{
+    plist_t properties = plist_new_dict();
+    plist_dict_set_item(properties, "ConnectionSpeed", plist_new_uint(480000000));
+    plist_dict_set_item(properties, "ConnectionType", plist_new_string("USB"));
+    plist_dict_set_item(properties, "DeviceID", plist_new_uint(DeviceID));
+    plist_dict_set_item(properties, "LocationID", plist_new_uint(0));
+    plist_dict_set_item(properties, "ProductID", plist_new_uint(ProductID));
+    plist_dict_set_item(properties, "SerialNumber", plist_new_string(options.serial));
+    return properties;
+}
+
+static plist_t createAttached()
+{
+    plist_t plist = plist_new_dict();
+    plist_dict_set_item(plist, "MessageType", plist_new_string("Attached"));
+    plist_dict_set_item(plist, "DeviceID", plist_new_uint(DeviceID));
+    plist_dict_set_item(plist, "Properties", createDeviceProperties());
+    return plist;
+}
+
+static plist_t createDetached()
+{
+    plist_t plist = plist_new_dict();
+    plist_dict_set_item(plist, "MessageType", plist_new_string("Detached"));
+    plist_dict_set_item(plist, "DeviceID", plist_new_uint(DeviceID));
+    return plist;
+}
+
+static void setAttached(bool value)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (attached == value) {
+        return;
+    }
+    attached = value;
+
+    fprintf(stderr, "Device %s\n", attached ? "attached" : "detached");
+
+    plist_t event = attached ? createAttached() : createDetached();
+    for (const Listener &listener : listeners) {
+        sendPlist(listener.fd, 0, event, listener.binary);
+    }
+    plist_free(event);
+
+    // Unplugging the device breaks its connections.
+    if (!attached) {
+        for (int fd : streams) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+}
+
+static void dropStreams()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    fprintf(stderr, "Dropping %zu connection%s\n", streams.size(), streams.size() == 1 ? "" : "s");
+    for (int fd : streams) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+static void removeFrom(std::vector<int> &fds, int fd)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = fds.begin(); it != fds.end(); ++it) {
+        if (*it == fd) {
+            fds.erase(it);
+            break;
+        }
+    }
+}
+
+static void streamRecording(int fd)
+{
+    const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / options.fps));
+    auto next = std::chrono::steady_clock::now();
+    char discard[4096];
+
+    do {
+        for (const Frame &frame : frames) {
+            if (!running) {
+                return;
+            }
+
+            if (frame.isPicture) {
+                std::this_thread::sleep_until(next);
+                next += interval;
+
+                // Don't try to catch up after a stall, just carry on from now.
+                const auto now = std::chrono::steady_clock::now();
+                if (now > next + std::chrono::seconds(1)) {
+                    next = now;
+                }
+            }
+
+            if (!sendAll(fd, recording.data() + frame.offset, frame.size)) {
+                return;
+            }
+
+            // Throw away the control frames the plugin sends to the phone.
+            while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {}
+        }
+    } while (options.loop);
+}
+
+static bool getUInt(plist_t dict, const char *key, uint64_t *value)
+{
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node == NULL || plist_get_node_type(node) != PLIST_UINT) {
+        return false;
+    }
+    plist_get_uint_val(node, value);
+    return true;
+}
+
+static void handleClient(int fd)
+{
+    bool isListener = false;
+
+    while (running) {
+        struct usbmuxd_header header;
+        if (!receiveAll(fd, (char *)&header, sizeof(header)) || header.length < sizeof(header)) {
+            break;
+        }
+
+        std::vector<char> payload(header.length - sizeof(header));
+        if (!payload.empty() && !receiveAll(fd, payload.data(), payload.size())) {
+            break;
+        }
+
+        if (header.message != MESSAGE_PLIST) {
+            // Only the plist protocol is supported, which makes libusbmuxd
+            // retry with it.
+            struct usbmuxd_result_msg result;
+            result.header.length = sizeof(result);
+            result.header.version = 0;
+            result.header.message = MESSAGE_RESULT;
+            result.header.tag = header.tag;
+            result.result = RESULT_BADVERSION;
+            sendAll(fd, (const char *)&result, sizeof(result));
+            continue;
+        }
+
+        const bool binary = plist_is_binary(payload.data(), (uint32_t)payload.size());
+        if (binary && options.xmlOnly) {
+            break;
+        }
+
+        plist_t request = NULL;
+        plist_from_memory(payload.data(), (uint32_t)payload.size(), &request);
+        if (request == NULL) {
+            break;
+        }
+
+        char *messageType = NULL;
+        plist_t node = plist_dict_get_item(request, "MessageType");
+        if (node != NULL && plist_get_node_type(node) == PLIST_STRING) {
+            plist_get_string_val(node, &messageType);
+        }
+        const std::string type = messageType ? messageType : "";
+        free(messageType);
+
+        if (type == "Listen") {
+            std::lock_guard<std::mutex> lock(mutex);
+            sendResult(fd, header.tag, RESULT_OK, binary);
+            if (attached) {
+                plist_t event = createAttached();
+                sendPlist(fd, 0, event, binary);
+                plist_free(event);
+            }
+            listeners.push_back(Listener{fd, binary});
+            isListener = true;
+        } else if (type == "ListDevices") {
+            plist_t list = plist_new_array();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (attached) {
+                    plist_array_append_item(list, createAttached());
+                }
+            }
+            plist_t response = plist_new_dict();
+            plist_dict_set_item(response, "DeviceList", list);
+            sendPlist(fd, header.tag, response, binary);
+            plist_free(response);
+        } else if (type == "ReadBUID") {
+            plist_t response = plist_new_dict();
+            plist_dict_set_item(response, "BUID", plist_new_string("00000000-0000-0000-0000-000000000000"));
+            sendPlist(fd, header.tag, response, binary);
+            plist_free(response);
+        } else if (type == "Connect") {
+            uint64_t deviceID = 0;
+            uint64_t port = 0;
+            getUInt(request, "DeviceID", &deviceID);
+            getUInt(request, "PortNumber", &port);
+            plist_free(request);
+
+            // The port is sent in network byte order.
+            port = ntohs((uint16_t)port);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (deviceID != DeviceID || !attached) {
+                    sendResult(fd, header.tag, RESULT_BADDEV, binary);
+                    break;
+                }
+                if ((int)port != options.port || options.refuse > 0) {
+                    if (options.refuse > 0) {
+                        options.refuse--;
+                        fprintf(stderr, "Refused client %d, %d refusal%s left\n", fd, options.refuse, options.refuse == 1 ? "" : "s");
+                    }
+                    sendResult(fd, header.tag, RESULT_CONNREFUSED, binary);
+                    break;
+                }
+                sendResult(fd, header.tag, RESULT_OK, binary);
+                streams.push_back(fd);
+            }
+
+            // From here on the socket is a connection to the device.
+            fprintf(stderr, "Streaming to client %d\n", fd);
+            streamRecording(fd);
+            fprintf(stderr, "Stopped streaming to client %d\n", fd);
+
+            removeFrom(streams, fd);
+            break;
+        } else {
+            sendResult(fd, header.tag, RESULT_BADCOMMAND, binary);
+        }
+
+        plist_free(request);
+    }
+
+    if (isListener) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = listeners.begin(); it != listeners.end(); ++it) {
+            if (it->fd == fd) {
+                listeners.erase(it);
+                break;
+            }
+        }
+    }
+    close(fd);
+}
+
+static void handleSignal(int signal)
+{
+    if (signal == SIGUSR1) {
+        toggleRequested = true;
+    } else if (signal == SIGUSR2) {
+        dropRequested = true;
+    } else {
+        running = false;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: USBMUXD_SOCKET_ADDRESS=UNIX:<path> %s [options] <recording>\n"
+            "\n"
+            "  --fps <n>        Video frames per second (default 60)\n"
+            "  --loop           Start the recording again when it ends\n"
+            "  --port <n>       The device port that can be connected to (default 2349)\n"
+            "  --refuse <n>     Refuse the first n connections to the port\n"
+            "  --serial <udid>  The serial number of the device\n"
+            "  --xml-only       Drop clients that send binary plists, like older daemons\n"
+            "\n"
+            "Send SIGUSR1 to unplug the device, or plug it back in, and SIGUSR2 to\n"
+            "break the connections to it.\n", name);
+}
+
+static bool parseOptions(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (arg == "--fps" && hasValue) {
+            options.fps = atof(argv[++i]);
+        } else if (arg == "--loop") {
+            options.loop = true;
+        } else if (arg == "--port" && hasValue) {
+            options.port = atoi(argv[++i]);
+        } else if (arg == "--refuse" && hasValue) {
+            options.refuse = atoi(argv[++i]);
+        } else if (arg == "--serial" && hasValue) {
+            options.serial = argv[++i];
+        } else if (arg == "--xml-only") {
+            options.xmlOnly = true;
+        } else if (arg[0] != '-' && options.recordingPath == NULL) {
+            options.recordingPath = argv[i];
+        } else {
+            return false;
+        }
+    }
+
+    const char *address = getenv("USBMUXD_SOCKET_ADDRESS");
+    if (address == NULL || strncmp(address, "UNIX:", 5) != 0 || address[5] == '\0') {
+        fprintf(stderr, "USBMUXD_SOCKET_ADDRESS must be set to UNIX:<path>\n");
+        return false;
+    }
+    options.socketPath = address + 5;
+
+    return options.recordingPath != NULL && options.fps > 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (!parseOptions(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!loadRecording(options.recordingPath)) {
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(options.socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long\n");
+        return 1;
+    }
+    strcpy(address.sun_path, options.socketPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(options.socketPath);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenFd, 16) != 0) {
+        perror("Could not listen on the socket");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    signal(SIGUSR1, handleSignal);
+    signal(SIGUSR2, handleSignal);
+
+    fprintf(stderr, "Listening on %s\n", options.socketPath);
+
+    while (running) {
+        if (toggleRequested.exchange(false)) {
+            bool value;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                value = !attached;
+            }
+            setAttached(value);
+        }
+
+        if (dropRequested.exchange(false)) {
+            dropStreams();
+        }
+
+        struct pollfd pfd = {listenFd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd >= 0) {
+            std::thread(handleClient, fd).detach();
+        }
+    }
+
+    close(listenFd);
+    unlink(options.socketPath);
+
+    return 0;
+}